@@ -0,0 +1,293 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <mutex>
+#include "Reactor.hpp"
+#include "AdmissionControl.hpp"
+
+/*
+ * Plaintext admin endpoint: GET /metrics answers with every registered reactor's
+ * ReactorMetrics in the Prometheus text format, anything else gets a 404. One request
+ * per connection, closed once the answer is sent. Runs on the reactor it is given, the
+ * metrics of the other reactors are read from there without stopping them.
+ */
+class AdminServer : public std::enable_shared_from_this<AdminServer>, noncopyable
+{
+public:
+	AdminServer() = delete;
+	explicit AdminServer(SpReactor re);
+	bool Listen(int port);
+	void AddReactor(SpReactor re);
+	// exports its counters; the admin listener also sheds connections through it when out of fds
+	void SetAdmission(SpAdmissionControl admission);
+	// the body served on /metrics
+	std::string Render();
+private:
+	static void onAccept(SpChannel chan);
+	static void onSent(SpChannel chan);
+	void onRequest(SpChannel chan);
+private:
+	static const size_t kMaxRequestSize = 8192;
+	SpReactor _reactor;
+	std::mutex _mutex;
+	std::vector<SpReactor> _reactors;		// guarded by _mutex
+	SpAdmissionControl _admission;			// guarded by _mutex
+	SpChannel _listener;
+};
+
+AdminServer::AdminServer(SpReactor re) :
+	_reactor(re)
+{
+}
+
+bool AdminServer::Listen(int port)
+{
+	_listener = CreateSpChannelListen(port, shared_from_this(), onAccept, nullptr);
+	if (!_listener) {
+		return false;
+	}
+	_reactor->AddChannel(_listener, ChannelEvent_e::IN);
+	minilog(LogLevel_e::INFO, "admin endpoint on port %d", port);
+	return true;
+}
+
+void AdminServer::AddReactor(SpReactor re)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_reactors.emplace_back(re);
+}
+
+void AdminServer::SetAdmission(SpAdmissionControl admission)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_admission = admission;
+}
+
+void AdminServer::onAccept(SpChannel chan)
+{
+	auto admin = std::static_pointer_cast<AdminServer>(chan->GetSpPrivData());
+	if (!admin) {
+		return;
+	}
+	SpAdmissionControl admission;
+	{
+		std::lock_guard<std::mutex> lock(admin->_mutex);
+		admission = admin->_admission;
+	}
+	std::weak_ptr<AdminServer> weak = admin;
+	while (true) {
+		sockaddr_in peer = {};
+		int savedErrno = 0;
+		int fd = admission ? admission->Accept(*chan, &peer, &savedErrno) : chan->Accept(&peer, &savedErrno);
+		if (fd < 0) {
+			if (savedErrno == EINTR) {
+				continue;
+			}
+			if (admission && (savedErrno == EMFILE || savedErrno == ENFILE)) {
+				admission->PauseListener(admin->_reactor, chan);
+			}
+			break;
+		}
+		SpChannel client = admin->_reactor->CreateChannel(fd, [weak](SpChannel c) {
+			if (auto self = weak.lock()) {
+				self->onRequest(c);
+			}
+		}, onSent, nullptr);
+		admin->_reactor->AddChannel(client, ChannelEvent_e::IN);
+	}
+}
+
+void AdminServer::onRequest(SpChannel chan)
+{
+	Buffer& recvBuffer = chan->GetRecvBuffer();
+	while (true) {
+		int savedErrno = 0;
+		ssize_t n = chan->Recv(&savedErrno);
+		if (n == 0 || (n < 0 && savedErrno != EAGAIN && savedErrno != EINTR)) {
+			_reactor->DelChannel(chan);
+			return;
+		}
+		if (n < 0) {
+			break;
+		}
+	}
+	size_t len = recvBuffer.ReadableBytes();
+	if (len == 0) {
+		return;
+	}
+	std::string request(recvBuffer.Pullup(len), len);
+	if (request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos) {
+		if (len > kMaxRequestSize) {
+			_reactor->DelChannel(chan);
+		}
+		return;
+	}
+	recvBuffer.RetrieveAll();
+	std::string line = request.substr(0, request.find_first_of("\r\n"));
+	std::string status = "200 OK";
+	std::string body;
+	if (line == "GET /metrics" || line.compare(0, 13, "GET /metrics ") == 0) {
+		body = Render();
+	}
+	else {
+		status = "404 Not Found";
+		body = "try /metrics\n";
+	}
+	chan->AppendSendBuffer("HTTP/1.0 " + status + "\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: " + std::to_string(body.size()) + "\r\n"
+		"Connection: close\r\n\r\n");
+	chan->AppendSendBuffer(body);
+	_reactor->EnableEvents(chan, ChannelEvent_e::OUT);
+}
+
+void AdminServer::onSent(SpChannel chan)
+{
+	SpReactor re = std::static_pointer_cast<Reactor>(chan->GetSpPrivData());
+	int savedErrno = 0;
+	while (!chan->GetSendBuffer().Empty()) {
+		ssize_t n = chan->Flush(&savedErrno);
+		if (n < 0 && savedErrno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+	}
+	if (chan->GetSendBuffer().Empty() || (savedErrno != 0 && savedErrno != EAGAIN)) {
+		re->DelChannel(chan);
+	}
+}
+
+struct MetricCounterDesc
+{
+	const char* name;
+	const char* help;
+	MetricCounter ReactorMetrics::* counter;
+	double scale;
+};
+
+struct MetricSummaryDesc
+{
+	const char* name;
+	const char* help;
+	AtomicHistogram ReactorMetrics::* hist;
+	double scale;
+};
+
+static void append_metric(std::string& out, const char* name, const std::string& labels, double value)
+{
+	char line[256];
+	// whole numbers (counts, bytes) in full, the rest with 9 significant digits
+	const char* fmt = value == static_cast<double>(static_cast<uint64_t>(value)) ? "%s{%s} %.0f\n" : "%s{%s} %.9g\n";
+	snprintf(line, sizeof(line), fmt, name, labels.c_str(), value);
+	out += line;
+}
+
+static void append_family(std::string& out, const char* name, const char* type, const char* help)
+{
+	out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+}
+
+std::string AdminServer::Render()
+{
+	static const MetricCounterDesc counters[] = {
+		{ "mini_polls_total", "Poller waits.", &ReactorMetrics::polls, 1 },
+		{ "mini_empty_polls_total", "Poller waits that returned no event.", &ReactorMetrics::emptyPolls, 1 },
+		{ "mini_events_total", "Events or completions dispatched.", &ReactorMetrics::events, 1 },
+		{ "mini_wakeups_total", "Eventfd wakeups by other threads.", &ReactorMetrics::wakeups, 1 },
+		{ "mini_accepts_total", "Connections accepted.", &ReactorMetrics::accepts, 1 },
+		{ "mini_received_bytes_total", "Bytes received.", &ReactorMetrics::bytesIn, 1 },
+		{ "mini_sent_bytes_total", "Bytes sent.", &ReactorMetrics::bytesOut, 1 },
+		{ "mini_functors_total", "Pending functors run.", &ReactorMetrics::functors, 1 },
+		{ "mini_read_pauses_total", "Channels that stopped reading because their output backed up.", &ReactorMetrics::readPauses, 1 },
+		{ "mini_callback_seconds_total", "Time spent in channel callbacks.", &ReactorMetrics::callbackNs, 1e-9 },
+		{ "mini_functor_seconds_total", "Time spent in pending functors.", &ReactorMetrics::functorNs, 1e-9 },
+		{ "mini_spin_seconds_total", "Time spent busy polling.", &ReactorMetrics::spinNs, 1e-9 },
+		{ "mini_sleep_seconds_total", "Time blocked in the poller while busy polling is on.", &ReactorMetrics::sleepNs, 1e-9 },
+		{ "mini_spin_hits_total", "Busy polls that found events.", &ReactorMetrics::spinHits, 1 },
+	};
+	static const MetricSummaryDesc summaries[] = {
+		{ "mini_events_per_poll", "Events dispatched per non-empty wait.", &ReactorMetrics::eventsPerPoll, 1 },
+		{ "mini_callback_batch_seconds", "Callbacks run for one wait.", &ReactorMetrics::callbackBatchNs, 1e-9 },
+		{ "mini_functor_queue_depth", "Functors queued when the reactor drained them.", &ReactorMetrics::functorBatch, 1 },
+		{ "mini_loop_busy_seconds", "Busy part of a loop iteration.", &ReactorMetrics::loopNs, 1e-9 },
+	};
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+	std::vector<SpReactor> reactors;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		reactors = _reactors;
+	}
+	std::vector<std::string> labels;
+	for (auto& re : reactors) {
+		labels.emplace_back("reactor=\"" + re->GetName() + "\"");
+	}
+
+	std::string out;
+	for (auto& desc : counters) {
+		append_family(out, desc.name, "counter", desc.help);
+		for (size_t i = 0; i < reactors.size(); i++) {
+			append_metric(out, desc.name, labels[i], (reactors[i]->GetMetrics().*desc.counter).Get() * desc.scale);
+		}
+	}
+	append_family(out, "mini_channels", "gauge", "Channels in the reactor's poller.");
+	for (size_t i = 0; i < reactors.size(); i++) {
+		append_metric(out, "mini_channels", labels[i], reactors[i]->GetChannelNum());
+	}
+	append_family(out, "mini_output_buffered_bytes", "gauge", "Bytes waiting in the reactor's send buffers.");
+	for (size_t i = 0; i < reactors.size(); i++) {
+		append_metric(out, "mini_output_buffered_bytes", labels[i], reactors[i]->GetOutputBuffered());
+	}
+	append_family(out, "mini_pool_free_objects", "gauge", "Objects cached in the reactor's memory pools.");
+	for (size_t i = 0; i < reactors.size(); i++) {
+		append_metric(out, "mini_pool_free_objects", labels[i] + ",pool=\"channel\"", reactors[i]->GetChannelPoolStats().freeCount);
+		append_metric(out, "mini_pool_free_objects", labels[i] + ",pool=\"block\"", reactors[i]->GetBlockPoolStats().freeCount);
+		append_metric(out, "mini_pool_free_objects", labels[i] + ",pool=\"frame\"", reactors[i]->GetFramePoolStats().freeCount);
+	}
+	for (auto& desc : summaries) {
+		append_family(out, desc.name, "summary", desc.help);
+		std::string sumName = std::string(desc.name) + "_sum";
+		std::string countName = std::string(desc.name) + "_count";
+		for (size_t i = 0; i < reactors.size(); i++) {
+			Histogram hist;
+			(reactors[i]->GetMetrics().*desc.hist).Snapshot(hist);
+			for (double q : quantiles) {
+				char label[32];
+				snprintf(label, sizeof(label), ",quantile=\"%g\"", q);
+				append_metric(out, desc.name, labels[i] + label, hist.Percentile(q * 100) * desc.scale);
+			}
+			append_metric(out, sumName.c_str(), labels[i], hist.Mean() * hist.Count() * desc.scale);
+			append_metric(out, countName.c_str(), labels[i], hist.Count());
+		}
+	}
+	SpAdmissionControl admission;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		admission = _admission;
+	}
+	if (admission) {
+		AdmissionStats stats = admission->GetStats();
+		append_family(out, "mini_connections", "gauge", "Connections admitted and still open.");
+		out += "mini_connections " + std::to_string(stats.connections) + "\n";
+		append_family(out, "mini_connections_refused_total", "counter", "Connections closed right after accept.");
+		out += "mini_connections_refused_total{reason=\"limit\"} " + std::to_string(stats.rejected) + "\n";
+		out += "mini_connections_refused_total{reason=\"fds\"} " + std::to_string(stats.shed) + "\n";
+		append_family(out, "mini_listener_pauses_total", "counter", "Times a listener stopped accepting for a while.");
+		out += "mini_listener_pauses_total " + std::to_string(stats.pauses) + "\n";
+	}
+	LogStats log = Logger::Instance()->GetStats();
+	append_family(out, "mini_log_lines_total", "counter", "Log lines accepted.");
+	out += "mini_log_lines_total " + std::to_string(log.written) + "\n";
+	append_family(out, "mini_log_dropped_total", "counter", "Log lines lost to full rings.");
+	out += "mini_log_dropped_total " + std::to_string(log.dropped) + "\n";
+	return out;
+}
+
+/*--------------- shared_ptr -----------*/
+using SpAdminServer = std::shared_ptr<AdminServer>;
+SpAdminServer CreateSpAdminServer(SpReactor re)
+{
+	return std::make_shared<AdminServer>(re);
+}
@@ -0,0 +1,196 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <fcntl.h>
+#include "utils.h"
+#include "MiniLog.hpp"
+#include "Reactor.hpp"
+
+static const uint64_t kDefaultListenPauseMs = 100;
+
+struct AdmissionStats
+{
+	size_t connections;		// admitted and not released yet
+	uint64_t rejected;		// over a connection limit, closed right after accept
+	uint64_t shed;			// accepted with the spare fd while out of descriptors, closed
+	uint64_t pauses;		// times a listener stopped accepting for a while
+};
+
+// held by an admitted connection, its slot is given back when the last copy goes
+using AdmissionTicket = std::shared_ptr<void>;
+
+/*
+ * Keeps the accepting side from melting down under a connection flood:
+ *
+ *  - at most maxConnections connections in total and maxPerReactor on any one reactor,
+ *    a connection over either limit is closed right after accept, unless the caller
+ *    names other reactors that still have room;
+ *  - out of descriptors (EMFILE / ENFILE) the pending connection is taken with a spare
+ *    fd kept open for that and closed at once, otherwise it stays in the backlog and a
+ *    level triggered listener is readable forever;
+ *  - in both cases the caller pauses the listener for a while with PauseListener, new
+ *    connections wait in the backlog instead of costing a wakeup each.
+ *
+ * Limits of 0 mean none. Thread safe, the listeners of several reactors may share one.
+ */
+class AdmissionControl : public std::enable_shared_from_this<AdmissionControl>, noncopyable
+{
+public:
+	explicit AdmissionControl(size_t maxConnections = 0, size_t maxPerReactor = 0, uint64_t pauseMs = kDefaultListenPauseMs);
+	~AdmissionControl();
+	// Channel::Accept plus the spare fd trick, the errno is still reported
+	int Accept(Channel& listener, sockaddr_in* peer, int* savedErrno);
+	// a ticket when re may take one more connection, null (and counted) when not
+	AdmissionTicket Admit(const SpReactor& re);
+	// as Admit, but when only *re is full the next reactor of fallbacks with room gets the
+	// connection and *re is set to it; null once the total is reached or all of them are full
+	AdmissionTicket Admit(SpReactor* re, const std::vector<SpReactor>& fallbacks);
+	// stops re's listener reading for the pause time, on re's thread
+	void PauseListener(const SpReactor& re, const SpChannel& listener);
+	AdmissionStats GetStats() const;
+private:
+	AdmissionTicket ticket(const Reactor* re);
+	void release(const Reactor* re);
+	void shed(Channel& listener);
+private:
+	size_t _maxConnections;
+	size_t _maxPerReactor;
+	uint64_t _pauseMs;
+	std::mutex _mutex;
+	std::unordered_map<const Reactor*, size_t> _perReactor;	// guarded by _mutex
+	int _spareFd;											// guarded by _mutex
+	std::atomic<size_t> _connections;
+	std::atomic<uint64_t> _rejected;
+	std::atomic<uint64_t> _shed;
+	std::atomic<uint64_t> _pauses;
+};
+
+AdmissionControl::AdmissionControl(size_t maxConnections, size_t maxPerReactor, uint64_t pauseMs) :
+	_maxConnections(maxConnections),
+	_maxPerReactor(maxPerReactor),
+	_pauseMs(pauseMs),
+	_spareFd(open("/dev/null", O_RDONLY | O_CLOEXEC)),
+	_connections(0),
+	_rejected(0),
+	_shed(0),
+	_pauses(0)
+{
+}
+
+AdmissionControl::~AdmissionControl()
+{
+	if (_spareFd >= 0) {
+		close(_spareFd);
+	}
+}
+
+int AdmissionControl::Accept(Channel& listener, sockaddr_in* peer, int* savedErrno)
+{
+	int fd = listener.Accept(peer, savedErrno);
+	if (fd < 0 && (*savedErrno == EMFILE || *savedErrno == ENFILE)) {
+		shed(listener);
+	}
+	return fd;
+}
+
+// gives up the spare fd for long enough to take one connection off the backlog and close it
+void AdmissionControl::shed(Channel& listener)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_spareFd < 0) {
+		return;
+	}
+	close(_spareFd);
+	int fd = accept4(listener.GetSocket(), nullptr, nullptr, SOCK_CLOEXEC);
+	if (fd >= 0) {
+		close(fd);
+		_shed.fetch_add(1, std::memory_order_relaxed);
+	}
+	_spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	minilog(LogLevel_e::WARRNIG, "out of file descriptors, connection dropped");
+}
+
+AdmissionTicket AdmissionControl::Admit(const SpReactor& re)
+{
+	SpReactor target = re;
+	return Admit(&target, {});
+}
+
+AdmissionTicket AdmissionControl::Admit(SpReactor* re, const std::vector<SpReactor>& fallbacks)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		size_t total = _connections.load(std::memory_order_relaxed);
+		if (_maxConnections == 0 || total < _maxConnections) {
+			// *re first, then the fallbacks from the one after it, so that the spill spreads
+			size_t n = fallbacks.size();
+			size_t start = std::find(fallbacks.begin(), fallbacks.end(), *re) - fallbacks.begin();
+			for (size_t i = 0; i <= n; i++) {
+				const SpReactor& candidate = i == 0 ? *re : fallbacks[(start + i) % n];
+				size_t& onReactor = _perReactor[candidate.get()];
+				if (_maxPerReactor == 0 || onReactor < _maxPerReactor) {
+					onReactor++;
+					_connections.store(total + 1, std::memory_order_relaxed);
+					*re = candidate;
+					return ticket(re->get());
+				}
+			}
+		}
+		_rejected.fetch_add(1, std::memory_order_relaxed);
+	}
+	return nullptr;
+}
+
+AdmissionTicket AdmissionControl::ticket(const Reactor* key)
+{
+	// any non null pointer will do, only the deleter matters; it may outlive this object
+	std::weak_ptr<AdmissionControl> weak = shared_from_this();
+	return AdmissionTicket(static_cast<void*>(this), [weak, key](void*) {
+		if (auto self = weak.lock()) {
+			self->release(key);
+		}
+	});
+}
+
+void AdmissionControl::release(const Reactor* re)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_perReactor[re]--;
+	_connections.store(_connections.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+}
+
+void AdmissionControl::PauseListener(const SpReactor& re, const SpChannel& listener)
+{
+	_pauses.fetch_add(1, std::memory_order_relaxed);
+	minilog(LogLevel_e::WARRNIG, "[%s] not accepting for %d ms, %d connections", re->GetName().c_str(),
+		static_cast<int>(_pauseMs), static_cast<int>(_connections.load(std::memory_order_relaxed)));
+	re->DisableEvents(listener, ChannelEvent_e::IN);
+	std::weak_ptr<Reactor> weakRe = re;
+	std::weak_ptr<Channel> weakChan = listener;
+	re->RunAfter(_pauseMs, [weakRe, weakChan]() {
+		SpReactor re = weakRe.lock();
+		SpChannel chan = weakChan.lock();
+		if (re && chan && chan->InPoller()) {
+			re->EnableEvents(chan, ChannelEvent_e::IN);
+		}
+	});
+}
+
+AdmissionStats AdmissionControl::GetStats() const
+{
+	AdmissionStats stats;
+	stats.connections = _connections.load(std::memory_order_relaxed);
+	stats.rejected = _rejected.load(std::memory_order_relaxed);
+	stats.shed = _shed.load(std::memory_order_relaxed);
+	stats.pauses = _pauses.load(std::memory_order_relaxed);
+	return stats;
+}
+
+/*--------------- shared_ptr -----------*/
+using SpAdmissionControl = std::shared_ptr<AdmissionControl>;
+SpAdmissionControl CreateSpAdmissionControl(size_t maxConnections = 0, size_t maxPerReactor = 0,
+	uint64_t pauseMs = kDefaultListenPauseMs)
+{
+	return std::make_shared<AdmissionControl>(maxConnections, maxPerReactor, pauseMs);
+}
@@ -0,0 +1,230 @@
+#pragma once
+#include <deque>
+#include <atomic>
+#include "Connector.hpp"
+
+static const int kAcquireAttempts = 3;			// a connect made for one client gives up after that many
+static const uint64_t kAcquireRetryMs = 20;
+
+struct BackendPoolStats
+{
+	size_t idle;			// connected, waiting for a client
+	size_t connecting;		// refills under way
+	uint64_t hits;			// clients given a warm connection
+	uint64_t misses;		// clients that waited for a connect of their own
+	uint64_t failed;		// of those, the ones that got none
+	uint64_t dropped;		// idle connections the backend closed or talked on, replaced
+};
+
+/*
+ * Warm connections to one backend for one reactor, so that a new client does not wait
+ * for a handshake: the pool keeps warm connected channels idle and opens a replacement
+ * as soon as one is taken. An idle connection that turns readable (the backend closed
+ * it, or says something unasked) is dropped and replaced. Refills that fail are retried
+ * with the Connector's backoff, a backend that is down costs one connect per slot per
+ * backoff, not one per client.
+ *
+ * A connection handed out is the client's, it is not given back. Start and Stop may be
+ * called from any thread, Acquire on the reactor's only; GetStats from anywhere.
+ */
+class BackendPool : public std::enable_shared_from_this<BackendPool>, noncopyable
+{
+public:
+	BackendPool(const SpReactor& re, const sockaddr_in& addr, size_t warm);
+	void Start();
+	// drops the idle connections and the refills under way
+	void Stop();
+	// onReady gets a connected channel, in the poller with no events as from Connector: a
+	// warm one right away, otherwise one connected for this call. nullptr once that failed
+	// kAcquireAttempts times. A warm connection may still turn out closed by the backend
+	// in the meantime, its first read then reports EOF.
+	void Acquire(CallBackFunc onReady);
+	const sockaddr_in& GetAddress() const { return _addr; }
+	BackendPoolStats GetStats() const;
+private:
+	class IdleWatch;
+	void fill();
+	void onFilled(Connector* conn, SpChannel chan);
+	void onIdleEvent(Channel& chan);
+	void removeConnector(Connector* conn);
+private:
+	SpReactor _reactor;
+	sockaddr_in _addr;
+	size_t _warm;
+	// reactor thread only
+	bool _running;
+	std::deque<SpChannel> _idle;
+	std::vector<SpConnector> _filling;	// one per connect under way
+	// mirrors for GetStats
+	std::atomic<size_t> _idleNum;
+	std::atomic<size_t> _fillingNum;
+	std::atomic<uint64_t> _hits;
+	std::atomic<uint64_t> _misses;
+	std::atomic<uint64_t> _failed;
+	std::atomic<uint64_t> _dropped;
+};
+
+// handler of an idle connection; a pool that is gone leaves it to be closed
+class BackendPool::IdleWatch : public ChannelHandler<IdleWatch>
+{
+public:
+	IdleWatch(Reactor* re, std::weak_ptr<BackendPool> pool) : _reactor(re), _pool(std::move(pool)) {}
+	void OnRead(Channel& chan)
+	{
+		if (auto pool = _pool.lock()) {
+			pool->onIdleEvent(chan);
+		}
+		else {
+			_reactor->DelChannel(chan.shared_from_this());
+		}
+	}
+private:
+	Reactor* _reactor;
+	std::weak_ptr<BackendPool> _pool;
+};
+
+BackendPool::BackendPool(const SpReactor& re, const sockaddr_in& addr, size_t warm) :
+	_reactor(re),
+	_addr(addr),
+	_warm(warm),
+	_running(false),
+	_idleNum(0),
+	_fillingNum(0),
+	_hits(0),
+	_misses(0),
+	_failed(0),
+	_dropped(0)
+{
+}
+
+void BackendPool::Start()
+{
+	auto self = shared_from_this();
+	_reactor->PushFunctor([self]() {
+		self->_running = true;
+		self->fill();
+	});
+}
+
+void BackendPool::Stop()
+{
+	auto self = shared_from_this();
+	_reactor->PushFunctor([self]() {
+		self->_running = false;
+		for (auto& conn : self->_filling) {
+			conn->Stop();
+		}
+		for (auto& chan : self->_idle) {
+			self->_reactor->DelChannel(chan);
+		}
+		self->_filling.clear();
+		self->_idle.clear();
+		self->_fillingNum.store(0, std::memory_order_relaxed);
+		self->_idleNum.store(0, std::memory_order_relaxed);
+	});
+}
+
+void BackendPool::fill()
+{
+	std::weak_ptr<BackendPool> weak = shared_from_this();
+	Reactor* re = _reactor.get();
+	while (_running && _idle.size() + _filling.size() < _warm) {
+		SpConnector conn = CreateSpConnector(_reactor, _addr);
+		Connector* raw = conn.get();
+		_filling.push_back(conn);
+		conn->Start([weak, re, raw](SpChannel chan) {
+			if (auto self = weak.lock()) {
+				self->onFilled(raw, chan);
+			}
+			else {
+				re->DelChannel(chan);
+			}
+		});
+	}
+	_fillingNum.store(_filling.size(), std::memory_order_relaxed);
+}
+
+void BackendPool::removeConnector(Connector* conn)
+{
+	for (size_t i = 0; i < _filling.size(); i++) {
+		if (_filling[i].get() == conn) {
+			_filling[i] = std::move(_filling.back());
+			_filling.pop_back();
+			break;
+		}
+	}
+	_fillingNum.store(_filling.size(), std::memory_order_relaxed);
+}
+
+void BackendPool::onFilled(Connector* conn, SpChannel chan)
+{
+	removeConnector(conn);
+	if (!_running) {
+		_reactor->DelChannel(chan);
+		return;
+	}
+	// watched while idle, a backend that hangs up shows as readable
+	chan->SetHandler(std::make_shared<IdleWatch>(_reactor.get(), shared_from_this()));
+	_reactor->EnableEvents(chan, ChannelEvent_e::IN);
+	_idle.push_back(chan);
+	_idleNum.store(_idle.size(), std::memory_order_relaxed);
+}
+
+void BackendPool::onIdleEvent(Channel& chan)
+{
+	auto it = std::find_if(_idle.begin(), _idle.end(), [&chan](const SpChannel& idle) { return idle.get() == &chan; });
+	if (it == _idle.end()) {
+		return;
+	}
+	minilog(LogLevel_e::DEBUG, "[%s] idle connection to %s closed by the backend", _reactor->GetName().c_str(),
+		FormatAddress(_addr).c_str());
+	_reactor->DelChannel(*it);
+	_idle.erase(it);
+	_idleNum.store(_idle.size(), std::memory_order_relaxed);
+	_dropped.fetch_add(1, std::memory_order_relaxed);
+	fill();
+}
+
+void BackendPool::Acquire(CallBackFunc onReady)
+{
+	if (!_idle.empty()) {
+		SpChannel chan = std::move(_idle.front());
+		_idle.pop_front();
+		_idleNum.store(_idle.size(), std::memory_order_relaxed);
+		_hits.fetch_add(1, std::memory_order_relaxed);
+		_reactor->DisableEvents(chan, ChannelEvent_e::IN);
+		fill();
+		onReady(chan);
+		return;
+	}
+	_misses.fetch_add(1, std::memory_order_relaxed);
+	// the callbacks keep the connector alive until it is done, it drops them then
+	SpConnector conn = CreateSpConnector(_reactor, _addr, kAcquireRetryMs, kAcquireRetryMs * 4, kAcquireAttempts);
+	std::weak_ptr<BackendPool> weak = shared_from_this();
+	conn->Start([conn, onReady](SpChannel chan) { onReady(chan); },
+		[conn, onReady, weak](int) {
+			if (auto self = weak.lock()) {
+				self->_failed.fetch_add(1, std::memory_order_relaxed);
+			}
+			onReady(nullptr);
+		});
+}
+
+BackendPoolStats BackendPool::GetStats() const
+{
+	BackendPoolStats stats;
+	stats.idle = _idleNum.load(std::memory_order_relaxed);
+	stats.connecting = _fillingNum.load(std::memory_order_relaxed);
+	stats.hits = _hits.load(std::memory_order_relaxed);
+	stats.misses = _misses.load(std::memory_order_relaxed);
+	stats.failed = _failed.load(std::memory_order_relaxed);
+	stats.dropped = _dropped.load(std::memory_order_relaxed);
+	return stats;
+}
+
+/*--------------- shared_ptr -----------*/
+using SpBackendPool = std::shared_ptr<BackendPool>;
+SpBackendPool CreateSpBackendPool(const SpReactor& re, const sockaddr_in& addr, size_t warm)
+{
+	return std::make_shared<BackendPool>(re, addr, warm);
+}
@@ -0,0 +1,501 @@
+#pragma once
+#include <string>
+#include <algorithm>
+#include <sys/uio.h>
+#include "utils.h"
+#include "MemPool.hpp"
+#include "SharedBuffer.hpp"
+
+/*
+ * A chain of fixed size blocks:
+ *
+ *   head                                         tail
+ *   [prependable | readable] -> [readable] -> ... [readable | writable]
+ *
+ * Data is only copied when it enters the buffer (Append / the overflow part of ReadFd),
+ * partial writes just advance the read index of the head block and whole blocks are
+ * recycled through the owner's MemPool, or a small per-thread free list without one.
+ * A shared block (AppendShared) is only a header pointing at a SharedBuffer's bytes; it is
+ * full from the start, nothing is ever written into it.
+ */
+struct BufferBlock
+{
+	BufferBlock* next;
+	size_t capacity;
+	size_t readIndex;
+	size_t writeIndex;
+	char* base;			// right behind the header, or a SharedBuffer's bytes
+
+	char* Begin() { return base; }
+	bool IsShared() const { return base != reinterpret_cast<const char*>(this + 1); }
+	char* Peek() { return Begin() + readIndex; }
+	char* BeginWrite() { return Begin() + writeIndex; }
+	size_t ReadableBytes() const { return writeIndex - readIndex; }
+	size_t WritableBytes() const { return capacity - writeIndex; }
+};
+
+struct SharedBufferBlock : BufferBlock
+{
+	SpSharedBuffer shared;
+};
+
+static const size_t kBufferBlockAllocSize = 4096;
+static const size_t kBufferBlockSize = kBufferBlockAllocSize - sizeof(BufferBlock);
+static const size_t kMaxCachedBufferBlocks = 256;
+
+struct BufferBlockCache
+{
+	BufferBlock* head = nullptr;
+	size_t count = 0;
+	~BufferBlockCache()
+	{
+		while (head) {
+			BufferBlock* next = head->next;
+			::operator delete(head);
+			head = next;
+		}
+	}
+};
+static thread_local BufferBlockCache tls_buffer_block_cache;
+
+static BufferBlock* alloc_buffer_block(MemPool* pool, size_t capacity = kBufferBlockSize)
+{
+	BufferBlock* block = nullptr;
+	BufferBlockCache& cache = tls_buffer_block_cache;
+	if (capacity <= kBufferBlockSize && pool) {
+		block = static_cast<BufferBlock*>(pool->Alloc(kBufferBlockAllocSize));
+		block->capacity = kBufferBlockSize;
+	}
+	else if (capacity <= kBufferBlockSize && cache.head) {
+		block = cache.head;
+		cache.head = block->next;
+		cache.count--;
+	}
+	else {
+		capacity = std::max(capacity, kBufferBlockSize);
+		block = static_cast<BufferBlock*>(::operator new(sizeof(BufferBlock) + capacity));
+		block->capacity = capacity;
+	}
+	block->next = nullptr;
+	block->readIndex = 0;
+	block->writeIndex = 0;
+	block->base = reinterpret_cast<char*>(block + 1);
+	return block;
+}
+
+static void free_buffer_block(MemPool* pool, BufferBlock* block)
+{
+	BufferBlockCache& cache = tls_buffer_block_cache;
+	if (block->IsShared()) {
+		delete static_cast<SharedBufferBlock*>(block);
+	}
+	else if (block->capacity == kBufferBlockSize && pool) {
+		pool->Free(block, kBufferBlockAllocSize);
+	}
+	else if (block->capacity == kBufferBlockSize && cache.count < kMaxCachedBufferBlocks) {
+		block->next = cache.head;
+		cache.head = block;
+		cache.count++;
+	}
+	else {
+		::operator delete(block);
+	}
+}
+
+class Buffer : noncopyable
+{
+public:
+	static const size_t kCheapPrepend = 8;
+	static const size_t kExtraReadSize = 65536;
+	static const int kMaxIov = 64;
+	static const size_t npos = static_cast<size_t>(-1);
+
+	Buffer();
+	explicit Buffer(MemPool* pool);
+	~Buffer();
+	Buffer(Buffer&&);
+	Buffer& operator=(Buffer&&);
+
+	size_t ReadableBytes() const { return _readable; }
+	bool Empty() const { return _readable == 0; }
+	// contiguous readable bytes at the front, see Pullup to make more of them contiguous
+	const char* Peek() const { return _head ? _head->Peek() : nullptr; }
+	size_t PeekableBytes() const { return _head ? _head->ReadableBytes() : 0; }
+	const char* Pullup(size_t len);
+
+	void Retrieve(size_t len);
+	void RetrieveAll();
+	std::string RetrieveAsString(size_t len);
+	std::string RetrieveAllAsString() { return RetrieveAsString(_readable); }
+
+	void Append(const char* data, size_t len);
+	void Append(const std::string& str) { Append(str.data(), str.size()); }
+	void Append(Buffer& other);			// moves other's blocks to our tail, other is left empty
+	// links shared's bytes in as a block of their own, no copy; ForEachChunk must not write to it
+	void AppendShared(const SpSharedBuffer& shared);
+	void Prepend(const void* data, size_t len);
+
+	// visit every readable chunk in order, f(char* data, size_t len)
+	template <typename F>
+	void ForEachChunk(F f);
+
+	// points vec at up to maxIov readable chunks from the front, maxBytes at most,
+	// returns how many
+	int PeekIov(iovec* vec, int maxIov, size_t maxBytes = npos) const;
+	// offset of the first occurrence of needle at or after from, npos if there is none;
+	// matches may straddle blocks
+	size_t Find(const char* needle, size_t len, size_t from = 0) const;
+
+	ssize_t ReadFd(int fd, int* savedErrno);
+	// the first maxBytes at most
+	ssize_t WriteFd(int fd, int* savedErrno, size_t maxBytes = npos);
+
+	// blocks are taken from and returned to pool, which must outlive the buffer.
+	// All standard blocks have the same size, so blocks spliced in from another buffer may
+	// end up in a different pool than they came from.
+	void SetPool(MemPool* pool);
+private:
+	void appendBlock(BufferBlock* block);
+	static bool matchAt(BufferBlock* block, size_t index, const char* needle, size_t len);
+	void popHead();
+	void clear();
+private:
+	BufferBlock* _head;
+	BufferBlock* _tail;
+	size_t _readable;
+	MemPool* _pool;
+};
+
+Buffer::Buffer() :
+	_head(nullptr),
+	_tail(nullptr),
+	_readable(0),
+	_pool(nullptr)
+{
+
+}
+
+Buffer::Buffer(MemPool* pool) :
+	_head(nullptr),
+	_tail(nullptr),
+	_readable(0),
+	_pool(pool)
+{
+
+}
+
+Buffer::~Buffer()
+{
+	clear();
+}
+
+Buffer::Buffer(Buffer&& other) :
+	_head(other._head),
+	_tail(other._tail),
+	_readable(other._readable),
+	_pool(other._pool)
+{
+	other._head = other._tail = nullptr;
+	other._readable = 0;
+}
+
+Buffer& Buffer::operator=(Buffer&& other)
+{
+	if (this != &other) {
+		clear();
+		std::swap(_head, other._head);
+		std::swap(_tail, other._tail);
+		std::swap(_readable, other._readable);
+	}
+	return *this;
+}
+
+void Buffer::SetPool(MemPool* pool)
+{
+	clear();
+	_pool = pool;
+}
+
+void Buffer::clear()
+{
+	while (_head) {
+		popHead();
+	}
+	_readable = 0;
+}
+
+void Buffer::appendBlock(BufferBlock* block)
+{
+	if (!_head) {
+		block->readIndex = block->writeIndex = kCheapPrepend;
+	}
+	if (_tail) {
+		_tail->next = block;
+	}
+	else {
+		_head = block;
+	}
+	_tail = block;
+}
+
+void Buffer::popHead()
+{
+	BufferBlock* block = _head;
+	_head = block->next;
+	if (!_head) {
+		_tail = nullptr;
+	}
+	free_buffer_block(_pool, block);
+}
+
+const char* Buffer::Pullup(size_t len)
+{
+	len = std::min(len, _readable);
+	if (!_head || _head->ReadableBytes() >= len) {
+		return Peek();
+	}
+	BufferBlock* block = alloc_buffer_block(_pool, len);
+	size_t copied = 0;
+	while (copied < len) {
+		size_t n = std::min(len - copied, _head->ReadableBytes());
+		memcpy(block->BeginWrite(), _head->Peek(), n);
+		block->writeIndex += n;
+		_head->readIndex += n;
+		copied += n;
+		if (_head->ReadableBytes() == 0) {
+			popHead();
+		}
+	}
+	block->next = _head;
+	_head = block;
+	if (!_tail) {
+		_tail = block;
+	}
+	return Peek();
+}
+
+void Buffer::Retrieve(size_t len)
+{
+	len = std::min(len, _readable);
+	_readable -= len;
+	while (len > 0) {
+		size_t n = std::min(len, _head->ReadableBytes());
+		_head->readIndex += n;
+		len -= n;
+		if (_head->ReadableBytes() == 0) {
+			popHead();
+		}
+	}
+}
+
+void Buffer::RetrieveAll()
+{
+	clear();
+}
+
+std::string Buffer::RetrieveAsString(size_t len)
+{
+	len = std::min(len, _readable);
+	std::string str;
+	str.reserve(len);
+	size_t left = len;
+	for (BufferBlock* block = _head; block && left > 0; block = block->next) {
+		size_t n = std::min(left, block->ReadableBytes());
+		str.append(block->Peek(), n);
+		left -= n;
+	}
+	Retrieve(len);
+	return str;
+}
+
+void Buffer::Append(const char* data, size_t len)
+{
+	_readable += len;
+	while (len > 0) {
+		if (!_tail || _tail->WritableBytes() == 0) {
+			appendBlock(alloc_buffer_block(_pool));
+		}
+		size_t n = std::min(len, _tail->WritableBytes());
+		memcpy(_tail->BeginWrite(), data, n);
+		_tail->writeIndex += n;
+		data += n;
+		len -= n;
+	}
+}
+
+void Buffer::Append(Buffer& other)
+{
+	if (other.Empty() || &other == this) {
+		return;
+	}
+	if (_tail) {
+		_tail->next = other._head;
+	}
+	else {
+		_head = other._head;
+	}
+	_tail = other._tail;
+	_readable += other._readable;
+	other._head = other._tail = nullptr;
+	other._readable = 0;
+}
+
+void Buffer::AppendShared(const SpSharedBuffer& shared)
+{
+	if (!shared || shared->Size() == 0) {
+		return;
+	}
+	SharedBufferBlock* block = new SharedBufferBlock();
+	block->next = nullptr;
+	block->capacity = shared->Size();
+	block->readIndex = 0;
+	block->writeIndex = shared->Size();
+	block->base = const_cast<char*>(shared->Data());
+	block->shared = shared;
+	if (_tail) {
+		_tail->next = block;
+	}
+	else {
+		_head = block;
+	}
+	_tail = block;
+	_readable += block->capacity;
+}
+
+void Buffer::Prepend(const void* data, size_t len)
+{
+	if (!_head || _head->IsShared() || _head->readIndex < len) {
+		// filled from its end so that further prepends keep fitting in front
+		BufferBlock* block = alloc_buffer_block(_pool, len);
+		block->readIndex = block->writeIndex = block->capacity;
+		block->next = _head;
+		_head = block;
+		if (!_tail) {
+			_tail = block;
+		}
+	}
+	_head->readIndex -= len;
+	memcpy(_head->Peek(), data, len);
+	_readable += len;
+}
+
+template <typename F>
+void Buffer::ForEachChunk(F f)
+{
+	for (BufferBlock* block = _head; block; block = block->next) {
+		if (block->ReadableBytes() > 0) {
+			f(block->Peek(), block->ReadableBytes());
+		}
+	}
+}
+
+int Buffer::PeekIov(iovec* vec, int maxIov, size_t maxBytes) const
+{
+	int iovcnt = 0;
+	for (BufferBlock* block = _head; block && iovcnt < maxIov && maxBytes > 0; block = block->next) {
+		if (block->ReadableBytes() > 0) {
+			size_t len = std::min(block->ReadableBytes(), maxBytes);
+			vec[iovcnt].iov_base = block->Peek();
+			vec[iovcnt].iov_len = len;
+			maxBytes -= len;
+			iovcnt++;
+		}
+	}
+	return iovcnt;
+}
+
+size_t Buffer::Find(const char* needle, size_t len, size_t from) const
+{
+	if (len == 0 || from + len > _readable) {
+		return npos;
+	}
+	size_t base = 0;
+	for (BufferBlock* block = _head; block; block = block->next) {
+		size_t n = block->ReadableBytes();
+		if (from < base + n) {
+			const char* data = block->Peek();
+			size_t i = from > base ? from - base : 0;
+			while (i < n) {
+				const char* hit = static_cast<const char*>(memchr(data + i, needle[0], n - i));
+				if (!hit) {
+					break;
+				}
+				i = hit - data;
+				if (base + i + len > _readable) {
+					return npos;
+				}
+				if (matchAt(block, i, needle, len)) {
+					return base + i;
+				}
+				i++;
+			}
+		}
+		base += n;
+	}
+	return npos;
+}
+
+bool Buffer::matchAt(BufferBlock* block, size_t index, const char* needle, size_t len)
+{
+	size_t matched = 0;
+	while (block && matched < len) {
+		size_t n = std::min(len - matched, block->ReadableBytes() - index);
+		if (memcmp(block->Peek() + index, needle + matched, n) != 0) {
+			return false;
+		}
+		matched += n;
+		block = block->next;
+		index = 0;
+	}
+	return matched == len;
+}
+
+// readv into the tail block plus a stack overflow area, only the overflow is copied again
+ssize_t Buffer::ReadFd(int fd, int* savedErrno)
+{
+	char extrabuf[kExtraReadSize];
+	if (!_tail || _tail->WritableBytes() == 0) {
+		appendBlock(alloc_buffer_block(_pool));
+	}
+	iovec vec[2];
+	size_t writable = _tail->WritableBytes();
+	vec[0].iov_base = _tail->BeginWrite();
+	vec[0].iov_len = writable;
+	vec[1].iov_base = extrabuf;
+	vec[1].iov_len = sizeof(extrabuf);
+	ssize_t n = readv(fd, vec, 2);
+	if (n < 0) {
+		*savedErrno = errno;
+	}
+	else if (static_cast<size_t>(n) <= writable) {
+		_tail->writeIndex += n;
+		_readable += n;
+	}
+	else {
+		_tail->writeIndex = _tail->capacity;
+		_readable += writable;
+		Append(extrabuf, n - writable);
+	}
+	return n;
+}
+
+// gathers up to kMaxIov blocks into one sendmsg, MSG_NOSIGNAL keeps a dead peer from raising SIGPIPE
+ssize_t Buffer::WriteFd(int fd, int* savedErrno, size_t maxBytes)
+{
+	iovec vec[kMaxIov];
+	int iovcnt = PeekIov(vec, kMaxIov, maxBytes);
+	if (iovcnt == 0) {
+		return 0;
+	}
+	msghdr msg = {};
+	msg.msg_iov = vec;
+	msg.msg_iovlen = iovcnt;
+	ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	if (n < 0) {
+		*savedErrno = errno;
+	}
+	else {
+		Retrieve(n);
+	}
+	return n;
+}
@@ -1,7 +1,16 @@
 #pragma once
 #include <functional>
 #include <memory>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <linux/filter.h>
+#include <sys/sendfile.h>
 #include "utils.h"
+#include "MiniLog.hpp"
+#include "Buffer.hpp"
+#include "FileSource.hpp"
+#include "ReactorMetrics.hpp"
 
 enum ChannelEvent_e : int
 {
@@ -14,53 +23,259 @@ enum ChannelEvent_e : int
 class Channel;
 using CallBackFunc = std::function<void(std::shared_ptr<Channel>)>;
 class EpollWrapper;
+class IoUringWrapper;
+
+// what a completion based poller has delivered to a channel but the handler has not
+// taken yet, plus the state of the channel's requests in flight. Absent under epoll.
+struct ChannelCompletion
+{
+	enum Kind_e { RECV, ACCEPT, POLL, CONNECT };	// CONNECT turns into RECV once connected
+	Kind_e kind = RECV;
+	ssize_t received = 0;		// bytes appended to the recv buffer since the last Recv
+	bool eof = false;
+	int error = 0;				// errno of a failed request, handed out once
+	std::vector<int> accepted;	// fds accepted by a listener, not taken yet
+	bool recvArmed = false;
+	bool sendInFlight = false;
+	bool writer = false;		// in the poller's list of channels that want to send
+	int inFlight = 0;			// requests the kernel may still complete for this channel
+	iovec iov[Buffer::kMaxIov];
+	msghdr msg;
+
+	~ChannelCompletion()
+	{
+		for (int fd : accepted) {
+			close(fd);
+		}
+	}
+};
+
+// one handler type's callbacks, filled in by ChannelHandler<Derived>
+struct ChannelHandlerOps
+{
+	void (*onRead)(void* handler, Channel& chan);
+	void (*onSend)(void* handler, Channel& chan);
+	void (*onError)(void* handler, Channel& chan);
+};
+
+// The output side of one reactor: send buffer bytes queued on all its channels against
+// an optional limit, and the channels waiting for the end of loop flush.
+// Reactor thread only, but used may be read by an exporter on any thread.
+struct ReactorOutput
+{
+	size_t limit = 0;				// 0: no limit
+	std::atomic<size_t> used{0};
+	CallBackFunc reapply;			// hands a channel whose reads were paused or resumed back to the poller
+	std::vector<std::shared_ptr<Channel>> pending;	// Send was called, not flushed yet
+};
+
 class Channel : public std::enable_shared_from_this<Channel>, noncopyable
 {
 	friend class EpollWrapper;
+	friend class IoUringWrapper;
+	friend class Reactor;
 public:
 	Channel() = delete;;
-	Channel(int fd, std::shared_ptr<void> priv, CallBackFunc read, CallBackFunc send, CallBackFunc error);
+	Channel(int fd, std::shared_ptr<void> priv, CallBackFunc read, CallBackFunc send, CallBackFunc error,
+		SpMemPool blockPool = nullptr);
 	~Channel();
 
 	int GetSocket() const { return _fd;}
 	ChannelEvent_e GetEvents() const { return _events;}
+	// must be set before the channel is added to epoll
+	void SetEdgeTriggered(bool on) { _edgeTriggered = on;}
+	bool IsEdgeTriggered() const { return _edgeTriggered;}
+	// an edge triggered handler that stopped before EAGAIN asks to be called again
+	void ResumeRead() { _resumeRead = true;}
+	// idle timeout bookkeeping, EpollWrapper touches the channel on every read event
+	void Touch(uint64_t nowMs) { _lastActiveMs = nowMs;}
+	uint64_t GetLastActive() const { return _lastActiveMs;}
 	std::shared_ptr<void> GetSpPrivData() { return _priv.lock();}
+	// whatever the application keeps per connection, owned by the channel
+	void SetContext(std::shared_ptr<void> ctx) { _context = std::move(ctx);}
+	std::shared_ptr<void> GetContext() const { return _context;}
+	// still in its reactor's poller, i.e. not deleted yet
+	bool InPoller() const { return _inEpoll;}
+	// SO_BUSY_POLL + SO_PREFER_BUSY_POLL: a blocking receive on this socket polls the NIC
+	// queue for usec first. Above net.core.busy_read it needs CAP_NET_ADMIN, false then
+	bool SetBusyPoll(int usec);
+
+	// Statically dispatched alternative to the CallBackFunc callbacks: events go straight
+	// to H::OnRead / OnSend / OnError(Channel&), with no std::function in between and no
+	// reference count taken per event. The channel keeps handler alive; see ChannelHandler.
+	template <typename H>
+	void SetHandler(std::shared_ptr<H> handler);
 
 	void HandleRead(){
-		if (_onRead) _onRead(shared_from_this());
+		if (_handlerOps) _handlerOps->onRead(_handler, *this);
+		else if (_onRead) _onRead(shared_from_this());
+		updateOutput();
 	}
 	void HandleSend(){
-		if (_onSend) _onSend(shared_from_this());
+		if (_handlerOps) _handlerOps->onSend(_handler, *this);
+		else if (_onSend) _onSend(shared_from_this());
+		updateOutput();
 	}
 	void HandleError(){
-		if (_onError) _onError(shared_from_this());
+		if (_handlerOps) _handlerOps->onError(_handler, *this);
+		else if (_onError) _onError(shared_from_this());
 	}
-	std::string& GetRecvBuffer() { return _recvBuffer;}
-	std::string& GetSendBuffer() { return _sendBuffer;}
-	void AppendRecvBuffer(const std::string& str) { _recvBuffer.append(str);}
-	void AppendSendBuffer(const std::string& str) { _sendBuffer.append(str);}
+	Buffer& GetRecvBuffer() { return _recvBuffer;}
+	Buffer& GetSendBuffer() { return _sendBuffer;}
+	void AppendRecvBuffer(const std::string& str) { _recvBuffer.Append(str);}
+	void AppendSendBuffer(const std::string& str) { _sendBuffer.Append(str);}
+	void AppendSendBuffer(const char* data, size_t len) { _sendBuffer.Append(data, len);}
+	void AppendSendBuffer(Buffer& buf) { _sendBuffer.Append(buf);}
+	// Queue data and have the reactor write it from its own thread at the end of this loop
+	// iteration, once for everything sent to the channel meanwhile. OUT is only enabled
+	// when the socket doesn't take it all, so a reply usually costs a single write.
+	// Reactor thread, channel added.
+	void Send(const char* data, size_t len) { _sendBuffer.Append(data, len); RequestFlush();}
+	void Send(const std::string& str) { _sendBuffer.Append(str); RequestFlush();}
+	// takes buf's blocks, no copy
+	void Send(Buffer& buf) { _sendBuffer.Append(buf); RequestFlush();}
+	// queues msg by reference, no copy: the same message may go to any number of channels
+	void Send(const SpSharedBuffer& msg) { _sendBuffer.AppendShared(msg); RequestFlush();}
+	// the same for what was written into GetSendBuffer() directly, e.g. by a codec
+	void RequestFlush();
+	// Queues len bytes of file from offset behind everything queued so far; the kernel
+	// copies them to the socket (sendfile), nothing passes through user space. Flushed
+	// like Send. Under io_uring the file is read into the send buffer piecewise instead.
+	void SendFile(const SpFileSource& file, off_t offset, size_t len);
+	// Moves up to maxLen bytes the socket src has received into this channel's output
+	// through a pipe (splice), behind everything queued, and flushes like Send. Returns
+	// the bytes moved, 0 at src's EOF, or -1 with savedErrno: EAGAIN src has nothing,
+	// ENOBUFS the pipe is full (stop reading src until this channel's output drains),
+	// EOPNOTSUPP under io_uring (Recv and Send instead).
+	ssize_t SpliceFrom(Channel& src, size_t maxLen, int* savedErrno);
+	// anything queued that did not go out yet: send buffer, file parts, spliced bytes
+	bool HasOutput() const { return !_sendBuffer.Empty() || !_regions.empty();}
+
+	// I/O that works under either poller. With epoll they make the syscall; under
+	// io_uring they hand out what the completions already delivered and fail with
+	// EAGAIN once that is used up, the kernel does the actual reads and writes.
+	ssize_t Recv(int* savedErrno);
+	ssize_t Flush(int* savedErrno);
+	int Accept(sockaddr_in* peer, int* savedErrno);
+	// the channel accepts connections, set by CreateSpChannelListen
+	void SetListening(bool on) { _listening = on;}
+	bool IsListening() const { return _listening;}
+	// a connect is in progress: the poller reports its outcome as the first OUT event,
+	// SO_ERROR tells which. Set before the channel is added, see Connector
+	void SetConnecting(bool on) { _connecting = on;}
+	bool IsConnecting() const { return _connecting;}
+
+	// Once the send buffer holds highWater bytes or more, reading stops (IN is taken out
+	// of what the poller waits for, GetEvents still reports it) until the buffer is down to
+	// lowWater; onHigh and onLow run at those two points. The reactor's output budget can
+	// pause a channel the same way. 0 turns the per channel marks off. Reactor thread, or
+	// before the channel is added.
+	void SetWaterMarks(size_t highWater, size_t lowWater, CallBackFunc onHigh = nullptr, CallBackFunc onLow = nullptr);
+	bool IsReadPaused() const { return _readPaused;}
 private:
 	void SetEvents(ChannelEvent_e evts) { _events = evts;}
+	// what the poller should wait for when the owner asked for evts
+	ChannelEvent_e activeEvents(ChannelEvent_e evts) const
+	{
+		return _readPaused ? static_cast<ChannelEvent_e>(evts & ~ChannelEvent_e::IN) : evts;
+	}
+	void updateOutput();
+	void releaseOutput();
+
+	// a file part or spliced bytes in the output, ahead is the number of send buffer bytes
+	// between the previous region (or the front) and this one
+	struct OutputRegion
+	{
+		SpFileSource file;		// null: the bytes wait in _pipe
+		off_t offset;
+		size_t len;
+		size_t ahead;
+	};
+	// send buffer bytes that may go out before the first region
+	size_t sendableBytes() const { return _regions.empty() ? _sendBuffer.ReadableBytes() : _regions.front().ahead;}
+	void queueRegion(SpFileSource file, off_t offset, size_t len);
+	void popRegion();
+	void bufferSent(size_t n);
+	ssize_t flushRegions(int* savedErrno);
+	bool loadRegion(int* savedErrno);
+	static const size_t kLoadRegionSize = 256 * 1024;	// io_uring reads a file part this much at a time
+	static const int kSplicePipeSize = 1 << 20;
 private:
 	int _fd;
 	std::weak_ptr<void> _priv;		//使用weak_ptr避免出现循环引用
+	std::shared_ptr<void> _context;
 	ChannelEvent_e _events;
+	bool _edgeTriggered;
+	bool _resumeRead;
+	bool _inEpoll;				// added to the reactor's poller, whichever it is
+	bool _listening;
+	bool _connecting;
+	std::unique_ptr<ChannelCompletion> _completion;
+	ReactorMetrics* _metrics;	// of the reactor whose poller holds the channel, null outside one
+	ReactorOutput* _output;		// of the reactor the channel was added to, null outside one
+	size_t _outputBytes;		// what this channel counts for in _output->used
+	size_t _highWater;
+	size_t _lowWater;
+	bool _readPaused;
+	bool _flushPending;			// in _output->pending
+	uint32_t _registered;		// the events epoll has for the fd, to skip a MOD that changes nothing
+	CallBackFunc _onHighWater;
+	CallBackFunc _onLowWater;
+	uint64_t _lastActiveMs;
+	uint64_t _idleTimeoutMs;
+	uint64_t _idleTimer;		// TimerId in the owning reactor's wheel
+	CallBackFunc _onIdle;
 	CallBackFunc _onRead;
 	CallBackFunc _onSend;
 	CallBackFunc _onError;
-	std::string _recvBuffer;
-	std::string _sendBuffer;
+	const ChannelHandlerOps* _handlerOps;	// set: the CallBackFuncs are not used
+	void* _handler;
+	std::shared_ptr<void> _handlerRef;
+	SpMemPool _blockPool;		// keeps the pool alive as long as the buffers may return blocks to it
+	Buffer _recvBuffer;
+	Buffer _sendBuffer;
+	std::deque<OutputRegion> _regions;
+	size_t _regionsAhead;		// sum of the regions' ahead
+	int _pipe[2];				// SpliceFrom's, created on first use
+	size_t _pipeBytes;
+	size_t _pipeCapacity;
 };
 
-Channel::Channel(int fd, std::shared_ptr<void> priv, CallBackFunc read, CallBackFunc send, CallBackFunc error) :
+Channel::Channel(int fd, std::shared_ptr<void> priv, CallBackFunc read, CallBackFunc send, CallBackFunc error,
+	SpMemPool blockPool) :
 	_fd(fd),
 	_priv(priv),
-	_onRead(read),
-	_onSend(send),
-	_onError(error)
+	_events(ChannelEvent_e::NONE),
+	_edgeTriggered(false),
+	_resumeRead(false),
+	_inEpoll(false),
+	_listening(false),
+	_connecting(false),
+	_metrics(nullptr),
+	_output(nullptr),
+	_outputBytes(0),
+	_highWater(0),
+	_lowWater(0),
+	_readPaused(false),
+	_flushPending(false),
+	_registered(0),
+	_lastActiveMs(0),
+	_idleTimeoutMs(0),
+	_idleTimer(0),
+	_onRead(std::move(read)),
+	_onSend(std::move(send)),
+	_onError(std::move(error)),
+	_handlerOps(nullptr),
+	_handler(nullptr),
+	_blockPool(std::move(blockPool)),
+	_recvBuffer(_blockPool.get()),
+	_sendBuffer(_blockPool.get()),
+	_regionsAhead(0),
+	_pipe{ -1, -1 },
+	_pipeBytes(0),
+	_pipeCapacity(0)
 {
-	_recvBuffer.clear();
-	_sendBuffer.clear();
+
 }
 
 Channel::~Channel()
@@ -68,25 +283,445 @@ Channel::~Channel()
 	if(_fd){
 		close(_fd);
 	}
+	if (_pipe[0] >= 0) {
+		close(_pipe[0]);
+		close(_pipe[1]);
+	}
 }
 
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+bool Channel::SetBusyPoll(int usec)
+{
+	if (setsockopt(_fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0) {
+		return false;
+	}
+	int on = usec > 0 ? 1 : 0;
+	// older kernels only lack the preference, the busy poll itself is on
+	setsockopt(_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+	return true;
+}
+
+ssize_t Channel::Recv(int* savedErrno)
+{
+	if (!_completion) {
+		ssize_t n = _recvBuffer.ReadFd(_fd, savedErrno);
+		if (n > 0 && _metrics) {
+			_metrics->bytesIn.Add(n);
+		}
+		return n;
+	}
+	ChannelCompletion& comp = *_completion;
+	if (comp.received > 0) {
+		ssize_t n = comp.received;
+		comp.received = 0;
+		if (_metrics) {
+			_metrics->bytesIn.Add(n);
+		}
+		return n;
+	}
+	if (comp.eof) {
+		return 0;
+	}
+	*savedErrno = comp.error ? comp.error : EAGAIN;
+	comp.error = 0;
+	return -1;
+}
+
+ssize_t Channel::Flush(int* savedErrno)
+{
+	if (!_completion) {
+		if (!_regions.empty()) {
+			return flushRegions(savedErrno);
+		}
+		ssize_t n = _sendBuffer.WriteFd(_fd, savedErrno);
+		if (n > 0 && _metrics) {
+			_metrics->bytesOut.Add(n);
+		}
+		return n;
+	}
+	// the poller sends whatever is buffered while OUT is enabled, and counts it
+	if (_completion->error) {
+		*savedErrno = _completion->error;
+		_completion->error = 0;
+		return -1;
+	}
+	if (!_regions.empty() && _regions.front().ahead == 0 && !_completion->sendInFlight && !loadRegion(savedErrno)) {
+		return -1;
+	}
+	if (!HasOutput()) {
+		return 0;
+	}
+	*savedErrno = EAGAIN;
+	return -1;
+}
+
+void Channel::SendFile(const SpFileSource& file, off_t offset, size_t len)
+{
+	if (!file || len == 0) {
+		return;
+	}
+	queueRegion(file, offset, len);
+	RequestFlush();
+}
+
+ssize_t Channel::SpliceFrom(Channel& src, size_t maxLen, int* savedErrno)
+{
+	if (_completion || src._completion) {
+		*savedErrno = EOPNOTSUPP;
+		return -1;
+	}
+	if (_pipe[0] < 0) {
+		if (pipe2(_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+			*savedErrno = errno;
+			return -1;
+		}
+		// a bigger pipe takes fewer round trips per megabyte, the default is 64KB
+		fcntl(_pipe[1], F_SETPIPE_SZ, kSplicePipeSize);
+		int size = fcntl(_pipe[1], F_GETPIPE_SZ);
+		_pipeCapacity = size > 0 ? static_cast<size_t>(size) : 65536;
+	}
+	if (_pipeBytes >= _pipeCapacity) {
+		*savedErrno = ENOBUFS;
+		return -1;
+	}
+	ssize_t n = splice(src._fd, nullptr, _pipe[1], nullptr, std::min(maxLen, _pipeCapacity - _pipeBytes),
+		SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+	if (n < 0) {
+		*savedErrno = errno;
+		// the pipe fills by pages per packet, not by bytes: with anything in it an EAGAIN
+		// may as well mean no room, and guessing "full" only costs a pause until the flush
+		if (*savedErrno == EAGAIN && _pipeBytes > 0) {
+			*savedErrno = ENOBUFS;
+		}
+		return -1;
+	}
+	if (n == 0) {
+		return 0;
+	}
+	if (src._metrics) {
+		src._metrics->bytesIn.Add(n);
+	}
+	_pipeBytes += n;
+	queueRegion(nullptr, 0, n);
+	RequestFlush();
+	return n;
+}
+
+void Channel::queueRegion(SpFileSource file, off_t offset, size_t len)
+{
+	size_t buffered = _sendBuffer.ReadableBytes();
+	size_t ahead = buffered > _regionsAhead ? buffered - _regionsAhead : 0;
+	// spliced bytes right behind spliced bytes just make that region longer
+	if (!file && ahead == 0 && !_regions.empty() && !_regions.back().file) {
+		_regions.back().len += len;
+		return;
+	}
+	OutputRegion region;
+	region.file = std::move(file);
+	region.offset = offset;
+	region.len = len;
+	region.ahead = ahead;
+	_regions.push_back(std::move(region));
+	_regionsAhead += ahead;
+}
+
+// the front region is done, send buffer bytes still ahead of it now precede the next one
+void Channel::popRegion()
+{
+	size_t ahead = _regions.front().ahead;
+	_regions.pop_front();
+	if (_regions.empty()) {
+		_regionsAhead -= ahead;
+	}
+	else {
+		_regions.front().ahead += ahead;
+	}
+}
+
+// n bytes left the front of the send buffer, they were ahead of the first region
+void Channel::bufferSent(size_t n)
+{
+	if (_regions.empty()) {
+		return;
+	}
+	size_t taken = std::min(n, _regions.front().ahead);
+	_regions.front().ahead -= taken;
+	_regionsAhead -= taken;
+}
+
+// Flush with regions queued under epoll: the send buffer up to the first region, or the
+// region itself. One syscall per call, like the plain path.
+ssize_t Channel::flushRegions(int* savedErrno)
+{
+	size_t ahead = _regions.front().ahead;
+	ssize_t n = 0;
+	if (ahead > 0) {
+		n = _sendBuffer.WriteFd(_fd, savedErrno, ahead);
+		if (n > 0) {
+			bufferSent(static_cast<size_t>(n));
+		}
+	}
+	else {
+		OutputRegion& region = _regions.front();
+		if (region.file) {
+			n = sendfile(_fd, region.file->GetFd(), &region.offset, region.len);
+		}
+		else {
+			n = splice(_pipe[0], nullptr, _fd, nullptr, region.len, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+		}
+		if (n < 0) {
+			*savedErrno = errno;
+			return -1;
+		}
+		if (n == 0) {
+			// the file is shorter than the part that was queued
+			*savedErrno = EIO;
+			return -1;
+		}
+		if (!region.file) {
+			_pipeBytes -= n;
+		}
+		region.len -= n;
+		if (region.len == 0) {
+			popRegion();
+		}
+	}
+	if (n > 0 && _metrics) {
+		_metrics->bytesOut.Add(n);
+	}
+	return n;
+}
+
+// io_uring has no sendfile: the front file part is read into the front of the send buffer
+// a piece at a time and goes out with it. Only while no send is in flight.
+bool Channel::loadRegion(int* savedErrno)
+{
+	OutputRegion& region = _regions.front();
+	std::vector<char> data(std::min(region.len, static_cast<size_t>(kLoadRegionSize)));
+	ssize_t n = pread(region.file->GetFd(), data.data(), data.size(), region.offset);
+	if (n <= 0) {
+		*savedErrno = n < 0 ? errno : EIO;
+		return false;
+	}
+	_sendBuffer.Prepend(data.data(), static_cast<size_t>(n));
+	region.offset += n;
+	region.len -= n;
+	region.ahead += n;
+	_regionsAhead += n;
+	if (region.len == 0) {
+		popRegion();
+	}
+	return true;
+}
+
+int Channel::Accept(sockaddr_in* peer, int* savedErrno)
+{
+	int fd = -1;
+	if (!_completion) {
+		socklen_t len = sizeof(*peer);
+		fd = accept4(_fd, reinterpret_cast<sockaddr*>(peer), &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			*savedErrno = errno;
+		}
+		else if (_metrics) {
+			_metrics->accepts.Add();
+		}
+		return fd;
+	}
+	ChannelCompletion& comp = *_completion;
+	if (comp.accepted.empty()) {
+		*savedErrno = comp.error ? comp.error : EAGAIN;
+		comp.error = 0;
+		return -1;
+	}
+	fd = comp.accepted.front();
+	comp.accepted.erase(comp.accepted.begin());
+	// a multishot accept has no per-connection address slot
+	socklen_t len = sizeof(*peer);
+	getpeername(fd, reinterpret_cast<sockaddr*>(peer), &len);
+	if (_metrics) {
+		_metrics->accepts.Add();
+	}
+	return fd;
+}
+
+template <typename H>
+void Channel::SetHandler(std::shared_ptr<H> handler)
+{
+	_handlerOps = H::Ops();
+	_handler = handler.get();
+	_handlerRef = std::move(handler);
+}
+
+void Channel::SetWaterMarks(size_t highWater, size_t lowWater, CallBackFunc onHigh, CallBackFunc onLow)
+{
+	_highWater = highWater;
+	_lowWater = std::min(lowWater, highWater);
+	_onHighWater = std::move(onHigh);
+	_onLowWater = std::move(onLow);
+	updateOutput();
+}
+
+void Channel::RequestFlush()
+{
+	if (_flushPending || !_output || !HasOutput()) {
+		return;
+	}
+	_flushPending = true;
+	_output->pending.emplace_back(shared_from_this());
+}
+
+// Runs after the callbacks and whenever the reactor changes the channel's events, the
+// points where the send buffer may have grown or drained.
+void Channel::updateOutput()
+{
+	if (!_output) {
+		return;
+	}
+	size_t size = _sendBuffer.ReadableBytes();
+	if (size != _outputBytes) {
+		_output->used.store(_output->used.load(std::memory_order_relaxed) + size - _outputBytes,
+			std::memory_order_relaxed);
+		_outputBytes = size;
+	}
+	if (!_readPaused) {
+		bool overHigh = _highWater > 0 && size >= _highWater;
+		bool overBudget = _output->limit > 0 && size > _lowWater &&
+			_output->used.load(std::memory_order_relaxed) > _output->limit;
+		if (!overHigh && !overBudget) {
+			return;
+		}
+	}
+	else if (size > _lowWater) {
+		return;
+	}
+	_readPaused = !_readPaused;
+	std::shared_ptr<Channel> self = shared_from_this();
+	if (_readPaused && _metrics) {
+		_metrics->readPauses.Add();
+	}
+	_output->reapply(self);
+	CallBackFunc& hook = _readPaused ? _onHighWater : _onLowWater;
+	if (hook) {
+		hook(self);
+	}
+}
+
+// the channel leaves its reactor, whatever it still buffers no longer counts there
+void Channel::releaseOutput()
+{
+	if (!_output) {
+		return;
+	}
+	_output->used.store(_output->used.load(std::memory_order_relaxed) - _outputBytes, std::memory_order_relaxed);
+	_output = nullptr;
+	_outputBytes = 0;
+}
+
+/*
+ * Base of a statically dispatched handler, Derived hides whichever of OnRead, OnSend and
+ * OnError it needs, the rest do nothing:
+ *
+ *     class Conn : public ChannelHandler<Conn>
+ *     {
+ *     public:
+ *         void OnRead(Channel& chan);
+ *     };
+ *     chan->SetHandler(std::make_shared<Conn>());
+ *
+ * The calls are bound at compile time into one table per Derived. The channel is passed by
+ * reference and only lives through the call; keep a Reactor* in Derived rather than going
+ * through GetSpPrivData on every event, the reactor outlives its channels.
+ */
+template <typename Derived>
+class ChannelHandler
+{
+public:
+	void OnRead(Channel&) {}
+	void OnSend(Channel&) {}
+	void OnError(Channel&) {}
+	static const ChannelHandlerOps* Ops()
+	{
+		static const ChannelHandlerOps ops = { &read, &send, &error };
+		return &ops;
+	}
+private:
+	static void read(void* h, Channel& chan) { static_cast<Derived*>(h)->OnRead(chan); }
+	static void send(void* h, Channel& chan) { static_cast<Derived*>(h)->OnSend(chan); }
+	static void error(void* h, Channel& chan) { static_cast<Derived*>(h)->OnError(chan); }
+};
 
 /*--------------------------------- shared_ptr --------------------*/
 using SpChannel = std::shared_ptr<Channel>;
 SpChannel CreateSpChannel(int fd, std::shared_ptr<void> priv, CallBackFunc read, CallBackFunc send, CallBackFunc error)
 {
-	return std::make_shared<Channel>(fd, priv, read, send, error);
+	return std::make_shared<Channel>(fd, priv, std::move(read), std::move(send), std::move(error));
 }
 
-SpChannel CreateSpChannelListen(int port, std::shared_ptr<void> priv, CallBackFunc connect, CallBackFunc error)
+static const int kDefaultListenBacklog = SOMAXCONN;
+
+static int create_listen_socket(int port, int backlog, bool reusePort)
 {
 	int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenFd < 0) {
+		minilog(LogLevel_e::ERROR, "create listen socket error = %s", strerror(errno));
+		return -1;
+	}
+	int on = 1;
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (reusePort && setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		minilog(LogLevel_e::ERROR, "set SO_REUSEPORT error = %s", strerror(errno));
+		close(listenFd);
+		return -1;
+	}
 	sockaddr_in sin = {};
 	sin.sin_family = AF_INET;
 	sin.sin_addr.s_addr = INADDR_ANY;
 	sin.sin_port = htons(port);
-	bind(listenFd, (sockaddr*)&sin, sizeof(sin));
-	listen(listenFd, 20);
+	if (bind(listenFd, (sockaddr*)&sin, sizeof(sin)) < 0 || listen(listenFd, backlog) < 0) {
+		minilog(LogLevel_e::ERROR, "listen on port %d error = %s", port, strerror(errno));
+		close(listenFd);
+		return -1;
+	}
 	fcntl(listenFd, F_SETFL, O_NONBLOCK);
-	return std::make_shared<Channel>(listenFd, priv, connect, nullptr, error);
+	return listenFd;
+}
+
+SpChannel CreateSpChannelListen(int port, std::shared_ptr<void> priv, CallBackFunc connect, CallBackFunc error,
+	int backlog = kDefaultListenBacklog, bool reusePort = false)
+{
+	int listenFd = create_listen_socket(port, backlog, reusePort);
+	if (listenFd < 0) {
+		return nullptr;
+	}
+	SpChannel chan = std::make_shared<Channel>(listenFd, priv, connect, nullptr, error);
+	chan->SetListening(true);
+	return chan;
+}
+
+// Steer each new connection to the SO_REUSEPORT group member served on the cpu that
+// received it. Members are indexed in the order they were bound, cpus[i] is the cpu the
+// listener bound i-th is served on. A connection that arrives on any other cpu is left
+// to the kernel's hash (an index past the group).
+bool AttachReusePortCpuSteering(int listenFd, const std::vector<int>& cpus)
+{
+	// a compare and a return per cpu, cBPF has no maps
+	std::vector<sock_filter> code;
+	code.push_back({ BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU) });
+	for (size_t i = 0; i < cpus.size(); i++) {
+		code.push_back({ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, static_cast<uint32_t>(cpus[i]) });
+		code.push_back({ BPF_RET | BPF_K, 0, 0, static_cast<uint32_t>(i) });
+	}
+	code.push_back({ BPF_RET | BPF_K, 0, 0, UINT32_MAX });
+	sock_fprog prog = {};
+	prog.len = static_cast<unsigned short>(code.size());
+	prog.filter = code.data();
+	if (setsockopt(listenFd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		minilog(LogLevel_e::ERROR, "attach reuseport cbpf error = %s", strerror(errno));
+		return false;
+	}
+	return true;
 }
@@ -0,0 +1,217 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+#include "utils.h"
+#include "CodecInterface.h"
+
+static const size_t kDefaultMaxFrame = 1 << 20;
+
+// payload behind a 1, 2 or 4 byte big endian length
+class LengthFieldCodec : public CodecInterface, noncopyable
+{
+public:
+	explicit LengthFieldCodec(int headerBytes = 4, size_t maxPayload = kDefaultMaxFrame);
+	ssize_t Decode(Buffer& buf, DecodeState& state, size_t* payloadOffset, size_t* payloadLen) override;
+	// false for more than maxPayload, the length would not fit the header
+	bool Encode(Buffer& out, const char* data, size_t len) override;
+private:
+	size_t _headerBytes;
+	size_t _maxPayload;
+};
+
+// payload up to a delimiter such as "\n" or "\r\n", the delimiter is not part of it
+class DelimiterCodec : public CodecInterface, noncopyable
+{
+public:
+	explicit DelimiterCodec(const std::string& delimiter = "\n", size_t maxPayload = kDefaultMaxFrame);
+	ssize_t Decode(Buffer& buf, DecodeState& state, size_t* payloadOffset, size_t* payloadLen) override;
+	bool Encode(Buffer& out, const char* data, size_t len) override;
+private:
+	std::string _delimiter;
+	size_t _maxPayload;
+};
+
+// every frame is exactly frameSize bytes of payload
+class FixedLengthCodec : public CodecInterface, noncopyable
+{
+public:
+	explicit FixedLengthCodec(size_t frameSize);
+	ssize_t Decode(Buffer& buf, DecodeState& state, size_t* payloadOffset, size_t* payloadLen) override;
+	bool Encode(Buffer& out, const char* data, size_t len) override;
+private:
+	size_t _frameSize;
+};
+
+LengthFieldCodec::LengthFieldCodec(int headerBytes, size_t maxPayload) :
+	_headerBytes(headerBytes == 1 || headerBytes == 2 ? headerBytes : 4),
+	_maxPayload(std::min<size_t>(maxPayload, (1ull << (8 * _headerBytes)) - 1))
+{
+}
+
+ssize_t LengthFieldCodec::Decode(Buffer& buf, DecodeState&, size_t* payloadOffset, size_t* payloadLen)
+{
+	if (buf.ReadableBytes() < _headerBytes) {
+		return 0;
+	}
+	const unsigned char* header = reinterpret_cast<const unsigned char*>(buf.Pullup(_headerBytes));
+	size_t len = 0;
+	for (size_t i = 0; i < _headerBytes; i++) {
+		len = (len << 8) | header[i];
+	}
+	if (len > _maxPayload) {
+		return -1;
+	}
+	if (buf.ReadableBytes() < _headerBytes + len) {
+		return 0;
+	}
+	*payloadOffset = _headerBytes;
+	*payloadLen = len;
+	return static_cast<ssize_t>(_headerBytes + len);
+}
+
+bool LengthFieldCodec::Encode(Buffer& out, const char* data, size_t len)
+{
+	if (len > _maxPayload) {
+		return false;
+	}
+	unsigned char header[4];
+	for (size_t i = 0; i < _headerBytes; i++) {
+		header[i] = static_cast<unsigned char>(len >> (8 * (_headerBytes - 1 - i)));
+	}
+	out.Append(reinterpret_cast<const char*>(header), _headerBytes);
+	out.Append(data, len);
+	return true;
+}
+
+DelimiterCodec::DelimiterCodec(const std::string& delimiter, size_t maxPayload) :
+	_delimiter(delimiter.empty() ? "\n" : delimiter),
+	_maxPayload(maxPayload)
+{
+}
+
+ssize_t DelimiterCodec::Decode(Buffer& buf, DecodeState& state, size_t* payloadOffset, size_t* payloadLen)
+{
+	size_t pos = buf.Find(_delimiter.data(), _delimiter.size(), state.scanned);
+	if (pos == Buffer::npos) {
+		// only the last few bytes can still be the start of a delimiter, the next call
+		// searches from there
+		size_t readable = buf.ReadableBytes();
+		state.scanned = readable >= _delimiter.size() ? readable - (_delimiter.size() - 1) : 0;
+		return readable > _maxPayload + _delimiter.size() ? -1 : 0;
+	}
+	// the next frame starts behind this one
+	state.scanned = 0;
+	if (pos > _maxPayload) {
+		return -1;
+	}
+	*payloadOffset = 0;
+	*payloadLen = pos;
+	return static_cast<ssize_t>(pos + _delimiter.size());
+}
+
+bool DelimiterCodec::Encode(Buffer& out, const char* data, size_t len)
+{
+	out.Append(data, len);
+	out.Append(_delimiter);
+	return true;
+}
+
+FixedLengthCodec::FixedLengthCodec(size_t frameSize) :
+	_frameSize(std::max<size_t>(frameSize, 1))
+{
+}
+
+ssize_t FixedLengthCodec::Decode(Buffer& buf, DecodeState&, size_t* payloadOffset, size_t* payloadLen)
+{
+	if (buf.ReadableBytes() < _frameSize) {
+		return 0;
+	}
+	*payloadOffset = 0;
+	*payloadLen = _frameSize;
+	return static_cast<ssize_t>(_frameSize);
+}
+
+bool FixedLengthCodec::Encode(Buffer& out, const char* data, size_t len)
+{
+	// short payloads are zero padded, long ones cut, the peer always reads frameSize bytes
+	size_t n = std::min(len, _frameSize);
+	out.Append(data, n);
+	if (n < _frameSize) {
+		std::string pad(_frameSize - n, '\0');
+		out.Append(pad);
+	}
+	return true;
+}
+
+/*
+ * Hands every complete frame at the front of in to bool onFrame(const char* payload, size_t len)
+ * and consumes it, so a read that brought in many pipelined requests is served in one
+ * pass. A frame straddling two blocks is copied together first, any other is passed in
+ * place. onFrame must not touch in; returning false leaves that frame and the rest in
+ * the buffer, e.g. to apply backpressure. Returns the number of frames consumed, -1 on
+ * a malformed stream (the offending bytes are left in the buffer). state is the
+ * connection's, kept for the next call.
+ */
+template <typename F>
+int DispatchFrames(Buffer& in, CodecInterface& codec, DecodeState& state, F onFrame)
+{
+	int frames = 0;
+	while (true) {
+		size_t offset = 0;
+		size_t len = 0;
+		ssize_t frameLen = codec.Decode(in, state, &offset, &len);
+		if (frameLen < 0) {
+			return -1;
+		}
+		if (frameLen == 0) {
+			return frames;
+		}
+		const char* frame = in.Pullup(static_cast<size_t>(frameLen));
+		if (!onFrame(frame + offset, len)) {
+			return frames;
+		}
+		in.Retrieve(static_cast<size_t>(frameLen));
+		frames++;
+	}
+}
+
+/*--------------- shared_ptr -----------*/
+SpCodec CreateSpLengthFieldCodec(int headerBytes = 4, size_t maxPayload = kDefaultMaxFrame)
+{
+	return std::make_shared<LengthFieldCodec>(headerBytes, maxPayload);
+}
+
+SpCodec CreateSpDelimiterCodec(const std::string& delimiter = "\n", size_t maxPayload = kDefaultMaxFrame)
+{
+	return std::make_shared<DelimiterCodec>(delimiter, maxPayload);
+}
+
+SpCodec CreateSpFixedLengthCodec(size_t frameSize)
+{
+	return std::make_shared<FixedLengthCodec>(frameSize);
+}
+
+// "len" (4 byte header), "len2", "len1", "line" ("\n"), "crlf" ("\r\n") or "fixed:N",
+// nullptr for anything else
+SpCodec CreateSpCodec(const std::string& spec)
+{
+	if (spec == "len") {
+		return CreateSpLengthFieldCodec(4);
+	}
+	if (spec == "len2") {
+		return CreateSpLengthFieldCodec(2);
+	}
+	if (spec == "len1") {
+		return CreateSpLengthFieldCodec(1);
+	}
+	if (spec == "line") {
+		return CreateSpDelimiterCodec("\n");
+	}
+	if (spec == "crlf") {
+		return CreateSpDelimiterCodec("\r\n");
+	}
+	if (spec.compare(0, 6, "fixed:") == 0 && atoi(spec.c_str() + 6) > 0) {
+		return CreateSpFixedLengthCodec(static_cast<size_t>(atoi(spec.c_str() + 6)));
+	}
+	return nullptr;
+}
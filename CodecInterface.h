@@ -0,0 +1,29 @@
+#pragma once
+#include <memory>
+#include "Buffer.hpp"
+
+// What a codec learned about the front of one connection's input between two Decode
+// calls, so that a frame arriving in many reads is not searched from its start each time.
+// Belongs to the connection; reset it if the input is consumed other than by Decode's frames.
+struct DecodeState
+{
+	size_t scanned = 0;		// bytes at the front known not to hold the end of the first frame
+};
+
+// Splits a byte stream into frames and wraps payloads back into frames.
+// Codecs keep no per-connection state, that is the caller's DecodeState, so one
+// instance can serve every channel.
+class CodecInterface
+{
+public:
+	virtual ~CodecInterface() {}
+	// Looks at the front of buf without consuming anything. Returns the size of the first
+	// frame on the wire and where its payload sits inside it, 0 while the frame is still
+	// incomplete, -1 when the bytes can't start a valid frame.
+	virtual ssize_t Decode(Buffer& buf, DecodeState& state, size_t* payloadOffset, size_t* payloadLen) = 0;
+	// appends one frame carrying data to out, false (and nothing appended) when the
+	// frame can't carry len bytes
+	virtual bool Encode(Buffer& out, const char* data, size_t len) = 0;
+};
+
+using SpCodec = std::shared_ptr<CodecInterface>;
@@ -0,0 +1,251 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include "utils.h"
+#include "MiniLog.hpp"
+#include "CpuTopology.hpp"
+#include "Reactor.hpp"
+
+static const size_t kDefaultComputeQueue = 65536;
+
+// runs on the reactor once the task is done, usually writes the answer; may be null
+using ComputeResult = std::function<void(void)>;
+// runs on a pool thread
+using ComputeTask = std::function<ComputeResult(void)>;
+
+struct ComputePoolStats
+{
+	uint64_t submitted;
+	uint64_t rejected;		// Submit found the pool full
+	uint64_t completed;
+	size_t queued;			// accepted, not run yet
+};
+
+class ComputePool;
+
+/*
+ * Tasks of one strand run one after the other in submit order, and their results are
+ * run on the strand's reactor in that same order. Give every connection its own strand:
+ * different connections proceed in parallel, one connection's requests stay ordered.
+ */
+class ComputeStrand : noncopyable
+{
+	friend class ComputePool;
+public:
+	ComputeStrand(SpReactor re, std::function<void(void)> onDelivered);
+	// submitted and not yet delivered to the reactor, for per connection backpressure
+	size_t GetInFlight() const { return _inFlight.load(std::memory_order_relaxed); }
+private:
+	std::weak_ptr<Reactor> _reactor;
+	std::function<void(void)> _onDelivered;	// on the reactor after every batch of results
+	std::mutex _mutex;
+	std::deque<ComputeTask> _tasks;			// guarded by _mutex
+	bool _scheduled;						// in the pool's ready list or running, guarded by _mutex
+	std::atomic<size_t> _inFlight;
+};
+
+using SpStrand = std::shared_ptr<ComputeStrand>;
+
+ComputeStrand::ComputeStrand(SpReactor re, std::function<void(void)> onDelivered) :
+	_reactor(re),
+	_onDelivered(std::move(onDelivered)),
+	_scheduled(false),
+	_inFlight(0)
+{
+}
+
+/*
+ * Threads for the work that must not run in a reactor. Ready strands wait in one FIFO;
+ * a thread takes a strand, runs up to kMaxBatch of its tasks and hands all their results
+ * to the reactor with a single PushFunctor, then puts the strand back at the end if it
+ * has more, so a busy connection can't starve the others.
+ * At most maxQueued tasks wait at a time, Submit fails beyond that and the caller is
+ * expected to stop reading from the connection until its strand drains.
+ */
+class ComputePool : noncopyable
+{
+public:
+	ComputePool() = delete;
+	explicit ComputePool(const std::string& name, size_t threadNum = 0, size_t maxQueued = kDefaultComputeQueue);
+	~ComputePool();
+	// onDelivered runs on re after each batch of this strand's results, may be null
+	SpStrand CreateStrand(SpReactor re, std::function<void(void)> onDelivered = nullptr);
+	// false when the pool is full, nothing is queued then
+	bool Submit(const SpStrand& strand, ComputeTask task);
+	ComputePoolStats GetStats() const;
+	size_t Size() const { return _threads.size(); }
+private:
+	void work();
+	void schedule(const SpStrand& strand);
+private:
+	static const size_t kMaxBatch = 64;
+	std::string _name;
+	size_t _maxQueued;
+	std::atomic<bool> _running;
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	std::deque<SpStrand> _ready;			// guarded by _mutex
+	std::atomic<size_t> _queued;
+	std::atomic<uint64_t> _submitted;
+	std::atomic<uint64_t> _rejected;
+	std::atomic<uint64_t> _completed;
+	std::vector<std::thread> _threads;
+};
+
+ComputePool::ComputePool(const std::string& name, size_t threadNum, size_t maxQueued) :
+	_name(name),
+	_maxQueued(maxQueued),
+	_running(true),
+	_queued(0),
+	_submitted(0),
+	_rejected(0),
+	_completed(0)
+{
+	if (threadNum == 0) {
+		threadNum = std::max<size_t>(1, std::thread::hardware_concurrency());
+	}
+	// started last, work() uses everything above
+	for (size_t i = 0; i < threadNum; i++) {
+		_threads.emplace_back(&ComputePool::work, this);
+		SetThreadName(_threads.back().native_handle(), _name + "_" + std::to_string(i));
+	}
+	minilog(LogLevel_e::INFO, "[%s] %d compute threads, at most %d tasks queued", _name.c_str(),
+		static_cast<int>(threadNum), static_cast<int>(maxQueued));
+}
+
+ComputePool::~ComputePool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_running = false;
+	}
+	_cv.notify_all();
+	for (auto& thrd : _threads) {
+		thrd.join();
+	}
+}
+
+SpStrand ComputePool::CreateStrand(SpReactor re, std::function<void(void)> onDelivered)
+{
+	return std::make_shared<ComputeStrand>(re, std::move(onDelivered));
+}
+
+bool ComputePool::Submit(const SpStrand& strand, ComputeTask task)
+{
+	if (_queued.fetch_add(1, std::memory_order_relaxed) >= _maxQueued) {
+		_queued.fetch_sub(1, std::memory_order_relaxed);
+		_rejected.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	_submitted.fetch_add(1, std::memory_order_relaxed);
+	strand->_inFlight.fetch_add(1, std::memory_order_relaxed);
+	bool idle = false;
+	{
+		std::lock_guard<std::mutex> lock(strand->_mutex);
+		strand->_tasks.emplace_back(std::move(task));
+		idle = !strand->_scheduled;
+		strand->_scheduled = true;
+	}
+	// a strand that is already waiting or running picks the task up itself
+	if (idle) {
+		schedule(strand);
+	}
+	return true;
+}
+
+void ComputePool::schedule(const SpStrand& strand)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_ready.emplace_back(strand);
+	}
+	_cv.notify_one();
+}
+
+ComputePoolStats ComputePool::GetStats() const
+{
+	ComputePoolStats stats;
+	stats.submitted = _submitted.load(std::memory_order_relaxed);
+	stats.rejected = _rejected.load(std::memory_order_relaxed);
+	stats.completed = _completed.load(std::memory_order_relaxed);
+	stats.queued = _queued.load(std::memory_order_relaxed);
+	return stats;
+}
+
+void ComputePool::work()
+{
+	std::vector<ComputeTask> batch;
+	while (true) {
+		SpStrand strand;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_cv.wait(lock, [this]() { return !_ready.empty() || !_running; });
+			if (!_running) {
+				return;
+			}
+			strand = std::move(_ready.front());
+			_ready.pop_front();
+		}
+		{
+			std::lock_guard<std::mutex> lock(strand->_mutex);
+			size_t n = std::min(static_cast<size_t>(kMaxBatch), strand->_tasks.size());
+			for (size_t i = 0; i < n; i++) {
+				batch.emplace_back(std::move(strand->_tasks.front()));
+				strand->_tasks.pop_front();
+			}
+		}
+		// taken off the queue, a running task no longer holds a slot of maxQueued
+		_queued.fetch_sub(batch.size(), std::memory_order_relaxed);
+		// results go over as one functor, they are shared because C++11 lambdas can't move-capture
+		auto results = std::make_shared<std::vector<ComputeResult>>();
+		results->reserve(batch.size());
+		for (auto& task : batch) {
+			results->emplace_back(task());
+		}
+		size_t n = batch.size();
+		batch.clear();
+		_completed.fetch_add(n, std::memory_order_relaxed);
+
+		// pushed before the strand is released, so the next batch's results can't overtake these
+		SpReactor re = strand->_reactor.lock();
+		if (re) {
+			re->PushFunctor([results, strand]() {
+				for (auto& result : *results) {
+					strand->_inFlight.fetch_sub(1, std::memory_order_relaxed);
+					if (result) {
+						result();
+					}
+				}
+				if (strand->_onDelivered) {
+					strand->_onDelivered();
+				}
+			});
+		}
+		else {
+			strand->_inFlight.fetch_sub(n, std::memory_order_relaxed);
+		}
+
+		bool more = false;
+		{
+			std::lock_guard<std::mutex> lock(strand->_mutex);
+			more = !strand->_tasks.empty();
+			strand->_scheduled = more;
+		}
+		if (more) {
+			schedule(strand);
+		}
+	}
+}
+
+/*--------------- shared_ptr -----------*/
+using SpComputePool = std::shared_ptr<ComputePool>;
+SpComputePool CreateSpComputePool(const std::string& name, size_t threadNum = 0,
+	size_t maxQueued = kDefaultComputeQueue)
+{
+	return std::make_shared<ComputePool>(name, threadNum, maxQueued);
+}
@@ -0,0 +1,285 @@
+#pragma once
+#include <random>
+#include <netdb.h>
+#include "Reactor.hpp"
+
+static const uint64_t kDefaultRetryMinMs = 100;
+static const uint64_t kDefaultRetryMaxMs = 10000;
+
+// "host:port", the host a dotted quad or a name resolved right now (blocking, meant for
+// startup), empty for loopback; false (and logged) when it is neither
+bool ParseAddress(const std::string& hostPort, sockaddr_in* addr);
+// "127.0.0.1:8080"
+std::string FormatAddress(const sockaddr_in& addr);
+
+using ConnectFailedFunc = std::function<void(int err)>;
+
+/*
+ * Opens outbound connections from a reactor: a non-blocking connect whose outcome the
+ * poller reports, retried after a failure with exponential backoff, minMs doubling up to
+ * maxMs and jittered so that a pool's connections don't all retry in the same instant.
+ *
+ * onConnected gets the connected socket as a channel of the reactor, already in its
+ * poller with no events: give it a handler and enable IN. onFailed gets the errno of the
+ * last try once maxAttempts connects failed in a row (0, the default, retries forever).
+ * One connection at a time; Start again, e.g. from onConnected, for the next one.
+ * Start and Stop may be called from any thread, the callbacks run on the reactor's.
+ */
+class Connector : public std::enable_shared_from_this<Connector>, noncopyable
+{
+public:
+	Connector(const SpReactor& re, const sockaddr_in& addr, uint64_t minMs = kDefaultRetryMinMs,
+		uint64_t maxMs = kDefaultRetryMaxMs, int maxAttempts = 0);
+	~Connector();
+	// does nothing while a connect is running
+	void Start(CallBackFunc onConnected, ConnectFailedFunc onFailed = nullptr);
+	// drops the connect in progress or the pending retry, no callback runs
+	void Stop();
+	const sockaddr_in& GetAddress() const { return _addr; }
+private:
+	class Watch;
+	void connect();
+	void onWritable(Channel& chan);
+	void retry(int err);
+	uint64_t nextDelay();
+private:
+	SpReactor _reactor;
+	sockaddr_in _addr;
+	uint64_t _minMs;
+	uint64_t _maxMs;
+	int _maxAttempts;
+	// reactor thread only
+	bool _running;
+	int _attempts;				// failed in a row
+	uint64_t _backoffMs;
+	SpChannel _chan;			// the connect in progress
+	TimerId _timer;				// the retry waiting
+	CallBackFunc _onConnected;
+	ConnectFailedFunc _onFailed;
+};
+
+// handler of a connecting channel; it must not keep the connector alive, the connector owns the channel
+class Connector::Watch : public ChannelHandler<Watch>
+{
+public:
+	explicit Watch(std::weak_ptr<Connector> owner) : _owner(std::move(owner)) {}
+	// epoll reports a refused connect as an error or hangup, which goes to OnRead
+	void OnRead(Channel& chan) { OnSend(chan); }
+	void OnSend(Channel& chan)
+	{
+		if (auto owner = _owner.lock()) {
+			// may replace this handler, nothing of it is touched afterwards
+			owner->onWritable(chan);
+		}
+	}
+private:
+	std::weak_ptr<Connector> _owner;
+};
+
+// on loopback a connect to a free port in the ephemeral range can end up connected to itself
+static bool is_self_connect(int fd)
+{
+	sockaddr_in local = {};
+	sockaddr_in peer = {};
+	socklen_t localLen = sizeof(local);
+	socklen_t peerLen = sizeof(peer);
+	if (getsockname(fd, reinterpret_cast<sockaddr*>(&local), &localLen) < 0 ||
+		getpeername(fd, reinterpret_cast<sockaddr*>(&peer), &peerLen) < 0) {
+		return false;
+	}
+	return local.sin_port == peer.sin_port && local.sin_addr.s_addr == peer.sin_addr.s_addr;
+}
+
+Connector::Connector(const SpReactor& re, const sockaddr_in& addr, uint64_t minMs, uint64_t maxMs, int maxAttempts) :
+	_reactor(re),
+	_addr(addr),
+	_minMs(std::max<uint64_t>(1, minMs)),
+	_maxMs(std::max(minMs, maxMs)),
+	_maxAttempts(maxAttempts),
+	_running(false),
+	_attempts(0),
+	_backoffMs(_minMs),
+	_timer(kInvalidTimerId)
+{
+}
+
+Connector::~Connector()
+{
+	if (_chan) {
+		_reactor->DelChannel(_chan);
+	}
+}
+
+void Connector::Start(CallBackFunc onConnected, ConnectFailedFunc onFailed)
+{
+	auto self = shared_from_this();
+	_reactor->PushFunctor([self, onConnected, onFailed]() {
+		if (self->_running) {
+			return;
+		}
+		self->_running = true;
+		self->_attempts = 0;
+		self->_backoffMs = self->_minMs;
+		self->_onConnected = onConnected;
+		self->_onFailed = onFailed;
+		self->connect();
+	});
+}
+
+void Connector::Stop()
+{
+	auto self = shared_from_this();
+	_reactor->PushFunctor([self]() {
+		self->_running = false;
+		if (self->_timer != kInvalidTimerId) {
+			self->_reactor->Cancel(self->_timer);
+			self->_timer = kInvalidTimerId;
+		}
+		if (self->_chan) {
+			self->_reactor->DelChannel(self->_chan);
+			self->_chan = nullptr;
+		}
+		self->_onConnected = nullptr;
+		self->_onFailed = nullptr;
+	});
+}
+
+void Connector::connect()
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		retry(errno);
+		return;
+	}
+	if (::connect(fd, reinterpret_cast<const sockaddr*>(&_addr), sizeof(_addr)) < 0 && errno != EINPROGRESS) {
+		int err = errno;
+		close(fd);
+		retry(err);
+		return;
+	}
+	// even a connect done at once goes through the poller, onConnected always runs the same way
+	_chan = _reactor->CreateChannel(fd, nullptr, nullptr, nullptr);
+	_chan->SetConnecting(true);
+	_chan->SetHandler(std::make_shared<Watch>(shared_from_this()));
+	_reactor->AddChannel(_chan, ChannelEvent_e::OUT);
+}
+
+void Connector::onWritable(Channel& chan)
+{
+	// the second report of one poll (error and hangup plus OUT), or a stopped connect
+	if (_chan.get() != &chan) {
+		return;
+	}
+	SpChannel conn = std::move(_chan);
+	_chan = nullptr;
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (getsockopt(conn->GetSocket(), SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+		err = errno;
+	}
+	if (err == 0 && is_self_connect(conn->GetSocket())) {
+		err = ECONNREFUSED;
+	}
+	if (err != 0) {
+		_reactor->DelChannel(conn);
+		retry(err);
+		return;
+	}
+	conn->SetConnecting(false);
+	_reactor->DisableEvents(conn, ChannelEvent_e::OUT);
+	_running = false;
+	_attempts = 0;
+	_onFailed = nullptr;
+	// the callbacks may hold whoever holds us, they go once used
+	CallBackFunc onConnected = std::move(_onConnected);
+	_onConnected = nullptr;
+	if (onConnected) {
+		onConnected(conn);
+	}
+}
+
+void Connector::retry(int err)
+{
+	_attempts++;
+	if (_maxAttempts > 0 && _attempts >= _maxAttempts) {
+		minilog(LogLevel_e::WARRNIG, "[%s] connect to %s failed: %s, giving up after %d tries", _reactor->GetName().c_str(),
+			FormatAddress(_addr).c_str(), strerror(err), _attempts);
+		_running = false;
+		_onConnected = nullptr;
+		ConnectFailedFunc onFailed = std::move(_onFailed);
+		_onFailed = nullptr;
+		if (onFailed) {
+			onFailed(err);
+		}
+		return;
+	}
+	uint64_t delay = nextDelay();
+	minilog(LogLevel_e::WARRNIG, "[%s] connect to %s failed: %s, retry in %d ms", _reactor->GetName().c_str(),
+		FormatAddress(_addr).c_str(), strerror(err), static_cast<int>(delay));
+	std::weak_ptr<Connector> weak = shared_from_this();
+	_timer = _reactor->RunAfter(delay, [weak]() {
+		if (auto self = weak.lock()) {
+			self->_timer = kInvalidTimerId;
+			if (self->_running) {
+				self->connect();
+			}
+		}
+	});
+}
+
+// somewhere in the upper half of the current backoff, which then doubles
+uint64_t Connector::nextDelay()
+{
+	static thread_local std::minstd_rand rng(static_cast<uint32_t>(monotonic_ns()));
+	uint64_t delay = _backoffMs / 2 + rng() % (_backoffMs - _backoffMs / 2 + 1);
+	_backoffMs = std::min(_backoffMs * 2, _maxMs);
+	return delay;
+}
+
+bool ParseAddress(const std::string& hostPort, sockaddr_in* addr)
+{
+	size_t colon = hostPort.rfind(':');
+	int port = colon == std::string::npos ? 0 : atoi(hostPort.c_str() + colon + 1);
+	if (port <= 0 || port > 65535) {
+		minilog(LogLevel_e::ERROR, "bad address %s, host:port expected", hostPort.c_str());
+		return false;
+	}
+	std::string host = hostPort.substr(0, colon);
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(static_cast<uint16_t>(port));
+	if (host.empty()) {
+		addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		return true;
+	}
+	if (inet_pton(AF_INET, host.c_str(), &addr->sin_addr) == 1) {
+		return true;
+	}
+	addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* res = nullptr;
+	int err = getaddrinfo(host.c_str(), nullptr, &hints, &res);
+	if (err != 0 || !res) {
+		minilog(LogLevel_e::ERROR, "can't resolve %s: %s", host.c_str(), gai_strerror(err));
+		return false;
+	}
+	addr->sin_addr = reinterpret_cast<sockaddr_in*>(res->ai_addr)->sin_addr;
+	freeaddrinfo(res);
+	return true;
+}
+
+std::string FormatAddress(const sockaddr_in& addr)
+{
+	char ip[INET_ADDRSTRLEN] = {};
+	inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+	return std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port));
+}
+
+/*--------------- shared_ptr -----------*/
+using SpConnector = std::shared_ptr<Connector>;
+SpConnector CreateSpConnector(const SpReactor& re, const sockaddr_in& addr, uint64_t minMs = kDefaultRetryMinMs,
+	uint64_t maxMs = kDefaultRetryMaxMs, int maxAttempts = 0)
+{
+	return std::make_shared<Connector>(re, addr, minMs, maxMs, maxAttempts);
+}
@@ -0,0 +1,346 @@
+#pragma once
+#if __cplusplus < 202002L
+#error "Coroutine.hpp needs -std=c++20, see the coro target in the makefile"
+#endif
+#include <coroutine>
+#include <exception>
+#include "Reactor.hpp"
+
+class CoConnection;
+
+/*
+ * Detached coroutine: runs as soon as it is called and frees its frame when it returns.
+ * Nobody awaits it, so an escaping exception is logged and ends it. A frame whose only
+ * parameter is a CoConnection& comes from that connection's reactor frame pool, other
+ * frames from the heap.
+ */
+class CoTask
+{
+public:
+	struct promise_type
+	{
+		CoTask get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception();
+
+		// not a template, -Wmismatched-new-delete takes a member template new and the plain delete for a mismatch
+		static void* operator new(size_t size, CoConnection& conn);
+		static void* operator new(size_t size) { return allocFrame(nullptr, size); }
+		static void operator delete(void* p, size_t size);
+	private:
+		static void* allocFrame(MemPool* pool, size_t size);
+	};
+};
+
+/*
+ * A channel served by a coroutine instead of callbacks:
+ *
+ *     CoTask echo(CoConnection& conn)
+ *     {
+ *         Buffer buf;
+ *         while (co_await conn.ReadSome(buf) > 0) {
+ *             if (co_await conn.WriteAll(buf) < 0) break;
+ *         }
+ *         conn.Close();
+ *     }
+ *     CoServe(re, chan, echo);
+ *
+ * The connection is the channel's ChannelHandler, so a suspended coroutine is resumed
+ * right from the poller's dispatch. One operation is awaited at a time. Returning from
+ * the coroutine does not close the channel, Close does; a channel closed by anyone else
+ * (idle timeout, DelChannel) destroys the suspended frame with it. Everything runs on
+ * the channel's reactor thread.
+ */
+class CoConnection : public ChannelHandler<CoConnection>, noncopyable
+{
+	friend struct CoTask::promise_type;
+public:
+	CoConnection(Reactor* re, Channel* chan);
+	~CoConnection();
+
+	struct ReadAwaiter
+	{
+		CoConnection& conn;
+		Buffer& buf;
+		ssize_t result;
+		bool await_ready() { return conn.tryRead(buf, &result); }
+		void await_suspend(std::coroutine_handle<> h) { conn.suspendRead(h, this); }
+		ssize_t await_resume() { return result; }
+	};
+	struct WriteAwaiter
+	{
+		CoConnection& conn;
+		ssize_t result;
+		bool await_ready() { return conn.tryWrite(&result); }
+		void await_suspend(std::coroutine_handle<> h) { conn.suspendWrite(h, this); }
+		ssize_t await_resume() { return result; }
+	};
+	struct SleepAwaiter
+	{
+		CoConnection& conn;
+		uint64_t ms;
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<> h) { conn.suspendSleep(h, ms); }
+		void await_resume() {}
+	};
+
+	// what the peer sent next, appended to buf: bytes read, 0 once the peer closed, -errno
+	ReadAwaiter ReadSome(Buffer& buf) { return ReadAwaiter{ *this, buf, 0 }; }
+	// done when the socket took all of it (and whatever was queued before): 0, or -errno
+	WriteAwaiter WriteAll(const char* data, size_t len);
+	WriteAwaiter WriteAll(const std::string& str) { return WriteAll(str.data(), str.size()); }
+	// takes buf's blocks, no copy
+	WriteAwaiter WriteAll(Buffer& buf);
+	// a timer on the connection's reactor, cancelled if the connection goes first
+	SleepAwaiter Sleep(uint64_t ms) { return SleepAwaiter{ *this, ms }; }
+	void Close();
+
+	Reactor& GetReactor() { return *_reactor; }
+	Channel& GetChannel() { return *_chan; }
+
+	void OnRead(Channel& chan);
+	void OnSend(Channel& chan);
+private:
+	bool tryRead(Buffer& buf, ssize_t* result);
+	bool tryWrite(ssize_t* result);
+	void suspendRead(std::coroutine_handle<> h, ReadAwaiter* reader);
+	void suspendWrite(std::coroutine_handle<> h, WriteAwaiter* writer);
+	void suspendSleep(std::coroutine_handle<> h, uint64_t ms);
+	void resume();
+private:
+	enum Wait_e { NOTHING, READ, WRITE, SLEEP };
+	Reactor* _reactor;
+	std::weak_ptr<Reactor> _weakReactor;	// expired once the reactor is being destroyed
+	Channel* _chan;					// owns this connection
+	SpMemPool _framePool;			// outlives the frames it handed out, the reactor may go first
+	std::coroutine_handle<> _waiting;
+	Wait_e _wait;
+	ReadAwaiter* _reader;			// in the suspended frame, gets the result
+	WriteAwaiter* _writer;
+	TimerId _timer;
+	bool _readOff;					// IN was turned off while nobody was reading
+	bool _readable;					// worth a Recv before waiting for the poller
+};
+
+// the pool a frame came from sits in front of it
+static const size_t kFrameHeader = 16;
+
+void* CoTask::promise_type::operator new(size_t size, CoConnection& conn)
+{
+	return allocFrame(conn._framePool.get(), size);
+}
+
+void* CoTask::promise_type::allocFrame(MemPool* pool, size_t size)
+{
+	void* p = pool ? pool->Alloc(size + kFrameHeader) : ::operator new(size + kFrameHeader);
+	*static_cast<MemPool**>(p) = pool;
+	return static_cast<char*>(p) + kFrameHeader;
+}
+
+void CoTask::promise_type::operator delete(void* frame, size_t size)
+{
+	void* p = static_cast<char*>(frame) - kFrameHeader;
+	MemPool* pool = *static_cast<MemPool**>(p);
+	if (pool) {
+		pool->Free(p, size + kFrameHeader);
+	}
+	else {
+		::operator delete(p);
+	}
+}
+
+void CoTask::promise_type::unhandled_exception()
+{
+	try {
+		std::rethrow_exception(std::current_exception());
+	}
+	catch (const std::exception& e) {
+		minilog(LogLevel_e::ERROR, "coroutine ended by exception: %s", e.what());
+	}
+	catch (...) {
+		minilog(LogLevel_e::ERROR, "coroutine ended by unknown exception");
+	}
+}
+
+CoConnection::CoConnection(Reactor* re, Channel* chan) :
+	_reactor(re),
+	_weakReactor(re->shared_from_this()),
+	_chan(chan),
+	_framePool(re->GetFramePool()),
+	_wait(NOTHING),
+	_reader(nullptr),
+	_writer(nullptr),
+	_timer(kInvalidTimerId),
+	_readOff(false),
+	_readable(true)
+{
+}
+
+CoConnection::~CoConnection()
+{
+	if (_timer != kInvalidTimerId) {
+		// a reactor being destroyed releases its channels after its timers are gone
+		if (SpReactor re = _weakReactor.lock()) {
+			re->Cancel(_timer);
+		}
+	}
+	if (_waiting) {
+		_waiting.destroy();
+	}
+}
+
+bool CoConnection::tryRead(Buffer& buf, ssize_t* result)
+{
+	while (_readable) {
+		int savedErrno = 0;
+		ssize_t n = _chan->Recv(&savedErrno);
+		if (n > 0) {
+			buf.Append(_chan->GetRecvBuffer());
+			// a level triggered poller reports what is left, so the next read waits for it
+			// instead of paying a recv that mostly ends in EAGAIN; one read per event, like
+			// the callback path
+			_readable = _chan->IsEdgeTriggered();
+			*result = n;
+			return true;
+		}
+		if (n == 0) {
+			*result = 0;
+			return true;
+		}
+		if (savedErrno == EINTR) {
+			continue;
+		}
+		if (savedErrno == EAGAIN || savedErrno == EWOULDBLOCK) {
+			_readable = false;
+			return false;
+		}
+		*result = -savedErrno;
+		return true;
+	}
+	return false;
+}
+
+bool CoConnection::tryWrite(ssize_t* result)
+{
+	while (_chan->HasOutput()) {
+		int savedErrno = 0;
+		ssize_t n = _chan->Flush(&savedErrno);
+		if (n > 0 || (n < 0 && savedErrno == EINTR)) {
+			continue;
+		}
+		if (n < 0 && savedErrno != EAGAIN && savedErrno != EWOULDBLOCK) {
+			*result = -savedErrno;
+			return true;
+		}
+		return false;
+	}
+	*result = 0;
+	return true;
+}
+
+CoConnection::WriteAwaiter CoConnection::WriteAll(const char* data, size_t len)
+{
+	_chan->AppendSendBuffer(data, len);
+	return WriteAwaiter{ *this, 0 };
+}
+
+CoConnection::WriteAwaiter CoConnection::WriteAll(Buffer& buf)
+{
+	_chan->AppendSendBuffer(buf);
+	return WriteAwaiter{ *this, 0 };
+}
+
+void CoConnection::suspendRead(std::coroutine_handle<> h, ReadAwaiter* reader)
+{
+	_waiting = h;
+	_wait = READ;
+	_reader = reader;
+	if (_readOff) {
+		_readOff = false;
+		_reactor->EnableEvents(_chan->shared_from_this(), ChannelEvent_e::IN);
+	}
+}
+
+void CoConnection::suspendWrite(std::coroutine_handle<> h, WriteAwaiter* writer)
+{
+	_waiting = h;
+	_wait = WRITE;
+	_writer = writer;
+	_reactor->EnableEvents(_chan->shared_from_this(), ChannelEvent_e::OUT);
+}
+
+void CoConnection::suspendSleep(std::coroutine_handle<> h, uint64_t ms)
+{
+	_waiting = h;
+	_wait = SLEEP;
+	_timer = _reactor->RunAfter(ms, [this]() {
+		_timer = kInvalidTimerId;
+		resume();
+	});
+}
+
+void CoConnection::resume()
+{
+	std::coroutine_handle<> h = _waiting;
+	_waiting = nullptr;
+	_wait = NOTHING;
+	_reader = nullptr;
+	_writer = nullptr;
+	h.resume();
+}
+
+void CoConnection::OnRead(Channel& chan)
+{
+	_readable = true;
+	if (_wait != READ) {
+		// nobody reads right now, stop a level triggered poller from reporting it again
+		if (!_readOff) {
+			_readOff = true;
+			_reactor->DisableEvents(chan.shared_from_this(), ChannelEvent_e::IN);
+		}
+		return;
+	}
+	if (tryRead(_reader->buf, &_reader->result)) {
+		resume();
+	}
+}
+
+void CoConnection::OnSend(Channel& chan)
+{
+	ssize_t result = 0;
+	if (!tryWrite(&result)) {
+		return;
+	}
+	_reactor->DisableEvents(chan.shared_from_this(), ChannelEvent_e::OUT);
+	if (_wait == WRITE) {
+		_writer->result = result;
+		resume();
+	}
+}
+
+void CoConnection::Close()
+{
+	_reactor->DelChannel(_chan->shared_from_this());
+}
+
+/*
+ * Adds chan to re and starts handler(conn) on re's thread once it is in the poller.
+ * Callable from any thread, like AddChannel.
+ */
+template <typename F>
+void CoServe(const SpReactor& re, const SpChannel& chan, F handler)
+{
+	auto conn = std::make_shared<CoConnection>(re.get(), chan.get());
+	chan->SetHandler(conn);
+	re->AddChannel(chan, ChannelEvent_e::IN);
+	// queued behind the AddChannel, the channel owns conn and outlives the coroutine's start
+	std::weak_ptr<Channel> weak = chan;
+	CoConnection* raw = conn.get();
+	re->PushFunctor([weak, raw, handler]() {
+		if (SpChannel chan = weak.lock()) {
+			handler(*raw);
+		}
+	});
+}
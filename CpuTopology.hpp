@@ -0,0 +1,291 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include "utils.h"
+#include "MiniLog.hpp"
+
+struct CpuInfo
+{
+	int cpu;
+	int core;			// core_id, unique within its package only
+	int package;
+	int node;			// 0 when the kernel has no NUMA nodes
+};
+
+/*
+ * The CPUs this process may run on (sched_getaffinity, so taskset and cpusets are
+ * respected) and how they group into physical cores and NUMA nodes, read from sysfs.
+ */
+class CpuTopology
+{
+public:
+	static CpuTopology Detect();
+	const std::vector<CpuInfo>& Cpus() const { return _cpus; }
+	// nullptr for a CPU we may not run on
+	const CpuInfo* Find(int cpu) const;
+	size_t CoreCount() const;
+	size_t NodeCount() const;
+	// the node a network interface's device sits on, -1 if unknown (virtual devices, no NUMA)
+	static int NicNode(const std::string& ifname);
+	// "cpu 2 (core 1, node 0)", or "cpus 1,3" for a set
+	std::string Describe(const std::vector<int>& cpus) const;
+private:
+	std::vector<CpuInfo> _cpus;
+};
+
+// where the threads of a server go
+struct CpuLayout
+{
+	std::vector<int> reactorCpus;	// reactor i runs on reactorCpus[i]
+	std::vector<int> spareCpus;		// for the acceptor, admin and logger threads, may be empty
+	int node;						// node the reactors were placed on, -1 for any
+};
+
+// "0-3,8,10-11", empty for a malformed list
+std::vector<int> ParseCpuList(const std::string& list);
+std::string FormatCpuList(const std::vector<int>& cpus);
+
+/*
+ * One reactor per physical core: the first hardware thread of each core, SMT siblings
+ * skipped, cores of node first (the NIC's node, -1 for no preference). reactors of 0
+ * is one per core of node, or of the whole machine without one. The CPUs left over are
+ * spare, other cores before the reactors' siblings. More reactors than cores share them.
+ */
+CpuLayout PlanCpuLayout(const CpuTopology& topo, size_t reactors, int node = -1);
+// reactor i on cpus[i % cpus.size()], the CPUs of the list beyond the reactors are spare
+CpuLayout ListCpuLayout(const std::vector<int>& cpus, size_t reactors);
+
+// false (and logged) when the kernel refuses, e.g. a CPU outside our cpuset
+bool SetThreadAffinity(pthread_t thread, const std::vector<int>& cpus);
+// shown by top -H, perf and gdb; the kernel keeps 15 characters
+void SetThreadName(pthread_t thread, const std::string& name);
+
+static int read_int_file(const std::string& path, int fallback)
+{
+	FILE* fp = fopen(path.c_str(), "r");
+	if (!fp) {
+		return fallback;
+	}
+	int value = fallback;
+	if (fscanf(fp, "%d", &value) != 1) {
+		value = fallback;
+	}
+	fclose(fp);
+	return value;
+}
+
+// sysfs links a CPU to its node as a cpuN/nodeM directory entry
+static int cpu_node(int cpu)
+{
+	std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+	DIR* dir = opendir(path.c_str());
+	if (!dir) {
+		return 0;
+	}
+	int node = 0;
+	while (dirent* entry = readdir(dir)) {
+		if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+			node = atoi(entry->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+CpuTopology CpuTopology::Detect()
+{
+	CpuTopology topo;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+		minilog(LogLevel_e::ERROR, "sched_getaffinity error = %s", strerror(errno));
+		return topo;
+	}
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &set)) {
+			continue;
+		}
+		std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+		CpuInfo info;
+		info.cpu = cpu;
+		// without sysfs every CPU counts as a core of its own
+		info.core = read_int_file(dir + "core_id", cpu);
+		info.package = read_int_file(dir + "physical_package_id", 0);
+		info.node = cpu_node(cpu);
+		topo._cpus.push_back(info);
+	}
+	return topo;
+}
+
+const CpuInfo* CpuTopology::Find(int cpu) const
+{
+	for (auto& info : _cpus) {
+		if (info.cpu == cpu) {
+			return &info;
+		}
+	}
+	return nullptr;
+}
+
+size_t CpuTopology::CoreCount() const
+{
+	std::map<std::pair<int, int>, int> cores;
+	for (auto& info : _cpus) {
+		cores[std::make_pair(info.package, info.core)] = info.cpu;
+	}
+	return cores.size();
+}
+
+size_t CpuTopology::NodeCount() const
+{
+	std::vector<int> nodes;
+	for (auto& info : _cpus) {
+		if (std::find(nodes.begin(), nodes.end(), info.node) == nodes.end()) {
+			nodes.push_back(info.node);
+		}
+	}
+	return nodes.size();
+}
+
+int CpuTopology::NicNode(const std::string& ifname)
+{
+	if (ifname.empty()) {
+		return -1;
+	}
+	return read_int_file("/sys/class/net/" + ifname + "/device/numa_node", -1);
+}
+
+std::string CpuTopology::Describe(const std::vector<int>& cpus) const
+{
+	if (cpus.empty()) {
+		return "any cpu";
+	}
+	if (cpus.size() > 1) {
+		return "cpus " + FormatCpuList(cpus);
+	}
+	const CpuInfo* info = Find(cpus[0]);
+	if (!info) {
+		return "cpu " + std::to_string(cpus[0]);
+	}
+	return "cpu " + std::to_string(info->cpu) + " (core " + std::to_string(info->core) +
+		", node " + std::to_string(info->node) + ")";
+}
+
+std::vector<int> ParseCpuList(const std::string& list)
+{
+	std::vector<int> cpus;
+	size_t pos = 0;
+	while (pos < list.size()) {
+		size_t end = list.find(',', pos);
+		if (end == std::string::npos) {
+			end = list.size();
+		}
+		int first = 0;
+		int last = 0;
+		char tail = 0;
+		std::string item = list.substr(pos, end - pos);
+		int n = sscanf(item.c_str(), "%d-%d%c", &first, &last, &tail);
+		if (n == 1) {
+			last = first;
+		}
+		if ((n != 1 && n != 2) || first < 0 || last < first || last >= CPU_SETSIZE) {
+			return std::vector<int>();
+		}
+		for (int cpu = first; cpu <= last; cpu++) {
+			cpus.push_back(cpu);
+		}
+		pos = end + 1;
+	}
+	return cpus;
+}
+
+std::string FormatCpuList(const std::vector<int>& cpus)
+{
+	std::string out;
+	for (size_t i = 0; i < cpus.size(); i++) {
+		if (i > 0) {
+			out += ",";
+		}
+		out += std::to_string(cpus[i]);
+	}
+	return out;
+}
+
+CpuLayout PlanCpuLayout(const CpuTopology& topo, size_t reactors, int node)
+{
+	CpuLayout layout;
+	layout.node = node;
+	// the first hardware thread of every core, the preferred node's cores in front
+	std::vector<const CpuInfo*> firsts;
+	std::vector<const CpuInfo*> siblings;
+	std::map<std::pair<int, int>, bool> seen;
+	for (auto& info : topo.Cpus()) {
+		bool& taken = seen[std::make_pair(info.package, info.core)];
+		(taken ? siblings : firsts).push_back(&info);
+		taken = true;
+	}
+	std::stable_partition(firsts.begin(), firsts.end(), [node](const CpuInfo* info) { return info->node == node; });
+	size_t local = std::count_if(firsts.begin(), firsts.end(), [node](const CpuInfo* info) { return info->node == node; });
+	if (reactors == 0) {
+		reactors = local > 0 ? local : firsts.size();
+	}
+	if (local == 0) {
+		layout.node = -1;
+	}
+	for (size_t i = 0; i < reactors && !firsts.empty(); i++) {
+		layout.reactorCpus.push_back(firsts[i % firsts.size()]->cpu);
+	}
+	// cores without a reactor first, then the reactors' own siblings
+	for (size_t i = reactors; i < firsts.size(); i++) {
+		layout.spareCpus.push_back(firsts[i]->cpu);
+	}
+	for (auto info : siblings) {
+		layout.spareCpus.push_back(info->cpu);
+	}
+	return layout;
+}
+
+CpuLayout ListCpuLayout(const std::vector<int>& cpus, size_t reactors)
+{
+	CpuLayout layout;
+	layout.node = -1;
+	if (cpus.empty()) {
+		return layout;
+	}
+	if (reactors == 0) {
+		reactors = cpus.size();
+	}
+	for (size_t i = 0; i < reactors; i++) {
+		layout.reactorCpus.push_back(cpus[i % cpus.size()]);
+	}
+	for (size_t i = reactors; i < cpus.size(); i++) {
+		layout.spareCpus.push_back(cpus[i]);
+	}
+	return layout;
+}
+
+bool SetThreadAffinity(pthread_t thread, const std::vector<int>& cpus)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus) {
+		CPU_SET(cpu, &set);
+	}
+	int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if (err != 0) {
+		minilog(LogLevel_e::ERROR, "can't pin thread to cpus %s: %s", FormatCpuList(cpus).c_str(), strerror(err));
+		return false;
+	}
+	return true;
+}
+
+void SetThreadName(pthread_t thread, const std::string& name)
+{
+	pthread_setname_np(thread, name.substr(0, 15).c_str());
+}
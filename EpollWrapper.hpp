@@ -1,85 +1,124 @@
 #pragma once
 
-#include <map>
 #include <vector>
+#include <atomic>
 
 #include "utils.h"
 #include "MiniLog.hpp"
 #include "Channel.hpp"
+#include "PollerInterface.h"
 
-class EpollWrapper : noncopyable
+class EpollWrapper : public PollerInterface, noncopyable
 {
 public:
     EpollWrapper();
     ~EpollWrapper();
-    bool Add(SpChannel, ChannelEvent_e);
-    bool Delete(SpChannel);
-    bool Modify(SpChannel, ChannelEvent_e);
-    int PollOnce(int);
+    bool Add(SpChannel, ChannelEvent_e) override;
+    bool Delete(SpChannel) override;
+    bool Modify(SpChannel, ChannelEvent_e) override;
+    int PollOnce(int) override;
 
-    bool IsChannelInEpoll(SpChannel) const;
-    size_t GetChannelNum() const;
+    bool HasChannel(SpChannel) const override;
+    size_t GetChannelNum() const override;
     int GetEpollFd() const { return _epoll;}
+    int GetWaitFd() const override { return _epoll;}
+    uint64_t GetPollTime() const override { return _pollTimeMs;}
+    bool HasPending() const override { return !_resumeList.empty();}
+    PollerBackend_e GetBackend() const override { return PollerBackend_e::EPOLL;}
+    void SetMetrics(ReactorMetrics* metrics) override { _metrics = metrics;}
+private:
+    void resumeReads();
+    SpChannel* findSlot(int fd);
 private:
     static const int kInitEventsListSize = 16;
+    static const int kInitChannelsSize = 1024;
     int _epoll;
-    std::map<int, SpChannel> _channels;
+    std::vector<SpChannel> _channels;     // indexed by fd, owns the channels in epoll
     std::vector<epoll_event> _eventsList;
+    std::atomic<size_t> _channelNum;      // readable from other threads, e.g. by dispatchers
+    std::vector<SpChannel> _resumeList;   // edge triggered channels that stopped reading early
+    bool _dispatching;
+    uint64_t _pollTimeMs;                 // monotonic ms taken when the last batch of events arrived
+    std::vector<SpChannel> _deferredFree; // channels deleted while their events may still be in _eventsList
+    ReactorMetrics* _metrics;
 };
 
 EpollWrapper::EpollWrapper():
     _epoll(epoll_create1(EPOLL_CLOEXEC)),
-    _eventsList(kInitEventsListSize)
+    _channels(kInitChannelsSize),
+    _eventsList(kInitEventsListSize),
+    _channelNum(0),
+    _dispatching(false),
+    _pollTimeMs(monotonic_ms()),
+    _metrics(nullptr)
 {
 
 }
 
 EpollWrapper::~EpollWrapper()
 {
-    for (auto iter = _channels.begin(); iter != _channels.end(); iter++){
-        close(iter->first);
-    }
+    // the channels close their own fds once the last reference is gone
     _channels.clear();
     close(_epoll);
 }
 
-bool EpollWrapper::Add(SpChannel chan, ChannelEvent_e evts) 
+SpChannel* EpollWrapper::findSlot(int fd)
+{
+    if(fd < 0 || static_cast<size_t>(fd) >= _channels.size() || !_channels[fd]){
+        return nullptr;
+    }
+    return &_channels[fd];
+}
+
+bool EpollWrapper::Add(SpChannel chan, ChannelEvent_e evts)
 {
     int fd = chan->GetSocket();
-    if(_channels.find(fd) != _channels.end()){
+    if(findSlot(fd)){
         Modify(chan, evts);
         return true;
     }
     epoll_event evt{};
-    evt.events = evts;
-    evt.data.fd = fd;
+    evt.events = chan->activeEvents(evts) | (chan->IsEdgeTriggered() ? static_cast<uint32_t>(EPOLLET) : 0u);
+    evt.data.ptr = chan.get();
     if(epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &evt) < 0){
         minilog(LogLevel_e::ERROR, "epoll ctl add error = %s", strerror(errno));
         return false;
     }
     else{
+        if(static_cast<size_t>(fd) >= _channels.size()){
+            _channels.resize(std::max(static_cast<size_t>(fd) + 1, _channels.size() * 2));
+        }
         chan->SetEvents(evts);
+        chan->_registered = evt.events;
+        chan->_inEpoll = true;
+        chan->_metrics = _metrics;
         _channels[fd] = chan;
+        _channelNum.fetch_add(1, std::memory_order_relaxed);
         return true;
-    } 
+    }
 }
 
 bool EpollWrapper::Delete(SpChannel chan)
 {
     int fd = chan->GetSocket();
-    if(_channels.find(fd) == _channels.end()){
+    SpChannel* slot = findSlot(fd);
+    if(!slot){
         return true;
     }
     epoll_event evt{};
-    evt.data.fd = fd;
     if(epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, &evt) < 0){
         minilog(LogLevel_e::ERROR, "epoll ctl del error = %s", strerror(errno));
         return false;
     }
     else{
-        close(fd);
-        _channels[fd].reset();
-        _channels.erase(fd);
+        (*slot)->_inEpoll = false;
+        (*slot)->_metrics = nullptr;
+        (*slot)->_registered = 0;
+        if(_dispatching){
+            _deferredFree.emplace_back(std::move(*slot));
+        }
+        slot->reset();
+        _channelNum.fetch_sub(1, std::memory_order_relaxed);
         return true;
     }
 }
@@ -87,24 +126,31 @@ bool EpollWrapper::Delete(SpChannel chan)
 bool EpollWrapper::Modify(SpChannel chan, ChannelEvent_e evts)
 {
     int fd = chan->GetSocket();
-    if(_channels.find(fd) == _channels.end()){
+    SpChannel* slot = findSlot(fd);
+    if(!slot){
         return false;
     }
     epoll_event evt{};
-    evt.data.fd = fd; 
-    evt.events = evts;
-    if(epoll_ctl(_epoll, EPOLL_CTL_MOD, fd, &evt) < 0){
+    evt.data.ptr = slot->get();
+    // while the channel's output is over its water mark reading stays off, a later MOD
+    // that turns it back on reports data already waiting, even edge triggered
+    evt.events = chan->activeEvents(evts) | (chan->IsEdgeTriggered() ? static_cast<uint32_t>(EPOLLET) : 0u);
+    if(evt.events != (*slot)->_registered && epoll_ctl(_epoll, EPOLL_CTL_MOD, fd, &evt) < 0){
         minilog(LogLevel_e::ERROR, "epoll ctl mod error = %s", strerror(errno));
         return false;
     }
     else{
-        _channels[fd]->SetEvents(evts);
+        (*slot)->SetEvents(evts);
+        (*slot)->_registered = evt.events;
         return true;
     }
 }
 
 int EpollWrapper::PollOnce(int timeout)
 {
+    if(!_resumeList.empty()){
+        timeout = 0;
+    }
     int activeNums = epoll_wait(_epoll, &_eventsList[0], static_cast<int>(_eventsList.size()), timeout);
     if (activeNums < 0)
     {
@@ -120,41 +166,91 @@ int EpollWrapper::PollOnce(int timeout)
     }
     else
     {
-        if(static_cast<size_t>(activeNums) == _eventsList.size()){
-            _eventsList.resize(_eventsList.size()*2);
-        }   
+        _pollTimeMs = monotonic_ms();
+        uint64_t dispatchStart = 0;
+        if(_metrics){
+            dispatchStart = _metrics->pollReturnNs = monotonic_ns();
+        }
+        _dispatching = true;
         for (int i = 0; i < activeNums; i++)
         {
-            int fd = _eventsList[i].data.fd;
+            Channel* chan = static_cast<Channel*>(_eventsList[i].data.ptr);
             int evts = _eventsList[i].events;
-            if(_channels.find(fd) != _channels.end()){
-                auto chan = _channels[fd];
-                if(evts & EPOLLIN){
-                    chan->HandleRead();
-                }
-                if(evts & EPOLLOUT){
-                    chan->HandleSend();
+            // deleted by an earlier callback of this batch, kept alive by _deferredFree
+            if(!chan->_inEpoll){
+                continue;
+            }
+            // paused by an earlier callback of this batch; errors and hangups still get
+            // through, nothing else would report them while IN is off
+            if(((evts & EPOLLIN) && !chan->_readPaused) || (evts & (EPOLLERR | EPOLLHUP))){
+                chan->_lastActiveMs = _pollTimeMs;
+                chan->HandleRead();
+                if(chan->_resumeRead){
+                    chan->_resumeRead = false;
+                    if(chan->IsEdgeTriggered() && chan->_inEpoll){
+                        _resumeList.emplace_back(_channels[chan->GetSocket()]);
+                    }
                 }
             }
-            else{
-                epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, &_eventsList[i]);
+            if((evts & EPOLLOUT) && chan->_inEpoll){
+                chan->HandleSend();
             }
         }
+        _dispatching = false;
+        _deferredFree.clear();
+        if(_metrics){
+            uint64_t ns = monotonic_ns() - dispatchStart;
+            _metrics->events.Add(activeNums);
+            _metrics->eventsPerPoll.Record(activeNums);
+            _metrics->callbackNs.Add(ns);
+            _metrics->callbackBatchNs.Record(ns);
+        }
+        if(static_cast<size_t>(activeNums) == _eventsList.size()){
+            _eventsList.resize(_eventsList.size()*2);
+        }
+    }
+    resumeReads();
+    if(_metrics){
+        _metrics->polls.Add();
+        if(activeNums <= 0){
+            _metrics->emptyPolls.Add();
+        }
     }
     return activeNums;
 }
 
-bool EpollWrapper::IsChannelInEpoll(SpChannel chan) const
+// No new edge will be reported for data left in the socket, so re-dispatch
+// the channels that hit their fairness cap once all ready events are served.
+void EpollWrapper::resumeReads()
 {
-    if(_channels.find(chan->_fd) != _channels.end()){
-        return true;
+    if(_resumeList.empty()){
+        return;
+    }
+    std::vector<SpChannel> resumeList;
+    resumeList.swap(_resumeList);
+    for (auto& chan : resumeList){
+        if(!chan->_inEpoll || chan->_readPaused){
+            continue;
+        }
+        chan->HandleRead();
+        if(chan->_resumeRead){
+            chan->_resumeRead = false;
+            if(chan->_inEpoll){
+                _resumeList.emplace_back(chan);
+            }
+        }
     }
-    return false;
+}
+
+bool EpollWrapper::HasChannel(SpChannel chan) const
+{
+    int fd = chan->_fd;
+    return fd >= 0 && static_cast<size_t>(fd) < _channels.size() && _channels[fd] == chan;
 }
 
 size_t EpollWrapper::GetChannelNum() const
 {
-    return _channels.size();
+    return _channelNum.load(std::memory_order_relaxed);
 }
 
 /* -------------------- shared_ptr ---------------------*/
@@ -162,4 +258,4 @@ using SpEpoll = std::shared_ptr<EpollWrapper>;
 SpEpoll CreateSpEpoll()
 {
     return std::make_shared<EpollWrapper>();
-}
\ No newline at end of file
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <sys/stat.h>
+#include "utils.h"
+#include "MiniLog.hpp"
+
+// An open file to serve from, shared by every channel sending a part of it (Channel::SendFile);
+// closed once the last of them is done.
+class FileSource : noncopyable
+{
+public:
+	FileSource(int fd, size_t size) : _fd(fd), _size(size) {}
+	~FileSource() { close(_fd); }
+	int GetFd() const { return _fd; }
+	// at open time, a file that shrinks meanwhile fails the channels still sending it
+	size_t GetSize() const { return _size; }
+private:
+	int _fd;
+	size_t _size;
+};
+
+/*--------------- shared_ptr -----------*/
+using SpFileSource = std::shared_ptr<FileSource>;
+// nullptr (and logged) when path can't be opened or is not a regular file
+SpFileSource CreateSpFileSource(const std::string& path)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		minilog(LogLevel_e::ERROR, "can't open %s: %s", path.c_str(), strerror(errno));
+		return nullptr;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		minilog(LogLevel_e::ERROR, "%s is not a regular file", path.c_str());
+		close(fd);
+		return nullptr;
+	}
+	return std::make_shared<FileSource>(fd, static_cast<size_t>(st.st_size));
+}
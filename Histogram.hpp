@@ -0,0 +1,181 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+#include "utils.h"
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram:
+ *
+ *   [0, 256)            one bucket per value
+ *   [2^k, 2^(k+1))      128 buckets each, k >= 8
+ *
+ * so any recorded value is reported within 1/128 (< 0.8%) of itself, over the whole
+ * uint64 range, with a fixed 58KB of counters and an O(1) Record.
+ * Not thread safe: keep one per thread and Merge them for the report, or use
+ * AtomicHistogram when another thread has to read it while it is being written.
+ */
+class Histogram
+{
+	friend class AtomicHistogram;
+public:
+	Histogram();
+	void Record(uint64_t value, uint64_t count = 1);
+	void Merge(const Histogram& other);
+	void Reset();
+	uint64_t Count() const { return _count; }
+	uint64_t Min() const { return _count ? _min : 0; }
+	uint64_t Max() const { return _max; }
+	double Mean() const { return _count ? static_cast<double>(_sum) / _count : 0.0; }
+	// smallest recorded value (to bucket precision) that p percent of the samples don't exceed
+	uint64_t Percentile(double p) const;
+private:
+	static size_t bucketIndex(uint64_t value);
+	static uint64_t bucketHighest(size_t index);
+private:
+	static const int kSubBucketBits = 7;
+	static const uint64_t kSubBucketCount = 1ull << kSubBucketBits;
+	static const size_t kBucketNum = (64 - kSubBucketBits) * kSubBucketCount + kSubBucketCount;
+	std::vector<uint64_t> _buckets;
+	uint64_t _count;
+	uint64_t _sum;
+	uint64_t _min;
+	uint64_t _max;
+};
+
+Histogram::Histogram() :
+	_buckets(kBucketNum, 0),
+	_count(0),
+	_sum(0),
+	_min(UINT64_MAX),
+	_max(0)
+{
+}
+
+size_t Histogram::bucketIndex(uint64_t value)
+{
+	if (value < 2 * kSubBucketCount) {
+		return static_cast<size_t>(value);
+	}
+	int shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+	return static_cast<size_t>(shift) * kSubBucketCount + (value >> shift);
+}
+
+uint64_t Histogram::bucketHighest(size_t index)
+{
+	if (index < 2 * kSubBucketCount) {
+		return index;
+	}
+	int shift = static_cast<int>(index / kSubBucketCount) - 1;
+	uint64_t top = index - static_cast<uint64_t>(shift) * kSubBucketCount;
+	return ((top + 1) << shift) - 1;
+}
+
+void Histogram::Record(uint64_t value, uint64_t count)
+{
+	_buckets[bucketIndex(value)] += count;
+	_count += count;
+	_sum += value * count;
+	_min = std::min(_min, value);
+	_max = std::max(_max, value);
+}
+
+void Histogram::Merge(const Histogram& other)
+{
+	for (size_t i = 0; i < kBucketNum; i++) {
+		_buckets[i] += other._buckets[i];
+	}
+	_count += other._count;
+	_sum += other._sum;
+	_min = std::min(_min, other._min);
+	_max = std::max(_max, other._max);
+}
+
+void Histogram::Reset()
+{
+	std::fill(_buckets.begin(), _buckets.end(), 0);
+	_count = 0;
+	_sum = 0;
+	_min = UINT64_MAX;
+	_max = 0;
+}
+
+uint64_t Histogram::Percentile(double p) const
+{
+	if (_count == 0) {
+		return 0;
+	}
+	uint64_t rank = static_cast<uint64_t>(p / 100.0 * _count + 0.5);
+	rank = std::max<uint64_t>(1, std::min(rank, _count));
+	uint64_t seen = 0;
+	for (size_t i = 0; i < kBucketNum; i++) {
+		seen += _buckets[i];
+		if (seen >= rank) {
+			return std::min(bucketHighest(i), _max);
+		}
+	}
+	return _max;
+}
+
+/*
+ * Histogram with one writer thread and any number of concurrent readers, e.g. a reactor
+ * recording its loop latencies while an admin thread exports them. The writer does
+ * relaxed load + store, no read-modify-write, so recording costs what a plain
+ * increment does; a reader's Snapshot may be a few samples behind.
+ */
+class AtomicHistogram : noncopyable
+{
+public:
+	AtomicHistogram();
+	void Record(uint64_t value);
+	// adds the current contents to hist
+	void Snapshot(Histogram& hist) const;
+	uint64_t Count() const { return _count.load(std::memory_order_relaxed); }
+	uint64_t Sum() const { return _sum.load(std::memory_order_relaxed); }
+private:
+	static void bump(std::atomic<uint64_t>& v, uint64_t n)
+	{
+		v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+private:
+	std::vector<std::atomic<uint64_t>> _buckets;
+	std::atomic<uint64_t> _count;
+	std::atomic<uint64_t> _sum;
+	std::atomic<uint64_t> _max;
+};
+
+AtomicHistogram::AtomicHistogram() :
+	_buckets(Histogram::kBucketNum),
+	_count(0),
+	_sum(0),
+	_max(0)
+{
+}
+
+void AtomicHistogram::Record(uint64_t value)
+{
+	bump(_buckets[Histogram::bucketIndex(value)], 1);
+	bump(_sum, value);
+	if (value > _max.load(std::memory_order_relaxed)) {
+		_max.store(value, std::memory_order_relaxed);
+	}
+	bump(_count, 1);
+}
+
+void AtomicHistogram::Snapshot(Histogram& hist) const
+{
+	// the count is taken from the buckets so that percentiles stay consistent with them
+	uint64_t count = 0;
+	for (size_t i = 0; i < Histogram::kBucketNum; i++) {
+		uint64_t n = _buckets[i].load(std::memory_order_relaxed);
+		if (n) {
+			hist._buckets[i] += n;
+			hist._min = std::min(hist._min, Histogram::bucketHighest(i));
+			count += n;
+		}
+	}
+	hist._count += count;
+	hist._sum += _sum.load(std::memory_order_relaxed);
+	hist._max = std::max(hist._max, _max.load(std::memory_order_relaxed));
+}
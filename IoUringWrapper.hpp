@@ -0,0 +1,654 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/io_uring.h>
+
+#include "utils.h"
+#include "MiniLog.hpp"
+#include "Channel.hpp"
+#include "PollerInterface.h"
+
+/*
+ * Completion based poller on a raw io_uring (no liburing):
+ *   - listeners keep one multishot accept armed, accepted fds queue up for Channel::Accept
+ *   - sockets keep one multishot recv armed on a provided buffer ring, data is appended to
+ *     the recv buffer before the read handler runs and Channel::Recv reports it
+ *   - anything else (e.g. the reactor's eventfd) gets a multishot poll, i.e. readiness
+ *   - channels with OUT enabled get one sendmsg over their send buffer at a time; all
+ *     sends and re-arms queued during a loop go to the kernel with the next wait, in one
+ *     io_uring_enter
+ * Needs multishot recv (5.19/6.0) and ring provided buffers, Init fails without them and
+ * the reactor falls back to epoll. Not thread safe, it belongs to one reactor.
+ */
+class IoUringWrapper : public PollerInterface, noncopyable
+{
+public:
+    IoUringWrapper();
+    ~IoUringWrapper();
+    // sets the ring up, false if the kernel lacks anything needed
+    bool Init();
+    bool Add(SpChannel, ChannelEvent_e) override;
+    bool Delete(SpChannel) override;
+    bool Modify(SpChannel, ChannelEvent_e) override;
+    int PollOnce(int) override;
+
+    bool HasChannel(SpChannel) const override;
+    size_t GetChannelNum() const override { return _channelNum.load(std::memory_order_relaxed);}
+    int GetWaitFd() const override { return _ring;}
+    uint64_t GetPollTime() const override { return _pollTimeMs;}
+    bool HasPending() const override;
+    PollerBackend_e GetBackend() const override { return PollerBackend_e::IO_URING;}
+    void SetMetrics(ReactorMetrics* metrics) override { _metrics = metrics;}
+private:
+    enum Op_e : uint64_t
+    {
+        kOpRecv = 1,
+        kOpSend = 2,
+        kOpAccept = 3,
+        kOpPoll = 4,
+        kOpMask = 7     // channels are at least 8 byte aligned, the op rides in the low bits
+    };
+    io_uring_sqe* getSqe();
+    int enter(unsigned minComplete, int timeout);
+    void arm(Channel* chan);
+    void cancel(Channel* chan, Op_e op);
+    void cancelAll(Channel* chan);
+    void submitSend(Channel* chan);
+    void prepareSends();
+    void handleCqe(uint64_t userData, int res, uint32_t flags);
+    void recycleBuffer(uint16_t bid);
+    void releaseClosed();
+    SpChannel* findSlot(int fd);
+private:
+    static const unsigned kSqEntries = 1024;
+    static const unsigned kCqEntries = 4096;
+    static const unsigned kBufEntries = 256;        // provided recv buffers, a power of 2
+    static const unsigned kBufSize = 4096;
+    static const uint16_t kBufGroup = 0;
+    static const int kInitChannelsSize = 1024;
+    int _ring;
+    void* _ringMem;
+    size_t _ringMemSize;
+    io_uring_sqe* _sqes;
+    size_t _sqesSize;
+    unsigned* _sqHead;
+    unsigned* _sqTail;
+    unsigned _sqMask;
+    unsigned _sqEntries;
+    unsigned _sqeTail;      // local tail, published on enter
+    unsigned _toSubmit;
+    unsigned* _cqHead;
+    unsigned* _cqTail;
+    unsigned _cqMask;
+    io_uring_cqe* _cqes;
+    io_uring_buf* _bufRing;             // the ring tail overlays the resv field of entry 0
+    char* _bufMem;
+    uint16_t _bufTail;
+    std::vector<SpChannel> _channels;   // indexed by fd, owns the channels added
+    std::atomic<size_t> _channelNum;
+    std::vector<SpChannel> _writers;    // channels with OUT enabled
+    std::vector<SpChannel> _closing;    // deleted, kept alive until the kernel is done with them
+    uint64_t _pollTimeMs;
+    ReactorMetrics* _metrics;
+};
+
+IoUringWrapper::IoUringWrapper():
+    _ring(-1),
+    _ringMem(MAP_FAILED),
+    _ringMemSize(0),
+    _sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+    _sqesSize(0),
+    _sqeTail(0),
+    _toSubmit(0),
+    _bufRing(static_cast<io_uring_buf*>(MAP_FAILED)),
+    _bufMem(nullptr),
+    _bufTail(0),
+    _channels(kInitChannelsSize),
+    _channelNum(0),
+    _pollTimeMs(monotonic_ms()),
+    _metrics(nullptr)
+{
+
+}
+
+IoUringWrapper::~IoUringWrapper()
+{
+    // closing the ring cancels whatever is still in flight
+    if (_ring >= 0) {
+        close(_ring);
+    }
+    _channels.clear();
+    _writers.clear();
+    _closing.clear();
+    if (_bufRing != MAP_FAILED) {
+        munmap(_bufRing, kBufEntries * sizeof(io_uring_buf));
+    }
+    if (_sqes != MAP_FAILED) {
+        munmap(_sqes, _sqesSize);
+    }
+    if (_ringMem != MAP_FAILED) {
+        munmap(_ringMem, _ringMemSize);
+    }
+    free(_bufMem);
+}
+
+static bool kernel_at_least(int major, int minor)
+{
+    utsname name;
+    int kmajor = 0, kminor = 0;
+    if (uname(&name) < 0 || sscanf(name.release, "%d.%d", &kmajor, &kminor) != 2) {
+        return false;
+    }
+    return kmajor > major || (kmajor == major && kminor >= minor);
+}
+
+bool IoUringWrapper::Init()
+{
+    // multishot recv arrived in 6.0, multishot accept and buffer rings in 5.19
+    if (!kernel_at_least(6, 0)) {
+        minilog(LogLevel_e::WARRNIG, "io_uring needs linux 6.0 or later");
+        return false;
+    }
+    io_uring_params params = {};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = kCqEntries;
+    _ring = static_cast<int>(syscall(__NR_io_uring_setup, kSqEntries, &params));
+    if (_ring < 0) {
+        minilog(LogLevel_e::WARRNIG, "io_uring_setup error = %s", strerror(errno));
+        return false;
+    }
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & needed) != needed) {
+        minilog(LogLevel_e::WARRNIG, "io_uring lacks features, have 0x%x", params.features);
+        return false;
+    }
+    _ringMemSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    _ringMem = mmap(nullptr, _ringMemSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+    _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    _sqes = static_cast<io_uring_sqe*>(mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        _ring, IORING_OFF_SQES));
+    if (_ringMem == MAP_FAILED || _sqes == MAP_FAILED) {
+        minilog(LogLevel_e::WARRNIG, "io_uring mmap error = %s", strerror(errno));
+        return false;
+    }
+    char* mem = static_cast<char*>(_ringMem);
+    _sqHead = reinterpret_cast<unsigned*>(mem + params.sq_off.head);
+    _sqTail = reinterpret_cast<unsigned*>(mem + params.sq_off.tail);
+    _sqMask = *reinterpret_cast<unsigned*>(mem + params.sq_off.ring_mask);
+    _sqEntries = params.sq_entries;
+    unsigned* sqArray = reinterpret_cast<unsigned*>(mem + params.sq_off.array);
+    for (unsigned i = 0; i < _sqEntries; i++) {
+        sqArray[i] = i;
+    }
+    _sqeTail = *_sqTail;
+    _cqHead = reinterpret_cast<unsigned*>(mem + params.cq_off.head);
+    _cqTail = reinterpret_cast<unsigned*>(mem + params.cq_off.tail);
+    _cqMask = *reinterpret_cast<unsigned*>(mem + params.cq_off.ring_mask);
+    _cqes = reinterpret_cast<io_uring_cqe*>(mem + params.cq_off.cqes);
+
+    // io_uring_buf_ring isn't used: its flexible array member gets an offset of 8 in C++
+    _bufRing = static_cast<io_uring_buf*>(mmap(nullptr, kBufEntries * sizeof(io_uring_buf),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    _bufMem = static_cast<char*>(malloc(kBufEntries * kBufSize));
+    if (_bufRing == MAP_FAILED || !_bufMem) {
+        minilog(LogLevel_e::WARRNIG, "io_uring buffer ring alloc failed");
+        return false;
+    }
+    io_uring_buf_reg reg = {};
+    reg.ring_addr = reinterpret_cast<uint64_t>(_bufRing);
+    reg.ring_entries = kBufEntries;
+    reg.bgid = kBufGroup;
+    if (syscall(__NR_io_uring_register, _ring, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        minilog(LogLevel_e::WARRNIG, "io_uring register buffer ring error = %s", strerror(errno));
+        return false;
+    }
+    for (unsigned i = 0; i < kBufEntries; i++) {
+        recycleBuffer(static_cast<uint16_t>(i));
+    }
+    __atomic_store_n(&_bufRing[0].resv, _bufTail, __ATOMIC_RELEASE);
+    return true;
+}
+
+SpChannel* IoUringWrapper::findSlot(int fd)
+{
+    if (fd < 0 || static_cast<size_t>(fd) >= _channels.size() || !_channels[fd]) {
+        return nullptr;
+    }
+    return &_channels[fd];
+}
+
+bool IoUringWrapper::HasChannel(SpChannel chan) const
+{
+    int fd = chan->_fd;
+    return fd >= 0 && static_cast<size_t>(fd) < _channels.size() && _channels[fd] == chan;
+}
+
+bool IoUringWrapper::HasPending() const
+{
+    if (_toSubmit > 0) {
+        return true;
+    }
+    for (auto& chan : _writers) {
+        if (!chan->_completion->sendInFlight && chan->sendableBytes() > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+io_uring_sqe* IoUringWrapper::getSqe()
+{
+    if (_sqeTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) {
+        // full, hand what we have to the kernel first
+        enter(0, 0);
+        if (_sqeTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) {
+            minilog(LogLevel_e::ERROR, "io_uring submission queue full");
+            return nullptr;
+        }
+    }
+    io_uring_sqe* sqe = &_sqes[_sqeTail & _sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    _sqeTail++;
+    _toSubmit++;
+    return sqe;
+}
+
+// submits everything queued and, with minComplete, waits up to timeout ms (-1: forever)
+int IoUringWrapper::enter(unsigned minComplete, int timeout)
+{
+    __atomic_store_n(_sqTail, _sqeTail, __ATOMIC_RELEASE);
+    unsigned flags = 0;
+    io_uring_getevents_arg arg = {};
+    __kernel_timespec ts = {};
+    if (minComplete > 0) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        arg.sigmask_sz = _NSIG / 8;
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+        }
+    }
+    else if (_toSubmit == 0) {
+        return 0;
+    }
+    int ret = static_cast<int>(syscall(__NR_io_uring_enter, _ring, _toSubmit, minComplete, flags,
+        flags ? &arg : nullptr, flags ? sizeof(arg) : 0));
+    if (ret < 0) {
+        if (errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            minilog(LogLevel_e::ERROR, "io_uring_enter error = %s", strerror(errno));
+        }
+        return -1;
+    }
+    _toSubmit -= std::min(_toSubmit, static_cast<unsigned>(ret));
+    return ret;
+}
+
+void IoUringWrapper::recycleBuffer(uint16_t bid)
+{
+    io_uring_buf* buf = &_bufRing[_bufTail & (kBufEntries - 1)];
+    buf->addr = reinterpret_cast<uint64_t>(_bufMem + static_cast<size_t>(bid) * kBufSize);
+    buf->len = kBufSize;
+    buf->bid = bid;
+    _bufTail++;
+}
+
+void IoUringWrapper::arm(Channel* chan)
+{
+    ChannelCompletion& comp = *chan->_completion;
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe) {
+        return;
+    }
+    sqe->fd = chan->_fd;
+    switch (comp.kind) {
+    case ChannelCompletion::ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = reinterpret_cast<uint64_t>(chan) | kOpAccept;
+        break;
+    case ChannelCompletion::RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kBufGroup;
+        sqe->user_data = reinterpret_cast<uint64_t>(chan) | kOpRecv;
+        break;
+    case ChannelCompletion::POLL:
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = reinterpret_cast<uint64_t>(chan) | kOpPoll;
+        break;
+    case ChannelCompletion::CONNECT:
+        // one shot, the socket is writable once the connect is done either way
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = reinterpret_cast<uint64_t>(chan) | kOpPoll;
+        break;
+    }
+    comp.recvArmed = true;
+    comp.inFlight++;
+}
+
+void IoUringWrapper::cancel(Channel* chan, Op_e op)
+{
+    io_uring_sqe* sqe = getSqe();
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = reinterpret_cast<uint64_t>(chan) | op;
+        sqe->user_data = 0;
+    }
+}
+
+void IoUringWrapper::cancelAll(Channel* chan)
+{
+    io_uring_sqe* sqe = getSqe();
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = chan->_fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = 0;
+    }
+}
+
+void IoUringWrapper::submitSend(Channel* chan)
+{
+    ChannelCompletion& comp = *chan->_completion;
+    // file parts are loaded into the buffer in order, nothing behind the first one may go yet
+    int iovcnt = chan->_sendBuffer.PeekIov(comp.iov, Buffer::kMaxIov, chan->sendableBytes());
+    io_uring_sqe* sqe = iovcnt > 0 ? getSqe() : nullptr;
+    if (!sqe) {
+        return;
+    }
+    // the buffer may grow at its tail meanwhile, the blocks in comp.iov stay put until the completion
+    memset(&comp.msg, 0, sizeof(comp.msg));
+    comp.msg.msg_iov = comp.iov;
+    comp.msg.msg_iovlen = iovcnt;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = chan->_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&comp.msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = reinterpret_cast<uint64_t>(chan) | kOpSend;
+    comp.sendInFlight = true;
+    comp.inFlight++;
+}
+
+void IoUringWrapper::prepareSends()
+{
+    for (size_t i = 0; i < _writers.size();) {
+        Channel* chan = _writers[i].get();
+        ChannelCompletion& comp = *chan->_completion;
+        if (!chan->_inEpoll || !(chan->_events & ChannelEvent_e::OUT)) {
+            comp.writer = false;
+            _writers[i] = std::move(_writers.back());
+            _writers.pop_back();
+            continue;
+        }
+        if (!comp.sendInFlight && chan->sendableBytes() > 0) {
+            submitSend(chan);
+        }
+        i++;
+    }
+}
+
+bool IoUringWrapper::Add(SpChannel chan, ChannelEvent_e evts)
+{
+    int fd = chan->GetSocket();
+    if (findSlot(fd)) {
+        return Modify(chan, evts);
+    }
+    if (chan->_completion && chan->_completion->inFlight > 0) {
+        minilog(LogLevel_e::ERROR, "channel(fd = %d) re-added before its requests completed", fd);
+        return false;
+    }
+    chan->_completion.reset(new ChannelCompletion());
+    struct stat st;
+    if (chan->IsListening()) {
+        chan->_completion->kind = ChannelCompletion::ACCEPT;
+    }
+    else if (chan->IsConnecting()) {
+        chan->_completion->kind = ChannelCompletion::CONNECT;
+    }
+    else if (fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        chan->_completion->kind = ChannelCompletion::RECV;
+    }
+    else {
+        chan->_completion->kind = ChannelCompletion::POLL;
+    }
+    if (static_cast<size_t>(fd) >= _channels.size()) {
+        _channels.resize(std::max(static_cast<size_t>(fd) + 1, _channels.size() * 2));
+    }
+    _channels[fd] = chan;
+    _channelNum.fetch_add(1, std::memory_order_relaxed);
+    chan->_inEpoll = true;
+    chan->_metrics = _metrics;
+    chan->SetEvents(ChannelEvent_e::NONE);
+    return Modify(chan, evts);
+}
+
+bool IoUringWrapper::Modify(SpChannel chan, ChannelEvent_e evts)
+{
+    SpChannel* slot = findSlot(chan->GetSocket());
+    if (!slot) {
+        return false;
+    }
+    Channel* ch = slot->get();
+    ChannelCompletion& comp = *ch->_completion;
+    ch->SetEvents(evts);
+    ChannelEvent_e active = ch->activeEvents(evts);
+    if (comp.kind == ChannelCompletion::CONNECT) {
+        // sends only complete once connected, until then OUT waits on the connect poll
+        active = (evts & ChannelEvent_e::OUT) ? ChannelEvent_e::IN : ChannelEvent_e::NONE;
+    }
+    if ((active & ChannelEvent_e::IN) && !comp.recvArmed) {
+        arm(ch);
+    }
+    else if (!(active & ChannelEvent_e::IN) && comp.recvArmed) {
+        // the final completion clears recvArmed
+        Op_e op = comp.kind == ChannelCompletion::ACCEPT ? kOpAccept : comp.kind == ChannelCompletion::RECV ? kOpRecv : kOpPoll;
+        cancel(ch, op);
+    }
+    if ((evts & ChannelEvent_e::OUT) && !comp.writer) {
+        comp.writer = true;
+        _writers.emplace_back(*slot);
+    }
+    return true;
+}
+
+bool IoUringWrapper::Delete(SpChannel chan)
+{
+    SpChannel* slot = findSlot(chan->GetSocket());
+    if (!slot) {
+        return true;
+    }
+    Channel* ch = slot->get();
+    ch->_inEpoll = false;
+    ch->_metrics = nullptr;
+    if (ch->_completion->inFlight > 0) {
+        cancelAll(ch);
+    }
+    // also covers deletes from inside a handler, which still uses the channel afterwards
+    _closing.emplace_back(std::move(*slot));
+    slot->reset();
+    _channelNum.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+void IoUringWrapper::releaseClosed()
+{
+    for (size_t i = 0; i < _closing.size();) {
+        if (_closing[i]->_completion->inFlight == 0) {
+            _closing[i] = std::move(_closing.back());
+            _closing.pop_back();
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+void IoUringWrapper::handleCqe(uint64_t userData, int res, uint32_t flags)
+{
+    Channel* chan = reinterpret_cast<Channel*>(userData & ~static_cast<uint64_t>(kOpMask));
+    if (!chan) {
+        return;     // cancel requests
+    }
+    ChannelCompletion& comp = *chan->_completion;
+    bool more = flags & IORING_CQE_F_MORE;
+    switch (userData & kOpMask) {
+    case kOpRecv:
+        if (flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+            if (res > 0) {
+                chan->_recvBuffer.Append(_bufMem + static_cast<size_t>(bid) * kBufSize, res);
+                comp.received += res;
+            }
+            recycleBuffer(bid);
+        }
+        if (!more) {
+            comp.recvArmed = false;
+            comp.inFlight--;
+        }
+        if (!chan->_inEpoll) {
+            break;
+        }
+        if (res > 0) {
+            chan->_lastActiveMs = _pollTimeMs;
+        }
+        else if (res == 0) {
+            comp.eof = true;
+        }
+        else if (res != -ENOBUFS && res != -ECANCELED) {
+            comp.error = -res;
+        }
+        if (res >= 0 || comp.error) {
+            chan->HandleRead();
+            chan->_resumeRead = false;
+        }
+        // re-armed unless the peer is gone or reading was disabled or paused, ENOBUFS only needs buffers back
+        if (chan->_inEpoll && !comp.recvArmed && (chan->activeEvents(chan->_events) & ChannelEvent_e::IN) && !comp.eof &&
+            (res >= 0 || res == -ENOBUFS || res == -ECANCELED)) {
+            arm(chan);
+        }
+        break;
+    case kOpAccept:
+        if (!more) {
+            comp.recvArmed = false;
+            comp.inFlight--;
+        }
+        if (res >= 0) {
+            if (!chan->_inEpoll) {
+                close(res);
+                break;
+            }
+            comp.accepted.push_back(res);
+        }
+        else if (res != -ECANCELED && chan->_inEpoll) {
+            comp.error = -res;
+        }
+        if (chan->_inEpoll && (res >= 0 || comp.error)) {
+            chan->HandleRead();
+            chan->_resumeRead = false;
+        }
+        if (chan->_inEpoll && !comp.recvArmed && (chan->activeEvents(chan->_events) & ChannelEvent_e::IN)) {
+            arm(chan);
+        }
+        break;
+    case kOpPoll:
+        if (!more) {
+            comp.recvArmed = false;
+            comp.inFlight--;
+        }
+        if (comp.kind == ChannelCompletion::CONNECT) {
+            if (!chan->_inEpoll || res == -ECANCELED) {
+                break;
+            }
+            // the connect is over, the socket is read like any other from now on
+            comp.kind = ChannelCompletion::RECV;
+            if (chan->_events & ChannelEvent_e::OUT) {
+                chan->HandleSend();
+            }
+            if (chan->_inEpoll && !comp.recvArmed && (chan->activeEvents(chan->_events) & ChannelEvent_e::IN)) {
+                arm(chan);
+            }
+            break;
+        }
+        if (chan->_inEpoll && res > 0) {
+            chan->HandleRead();
+        }
+        if (chan->_inEpoll && !comp.recvArmed && (chan->activeEvents(chan->_events) & ChannelEvent_e::IN)) {
+            arm(chan);
+        }
+        break;
+    case kOpSend:
+        comp.sendInFlight = false;
+        comp.inFlight--;
+        if (res > 0) {
+            chan->_sendBuffer.Retrieve(res);
+            chan->bufferSent(static_cast<size_t>(res));
+            if (chan->_metrics) {
+                chan->_metrics->bytesOut.Add(res);
+            }
+        }
+        else if (res < 0 && res != -ECANCELED && res != -EAGAIN && res != -EINTR) {
+            comp.error = -res;
+        }
+        if (chan->_inEpoll && (chan->_events & ChannelEvent_e::OUT)) {
+            chan->HandleSend();
+        }
+        break;
+    }
+}
+
+int IoUringWrapper::PollOnce(int timeout)
+{
+    releaseClosed();
+    prepareSends();
+    bool ready = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE) != *_cqHead;
+    enter(ready || timeout == 0 ? 0 : 1, timeout);
+
+    _pollTimeMs = monotonic_ms();
+    uint64_t dispatchStart = 0;
+    if (_metrics) {
+        dispatchStart = _metrics->pollReturnNs = monotonic_ns();
+    }
+    unsigned head = *_cqHead;
+    unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    int count = 0;
+    for (; head != tail; head++) {
+        io_uring_cqe* cqe = &_cqes[head & _cqMask];
+        uint64_t userData = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+        handleCqe(userData, res, flags);
+        count++;
+    }
+    __atomic_store_n(&_bufRing[0].resv, _bufTail, __ATOMIC_RELEASE);
+    releaseClosed();
+    if (_metrics) {
+        _metrics->polls.Add();
+        if (count == 0) {
+            _metrics->emptyPolls.Add();
+        }
+        else {
+            uint64_t ns = monotonic_ns() - dispatchStart;
+            _metrics->events.Add(count);
+            _metrics->eventsPerPoll.Record(count);
+            _metrics->callbackNs.Add(ns);
+            _metrics->callbackBatchNs.Record(ns);
+        }
+    }
+    return count;
+}
@@ -0,0 +1,211 @@
+#pragma once
+#include <mutex>
+#include <string>
+#include <memory>
+#include "utils.h"
+
+struct MemPoolStats
+{
+	uint64_t hits;			// served from the free list
+	uint64_t misses;		// had to go to the global allocator
+	uint64_t recycled;		// given back to the free list
+	uint64_t released;		// given back to the global allocator (free list full or trimmed)
+	size_t freeCount;
+	size_t objSize;
+};
+
+/*
+ * Free list of equally sized objects. The object size is fixed by the first Alloc
+ * unless given up front; requests of any other size bypass the pool. Objects may be
+ * freed from any thread (a channel dies wherever its last reference is dropped), so
+ * the list is guarded by a mutex that is uncontended in the common case.
+ */
+class MemPool : noncopyable
+{
+public:
+	MemPool(const std::string& name, size_t maxFree, size_t objSize = 0);
+	~MemPool();
+	void* Alloc(size_t size);
+	void Free(void* p, size_t size);
+	size_t Trim(size_t keep);
+	// fills the free list up to count objects, allocated (and touched) by the calling
+	// thread; nothing for a pool whose object size is not known yet
+	size_t Reserve(size_t count);
+	void SetMaxFree(size_t maxFree);
+	MemPoolStats GetStats();
+	std::string GetName() const { return _name; }
+private:
+	struct FreeNode
+	{
+		FreeNode* next;
+	};
+	std::string _name;
+	std::mutex _mutex;
+	FreeNode* _freeList;
+	size_t _freeCount;
+	size_t _maxFree;
+	size_t _objSize;
+	MemPoolStats _stats;
+};
+
+MemPool::MemPool(const std::string& name, size_t maxFree, size_t objSize) :
+	_name(name),
+	_freeList(nullptr),
+	_freeCount(0),
+	_maxFree(maxFree),
+	_objSize(objSize),
+	_stats()
+{
+
+}
+
+MemPool::~MemPool()
+{
+	Trim(0);
+}
+
+void* MemPool::Alloc(size_t size)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_objSize == 0) {
+			_objSize = std::max(size, sizeof(FreeNode));
+		}
+		if (size == _objSize || (size < _objSize && size >= sizeof(FreeNode))) {
+			if (_freeList) {
+				FreeNode* node = _freeList;
+				_freeList = node->next;
+				_freeCount--;
+				_stats.hits++;
+				return node;
+			}
+			_stats.misses++;
+			size = _objSize;
+		}
+	}
+	return ::operator new(size);
+}
+
+void MemPool::Free(void* p, size_t size)
+{
+	if (!p) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (size <= _objSize && size >= sizeof(FreeNode)) {
+			if (_freeCount < _maxFree) {
+				FreeNode* node = static_cast<FreeNode*>(p);
+				node->next = _freeList;
+				_freeList = node;
+				_freeCount++;
+				_stats.recycled++;
+				return;
+			}
+			_stats.released++;
+		}
+	}
+	::operator delete(p);
+}
+
+// give free objects above keep back to the global allocator
+size_t MemPool::Trim(size_t keep)
+{
+	FreeNode* release = nullptr;
+	size_t count = 0;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		while (_freeCount > keep) {
+			FreeNode* node = _freeList;
+			_freeList = node->next;
+			node->next = release;
+			release = node;
+			_freeCount--;
+			count++;
+		}
+		_stats.released += count;
+	}
+	while (release) {
+		FreeNode* next = release->next;
+		::operator delete(release);
+		release = next;
+	}
+	return count;
+}
+
+size_t MemPool::Reserve(size_t count)
+{
+	size_t objSize = 0;
+	size_t missing = 0;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		objSize = _objSize;
+		count = std::min(count, _maxFree);
+		missing = _freeCount < count ? count - _freeCount : 0;
+	}
+	if (objSize == 0) {
+		return 0;
+	}
+	size_t added = 0;
+	for (size_t i = 0; i < missing; i++) {
+		void* p = ::operator new(objSize);
+		// first touch places the pages on this thread's node
+		memset(p, 0, objSize);
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_freeCount >= _maxFree) {
+			::operator delete(p);
+			break;
+		}
+		FreeNode* node = static_cast<FreeNode*>(p);
+		node->next = _freeList;
+		_freeList = node;
+		_freeCount++;
+		added++;
+	}
+	return added;
+}
+
+void MemPool::SetMaxFree(size_t maxFree)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_maxFree = maxFree;
+	}
+	Trim(maxFree);
+}
+
+MemPoolStats MemPool::GetStats()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	MemPoolStats stats = _stats;
+	stats.freeCount = _freeCount;
+	stats.objSize = _objSize;
+	return stats;
+}
+
+using SpMemPool = std::shared_ptr<MemPool>;
+SpMemPool CreateSpMemPool(const std::string& name, size_t maxFree, size_t objSize = 0)
+{
+	return std::make_shared<MemPool>(name, maxFree, objSize);
+}
+
+// std allocator over a MemPool, meant for std::allocate_shared so the control block
+// and the object share one pooled allocation
+template <typename T>
+class PoolAllocator
+{
+public:
+	using value_type = T;
+	explicit PoolAllocator(SpMemPool pool) : _pool(pool) {}
+	template <typename U>
+	PoolAllocator(const PoolAllocator<U>& other) : _pool(other._pool) {}
+	T* allocate(size_t n) { return static_cast<T*>(_pool->Alloc(n * sizeof(T))); }
+	void deallocate(T* p, size_t n) { _pool->Free(p, n * sizeof(T)); }
+	template <typename U>
+	bool operator==(const PoolAllocator<U>& other) const { return _pool == other._pool; }
+	template <typename U>
+	bool operator!=(const PoolAllocator<U>& other) const { return _pool != other._pool; }
+private:
+	template <typename U> friend class PoolAllocator;
+	SpMemPool _pool;		// the control block keeps a copy, so the pool outlives its last object
+};
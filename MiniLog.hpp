@@ -1,123 +1,492 @@
 #pragma once
+#include <atomic>
 #include <mutex>
-#include <queue>
-#include <stdarg.h>
+#include <vector>
+#include <string>
 #include <memory>
-#include <mutex>
 #include <thread>
+#include <chrono>
 #include <condition_variable>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "utils.h"
 
-#define minilog(level, fmt, ...)                                                                 \
-	do                                                                                           \
-	{                                                                                            \
-		Logger::GetInstance()->Log(level, __FILE__, __FUNCTION__, __LINE__, fmt, ##__VA_ARGS__); \
-	} while (0)
-
 enum class LogLevel_e
 {
-	INFO = 0,
-	DEBUG,
+	DEBUG = 0,
+	INFO,
 	WARRNIG,
 	ERROR
 };
 
-static std::string convert_level_to_string(LogLevel_e level)
+// statements below this level are compiled out, arguments included, e.g. -DMINILOG_ACTIVE_LEVEL=1 drops DEBUG
+#ifndef MINILOG_ACTIVE_LEVEL
+#define MINILOG_ACTIVE_LEVEL 0
+#endif
+
+// nothing is formatted or evaluated unless the level passes both filters
+#define minilog(level, fmt, ...)                                                                    \
+	do                                                                                              \
+	{                                                                                               \
+		if (static_cast<int>(level) >= MINILOG_ACTIVE_LEVEL && Logger::IsEnabled(level))            \
+		{                                                                                           \
+			Logger::Instance()->Log(level, __FILE__, __FUNCTION__, __LINE__, fmt, ##__VA_ARGS__); \
+		}                                                                                           \
+	} while (0)
+
+static const char* convert_level_to_string(LogLevel_e level)
 {
-	std::string levelStr;
 	switch (level)
 	{
-	case LogLevel_e::INFO:
-		levelStr = "INFO";
-		break;
 	case LogLevel_e::DEBUG:
-		levelStr = "DEBUG";
-		break;
+		return "DEBUG";
+	case LogLevel_e::INFO:
+		return "INFO";
 	case LogLevel_e::WARRNIG:
-		levelStr = "WARRNING";
-		break;
+		return "WARRNING";
 	case LogLevel_e::ERROR:
-		levelStr = "ERROR";
-		break;
+		return "ERROR";
 	default:
-		break;
+		return "";
 	}
-	return levelStr;
 }
 
+// what a thread does when its ring is full
+enum class LogOverflow_e
+{
+	DROP = 0,	// count the line and go on, the default: the reactors never wait for the disk
+	BLOCK		// wait for the writer thread, nothing is lost
+};
+
+struct LogStats
+{
+	uint64_t written;	// lines accepted into the rings
+	uint64_t dropped;	// lines lost to full rings
+	uint64_t blocked;	// times a thread had to wait for ring space
+	uint64_t bytes;		// bytes handed to the sink
+	uint64_t rotations;
+};
+
+/*
+ * Single producer / single consumer ring of variable length records, one per logging
+ * thread. A record is a uint32 length and the line; a record that does not fit before
+ * the end of the ring is preceded by a wrap marker (or by nothing when fewer than 4
+ * bytes are left) and starts over at offset 0.
+ */
+class LogRing : noncopyable
+{
+public:
+	explicit LogRing(size_t capacity);
+	// returns false when full, *used is the fill level after the push
+	bool TryPush(const char* data, uint32_t len, size_t* used);
+	// appends every complete record to out
+	size_t Drain(std::string& out);
+	bool Empty() const { return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_relaxed); }
+	size_t Capacity() const { return _capacity; }
+	void Close() { _closed.store(true, std::memory_order_release); }
+	bool IsClosed() const { return _closed.load(std::memory_order_acquire); }
+
+	// written by the owning thread only, read by GetStats
+	std::atomic<uint64_t> _written;
+	std::atomic<uint64_t> _dropped;
+	std::atomic<uint64_t> _blocked;
+private:
+	static const uint32_t kWrapMarker = 0xffffffffu;
+	std::vector<char> _buf;
+	size_t _capacity;
+	std::atomic<bool> _closed;
+	alignas(64) std::atomic<size_t> _head;	// producer position
+	alignas(64) std::atomic<size_t> _tail;	// consumer position
+};
+
+LogRing::LogRing(size_t capacity) :
+	_written(0),
+	_dropped(0),
+	_blocked(0),
+	_buf(capacity),
+	_capacity(capacity),
+	_closed(false),
+	_head(0),
+	_tail(0)
+{
+
+}
+
+bool LogRing::TryPush(const char* data, uint32_t len, size_t* used)
+{
+	size_t head = _head.load(std::memory_order_relaxed);
+	size_t tail = _tail.load(std::memory_order_acquire);
+	size_t pos = head % _capacity;
+	size_t contig = _capacity - pos;
+	size_t need = sizeof(uint32_t) + len;
+	size_t skip = contig < need ? contig : 0;
+	if (head - tail + skip + need > _capacity) {
+		return false;
+	}
+	if (skip) {
+		if (contig >= sizeof(uint32_t)) {
+			memcpy(&_buf[pos], &kWrapMarker, sizeof(uint32_t));
+		}
+		pos = 0;
+	}
+	memcpy(&_buf[pos], &len, sizeof(uint32_t));
+	memcpy(&_buf[pos + sizeof(uint32_t)], data, len);
+	head += skip + need;
+	_head.store(head, std::memory_order_release);
+	*used = head - tail;
+	return true;
+}
+
+size_t LogRing::Drain(std::string& out)
+{
+	size_t tail = _tail.load(std::memory_order_relaxed);
+	size_t head = _head.load(std::memory_order_acquire);
+	size_t count = 0;
+	while (tail != head) {
+		size_t pos = tail % _capacity;
+		size_t contig = _capacity - pos;
+		uint32_t len = kWrapMarker;
+		if (contig >= sizeof(uint32_t)) {
+			memcpy(&len, &_buf[pos], sizeof(uint32_t));
+		}
+		if (len == kWrapMarker) {
+			tail += contig;
+			continue;
+		}
+		out.append(&_buf[pos + sizeof(uint32_t)], len);
+		tail += sizeof(uint32_t) + len;
+		count++;
+	}
+	_tail.store(tail, std::memory_order_release);
+	return count;
+}
+
+/*
+ * Asynchronous logger. Log() formats on the calling thread into a stack buffer and copies
+ * the line into that thread's ring, no lock and no allocation once the ring exists.
+ * A background thread wakes up every kFlushIntervalMs, or early for errors and half full
+ * rings, drains all rings into one batch and writes it to the sink with a single flush.
+ * Lines of one thread stay in order; lines of different threads are ordered per batch only.
+ * The file sink is rotated by size and/or age, the old file is renamed to path.YYYYmmdd-HHMMSS.
+ */
 class Logger
 {
 public:
 	Logger(const Logger &) = delete;
 	Logger operator=(const Logger &) = delete;
+	~Logger();
 	static std::shared_ptr<Logger> GetInstance();
+	static Logger* Instance() { return _inst.get(); }
+	static bool IsEnabled(LogLevel_e level) { return static_cast<int>(level) >= _level.load(std::memory_order_relaxed); }
+	static void SetLevel(LogLevel_e level) { _level.store(static_cast<int>(level), std::memory_order_relaxed); }
+	static LogLevel_e GetLevel() { return static_cast<LogLevel_e>(_level.load(std::memory_order_relaxed)); }
+
 	void Log(LogLevel_e level, const char *file, const char *func, int line, const char *format, ...);
+	void SetOverflowPolicy(LogOverflow_e policy) { _policy.store(policy, std::memory_order_relaxed); }
+	// rotateBytes / rotateSeconds of 0 disable that trigger, returns false if path can't be opened
+	bool SetFileSink(const std::string& path, size_t rotateBytes = 0, int rotateSeconds = 0);
+	LogStats GetStats();
+	// the writer thread, named "minilog"; to keep it off the reactors' CPUs (SetThreadAffinity)
+	std::thread::native_handle_type NativeHandle() { return _thread.native_handle(); }
 	void Work();
 
 private:
-	Logger()
-	{
-		_thread = std::thread(&Logger::Work, this);
-		_running = true;
-	}
-	~Logger()
-	{
-		_running = false;
-		_queueCv.notify_all();
-		_thread.join();
-	}
+	Logger();
+	LogRing* localRing();
+	size_t formatPrefix(char* buf, size_t size, LogLevel_e level, const char* file, const char* func, int line);
+	size_t drainRings(std::string& batch);
+	void writeSink(const std::string& batch);
+	void rotate();
+
+	static const size_t kRingSize = 256 * 1024;
+	static const size_t kMaxLineSize = 2048;
+	static const size_t kBatchSize = 64 * 1024;
+	static const int kFlushIntervalMs = 100;
+
 	static std::shared_ptr<Logger> _inst;
-	std::mutex _queueMutex;
-	std::condition_variable _queueCv;
-	std::queue<std::string> _queue;
+	static std::atomic<int> _level;
+	std::atomic<LogOverflow_e> _policy;
+	std::atomic<bool> _running;
+	std::mutex _waitMutex;
+	std::condition_variable _waitCv;
+	std::mutex _ringsMutex;
+	std::vector<std::shared_ptr<LogRing>> _rings;
+	uint64_t _exitedWritten;	// counters of rings whose thread is gone
+	uint64_t _exitedDropped;
+	uint64_t _exitedBlocked;
+	uint64_t _reportedDropped;
+	std::mutex _sinkMutex;
+	FILE* _file;
+	std::string _path;
+	size_t _rotateBytes;
+	int _rotateSeconds;
+	size_t _fileBytes;
+	time_t _fileOpened;
+	std::atomic<uint64_t> _bytes;
+	std::atomic<uint64_t> _rotations;
 	std::thread _thread;
-	bool _running;
 };
 
+// the ring outlives its thread until the writer has drained it
+struct LogThreadContext
+{
+	std::shared_ptr<LogRing> ring;
+	time_t second = 0;
+	char date[32];		// "YYYY-mm-dd HH:MM:SS" of second
+	~LogThreadContext()
+	{
+		if (ring) {
+			ring->Close();
+		}
+	}
+};
+static thread_local LogThreadContext tls_log_context;
+
 std::shared_ptr<Logger> Logger::_inst = std::shared_ptr<Logger>(new Logger, [](Logger *p)
 																{ delete p; });
+std::atomic<int> Logger::_level(static_cast<int>(LogLevel_e::INFO));
+
+Logger::Logger() :
+	_policy(LogOverflow_e::DROP),
+	_running(true),
+	_exitedWritten(0),
+	_exitedDropped(0),
+	_exitedBlocked(0),
+	_reportedDropped(0),
+	_file(stdout),
+	_rotateBytes(0),
+	_rotateSeconds(0),
+	_fileBytes(0),
+	_fileOpened(time(nullptr)),
+	_bytes(0),
+	_rotations(0)
+{
+	// started last, Work() must see everything above
+	_thread = std::thread(&Logger::Work, this);
+}
+
+Logger::~Logger()
+{
+	_running = false;
+	_waitCv.notify_all();
+	_thread.join();
+	if (_file && _file != stdout) {
+		fclose(_file);
+	}
+}
+
 std::shared_ptr<Logger> Logger::GetInstance()
 {
 	return _inst;
 }
 
+LogRing* Logger::localRing()
+{
+	LogThreadContext& ctx = tls_log_context;
+	if (!ctx.ring) {
+		ctx.ring = std::make_shared<LogRing>(static_cast<size_t>(kRingSize));
+		std::lock_guard<std::mutex> lock(_ringsMutex);
+		_rings.push_back(ctx.ring);
+	}
+	return ctx.ring.get();
+}
+
+size_t Logger::formatPrefix(char* buf, size_t size, LogLevel_e level, const char* file, const char* func, int line)
+{
+	LogThreadContext& ctx = tls_log_context;
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	if (ts.tv_sec != ctx.second) {
+		// localtime_r is the expensive part, so it runs at most once per second and thread
+		tm tmNow;
+		localtime_r(&ts.tv_sec, &tmNow);
+		strftime(ctx.date, sizeof(ctx.date), "%Y-%m-%d %H:%M:%S", &tmNow);
+		ctx.second = ts.tv_sec;
+	}
+	int n = snprintf(buf, size, "%s.%03d [%s] [%s:%d - %s] ", ctx.date, static_cast<int>(ts.tv_nsec / 1000000),
+		convert_level_to_string(level), file, line, func);
+	return n < 0 ? 0 : std::min(static_cast<size_t>(n), size - 1);
+}
+
 void Logger::Log(LogLevel_e level, const char *file, const char *func, int line, const char *format, ...)
 {
-	char variaty[1024];
+	LogRing* ring = localRing();
+	char buf[kMaxLineSize];
+	size_t len = formatPrefix(buf, kMaxLineSize - 1, level, file, func, line);
 	va_list args;
 	va_start(args, format);
-	vsprintf(variaty, format, args);
+	int n = vsnprintf(buf + len, kMaxLineSize - 1 - len, format, args);
 	va_end(args);
-	char res[2048];
-	sprintf(res, "[%s] [%s:%d - %s] %s\n", convert_level_to_string(level).c_str(), file, line, func, variaty);
-	std::string oneLog = res;
+	if (n > 0) {
+		// longer lines are truncated
+		len += std::min(static_cast<size_t>(n), kMaxLineSize - 2 - len);
+	}
+	buf[len++] = '\n';
+
+	size_t used = 0;
+	bool pushed = ring->TryPush(buf, static_cast<uint32_t>(len), &used);
+	if (!pushed && _policy.load(std::memory_order_relaxed) == LogOverflow_e::BLOCK) {
+		ring->_blocked.store(ring->_blocked.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		while (!pushed && _running.load(std::memory_order_relaxed)) {
+			_waitCv.notify_one();
+			std::this_thread::yield();
+			pushed = ring->TryPush(buf, static_cast<uint32_t>(len), &used);
+		}
+	}
+	if (!pushed) {
+		ring->_dropped.store(ring->_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+	ring->_written.store(ring->_written.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	// wake the writer only when it matters, the timeout picks up everything else
+	if (level >= LogLevel_e::ERROR || (used >= ring->Capacity() / 2 && used - len < ring->Capacity() / 2)) {
+		_waitCv.notify_one();
+	}
+}
+
+bool Logger::SetFileSink(const std::string& path, size_t rotateBytes, int rotateSeconds)
+{
+	FILE* file = fopen(path.c_str(), "a");
+	if (!file) {
+		fprintf(stderr, "[%s] can't open log file %s: %s\n", convert_level_to_string(LogLevel_e::ERROR), path.c_str(), strerror(errno));
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(_sinkMutex);
+	if (_file && _file != stdout) {
+		fclose(_file);
+	}
+	_file = file;
+	_path = path;
+	_rotateBytes = rotateBytes;
+	_rotateSeconds = rotateSeconds;
+	fseek(file, 0, SEEK_END);
+	_fileBytes = static_cast<size_t>(ftell(file));
+	_fileOpened = time(nullptr);
+	return true;
+}
+
+LogStats Logger::GetStats()
+{
+	LogStats stats = {};
 	{
-		std::lock_guard<std::mutex> lock(_queueMutex);
-		_queue.push(std::move(oneLog));
+		std::lock_guard<std::mutex> lock(_ringsMutex);
+		stats.written = _exitedWritten;
+		stats.dropped = _exitedDropped;
+		stats.blocked = _exitedBlocked;
+		for (auto& ring : _rings) {
+			stats.written += ring->_written.load(std::memory_order_relaxed);
+			stats.dropped += ring->_dropped.load(std::memory_order_relaxed);
+			stats.blocked += ring->_blocked.load(std::memory_order_relaxed);
+		}
+	}
+	stats.bytes = _bytes.load(std::memory_order_relaxed);
+	stats.rotations = _rotations.load(std::memory_order_relaxed);
+	return stats;
+}
+
+size_t Logger::drainRings(std::string& batch)
+{
+	std::lock_guard<std::mutex> lock(_ringsMutex);
+	size_t count = 0;
+	uint64_t dropped = _exitedDropped;
+	for (size_t i = 0; i < _rings.size();) {
+		LogRing* ring = _rings[i].get();
+		// read closed first, a ring closed after its last push is then drained completely
+		bool closed = ring->IsClosed();
+		count += ring->Drain(batch);
+		dropped += ring->_dropped.load(std::memory_order_relaxed);
+		if (batch.size() >= kBatchSize) {
+			writeSink(batch);
+			batch.clear();
+		}
+		if (closed) {
+			_exitedWritten += ring->_written.load(std::memory_order_relaxed);
+			_exitedDropped += ring->_dropped.load(std::memory_order_relaxed);
+			_exitedBlocked += ring->_blocked.load(std::memory_order_relaxed);
+			_rings[i] = _rings.back();
+			_rings.pop_back();
+		}
+		else {
+			i++;
+		}
+	}
+	if (dropped != _reportedDropped) {
+		char line[128];
+		snprintf(line, sizeof(line), "[%s] [logger] %llu lines dropped, rings full\n", convert_level_to_string(LogLevel_e::WARRNIG),
+			static_cast<unsigned long long>(dropped - _reportedDropped));
+		batch.append(line);
+		_reportedDropped = dropped;
 	}
-	_queueCv.notify_all();
+	return count;
+}
+
+void Logger::writeSink(const std::string& batch)
+{
+	if (batch.empty()) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(_sinkMutex);
+	fwrite(batch.data(), 1, batch.size(), _file);
+	_fileBytes += batch.size();
+	_bytes.fetch_add(batch.size(), std::memory_order_relaxed);
+	// checked per batch, so a file may end up one batch larger than rotateBytes
+	if (_file != stdout && ((_rotateBytes && _fileBytes >= _rotateBytes) ||
+		(_rotateSeconds > 0 && time(nullptr) - _fileOpened >= _rotateSeconds))) {
+		rotate();
+	}
+}
+
+void Logger::rotate()
+{
+	fclose(_file);
+	time_t now = time(nullptr);
+	tm tmNow;
+	localtime_r(&now, &tmNow);
+	char suffix[32];
+	strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &tmNow);
+	std::string rotated = _path + suffix;
+	for (int i = 1; access(rotated.c_str(), F_OK) == 0; i++) {
+		rotated = _path + suffix + "." + std::to_string(i);
+	}
+	rename(_path.c_str(), rotated.c_str());
+	_file = fopen(_path.c_str(), "a");
+	if (!_file) {
+		fprintf(stderr, "[%s] can't reopen log file %s: %s\n", convert_level_to_string(LogLevel_e::ERROR), _path.c_str(), strerror(errno));
+		_file = stdout;
+	}
+	_fileBytes = 0;
+	_fileOpened = now;
+	_rotations.fetch_add(1, std::memory_order_relaxed);
 }
 
 void Logger::Work()
 {
-	while (_running)
+	pthread_setname_np(pthread_self(), "minilog");
+	std::string batch;
+	batch.reserve(kBatchSize * 2);
+	const int intervalMs = kFlushIntervalMs;
+	while (true)
 	{
-		// _queueMutex.lock();
-		// while(_queue.empty())
-		// {
-		// 	_queueMutex.unlock();
-		// 	_ququeCv.wait();
-		// }
-		// _queueMutex.lock();
-		// std::string &log = _queue.front();
-		// _queue.pop();
-		// _queueMutex.unlock();
-		std::unique_lock<std::mutex> lock(_queueMutex);
-		_queueCv.wait(lock, [this](){ return !(this->_queue.empty()) || !this->_running;});
-		if(!_queue.empty()){
-			std::string &log = _queue.front();
-			printf("%s", log.c_str());
-			_queue.pop();
+		bool running = _running.load();
+		{
+			std::unique_lock<std::mutex> lock(_waitMutex);
+			if (running) {
+				_waitCv.wait_for(lock, std::chrono::milliseconds(intervalMs));
+			}
+		}
+		drainRings(batch);
+		writeSink(batch);
+		batch.clear();
+		{
+			std::lock_guard<std::mutex> lock(_sinkMutex);
+			fflush(_file);
+		}
+		if (!running) {
+			break;
 		}
 	}
 }
@@ -1,10 +1,29 @@
 ﻿#include <semaphore.h>
 #include <signal.h>
 #include <algorithm>
+#include <getopt.h>
 #include "MiniLog.hpp"
 #include "ReactorThread.hpp"
+#include "ReactorThreadPool.hpp"
+#include "AdminServer.hpp"
+#include "Codec.hpp"
+#include "ComputePool.hpp"
+#include "AdmissionControl.hpp"
+#include "CpuTopology.hpp"
 
 static sem_t *sem = new sem_t;
+static bool edgeTriggered = false;
+static uint64_t idleTimeoutMs = 0;
+static PollerBackend_e backend = PollerBackend_e::EPOLL;
+static SpCodec codec;       // null: echo the raw stream
+static SpComputePool computePool;   // null: requests are answered inline by the reactor
+static const int kMaxReadsPerEvent = 16;
+static const int kMaxAcceptsPerEvent = 64;
+static const size_t kMaxInFlightPerConn = 256;
+static size_t highWaterBytes = 0;   // per connection send buffer mark, 0: unbounded
+static SpAdmissionControl admission;
+static SpReactor mainReactor;       // owns the listener unless -r
+static int socketBusyPollUs = 0;    // SO_BUSY_POLL on client sockets, 0: off
 
 static void signal_handler(int sig_num)
 {
@@ -13,80 +32,504 @@ static void signal_handler(int sig_num)
     sem_post(sem);
 }
 
-void onRead(SpChannel chan)
+/*
+ * One client connection, handler of its channel. Uppercases what it reads: the raw
+ * stream, or frame by frame with -f, on the compute pool with -w.
+ */
+class Connection : public ChannelHandler<Connection>
 {
-    int fd = chan->GetSocket();
-    SpReactor re = std::static_pointer_cast<Reactor>(chan->GetSpPrivData());
-    char recvBuffer[1024] = {};
-    int ret = recv(fd, recvBuffer, sizeof(recvBuffer), 0);
-    if (ret == 0) {
-        minilog(LogLevel_e::WARRNIG, "peer close");
-        re->DelChannel(chan);
-    }
-    else if (ret < 0) {
-        minilog(LogLevel_e::DEBUG, "onRead ret < 0  errno = %d", errno);
-        if(!(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)){
-            minilog(LogLevel_e::ERROR, strerror(errno));
-            re->DelChannel(chan);
-        }
-    }
-    else{
-        minilog(LogLevel_e::DEBUG, "onRead ret = %d", ret);
-        chan->GetSendBuffer().clear();
-        chan->AppendSendBuffer(std::string(recvBuffer));
-        std::transform(chan->GetSendBuffer().begin(), chan->GetSendBuffer().end(), chan->GetSendBuffer().begin(), ::toupper);
-        re->EnableEvents(chan, ChannelEvent_e::OUT);
-    }
-    return;
+public:
+    Connection(Reactor* re, AdmissionTicket ticket) : _reactor(re), _ticket(std::move(ticket)), _paused(false) {}
+    void OnRead(Channel& chan);
+    void OnSend(Channel& chan);
+private:
+    void handleFrames(Channel& chan);
+    int offloadFrames(Channel& chan);
+    static void onOffloadDelivered(const std::weak_ptr<Channel>& weak, Connection* self);
+private:
+    Reactor* _reactor;
+    AdmissionTicket _ticket;    // the connection's slot, given back with it
+    SpStrand _strand;       // made when the first frame is offloaded
+    bool _paused;           // reading stopped until the strand drains
+    DecodeState _decode;    // where the codec left off in the recv buffer
+};
+
+// on the reactor after a batch of results came back: flush them and, once the strand has
+// room again, pick up the frames left in the buffer. self lives as long as the channel.
+void Connection::onOffloadDelivered(const std::weak_ptr<Channel>& weak, Connection* self)
+{
+    SpChannel chan = weak.lock();
+    if (!chan || !chan->InPoller()) {
+        return;
+    }
+    chan->RequestFlush();
+    if (self->_paused && self->_strand->GetInFlight() <= kMaxInFlightPerConn / 2) {
+        self->_paused = false;
+        self->_reactor->EnableEvents(chan, ChannelEvent_e::IN);
+        self->handleFrames(*chan);
+    }
 }
 
-void onSend(SpChannel chan)
+// the uppercasing runs on the compute pool, in order per connection
+int Connection::offloadFrames(Channel& chan)
 {
-    SpReactor re = std::static_pointer_cast<Reactor>(chan->GetSpPrivData());
-    if (!chan->GetSendBuffer().empty()) {
-        auto sendLen = send(chan->GetSocket(), chan->GetSendBuffer().c_str(), chan->GetSendBuffer().size(), 0);
-        minilog(LogLevel_e::DEBUG, "onSend sendLen = %d", sendLen);
-        if (sendLen > 0) {
-            chan->GetSendBuffer() = chan->GetSendBuffer().substr(sendLen);
+    if (_paused) {
+        return 0;
+    }
+    std::weak_ptr<Channel> weak = chan.shared_from_this();
+    Connection* self = this;
+    if (!_strand) {
+        _strand = computePool->CreateStrand(_reactor->shared_from_this(), [weak, self]() { onOffloadDelivered(weak, self); });
+    }
+    bool full = false;
+    Reactor* re = _reactor;
+    int frames = DispatchFrames(chan.GetRecvBuffer(), *codec, _decode, [&](const char* data, size_t len) {
+        if (_strand->GetInFlight() >= kMaxInFlightPerConn) {
+            full = true;
+            return false;
+        }
+        auto msg = std::make_shared<std::string>(data, len);
+        full = !computePool->Submit(_strand, [msg, weak, re]() -> ComputeResult {
+            std::transform(msg->begin(), msg->end(), msg->begin(), ::toupper);
+            return [msg, weak, re]() {
+                SpChannel chan = weak.lock();
+                if (chan && chan->InPoller() && !codec->Encode(chan->GetSendBuffer(), msg->data(), msg->size())) {
+                    minilog(LogLevel_e::WARRNIG, "reply too large for a frame, fd = %d closed", chan->GetSocket());
+                    re->DelChannel(chan);
+                }
+            };
+        });
+        return !full;
+    });
+    if (full) {
+        // stop reading until results come back, the frames not taken stay in the buffer
+        _paused = true;
+        _reactor->DisableEvents(chan.shared_from_this(), ChannelEvent_e::IN);
+        if (_strand->GetInFlight() == 0) {
+            // the pool is full of other connections' work, nothing of ours will resume us
+            _reactor->RunAfter(1, [weak, self]() { onOffloadDelivered(weak, self); });
         }
     }
-    if (chan->GetSendBuffer().empty()) {
-        re->DisableEvents(chan, ChannelEvent_e::OUT);
+    return frames;
+}
+
+// answer every complete request of the batch, the replies go out in one flush
+void Connection::handleFrames(Channel& chan)
+{
+    int frames = 0;
+    if (computePool) {
+        frames = offloadFrames(chan);
+    }
+    else {
+        static thread_local std::string reply;
+        Buffer& sendBuffer = chan.GetSendBuffer();
+        bool tooLarge = false;
+        frames = DispatchFrames(chan.GetRecvBuffer(), *codec, _decode, [&sendBuffer, &tooLarge](const char* data, size_t len) {
+            reply.assign(data, len);
+            std::transform(reply.begin(), reply.end(), reply.begin(), ::toupper);
+            tooLarge = !codec->Encode(sendBuffer, reply.data(), reply.size());
+            return !tooLarge;
+        });
+        if (tooLarge) {
+            minilog(LogLevel_e::WARRNIG, "reply too large for a frame, fd = %d closed", chan.GetSocket());
+            _reactor->DelChannel(chan.shared_from_this());
+            return;
+        }
+        if (frames > 0) {
+            chan.RequestFlush();
+        }
+    }
+    if (frames < 0) {
+        minilog(LogLevel_e::WARRNIG, "malformed frame from fd = %d", chan.GetSocket());
+        _reactor->DelChannel(chan.shared_from_this());
     }
-    return;
 }
 
-void onConnect(SpChannel chan)
+void Connection::OnRead(Channel& chan)
 {
-    SpReactor re = std::static_pointer_cast<Reactor>(chan->GetSpPrivData());
-    int fd = chan->GetSocket();
-    sockaddr_in clientAddr = {};
-    socklen_t len = sizeof(clientAddr);
-    int clientFd = accept(fd, (sockaddr*)&clientAddr, &len);
-    minilog(LogLevel_e::INFO, "accept client address : %s:%d", inet_ntoa(clientAddr.sin_addr), htons(clientAddr.sin_port));
-    if (clientFd == -1) {
-        if (errno != EAGAIN && errno != EINTR) {
+    Buffer& recvBuffer = chan.GetRecvBuffer();
+    if (_paused) {
+        // an edge triggered resume can still get here, the socket keeps what we don't read
+        return;
+    }
+    bool drained = false;
+    for (int i = 0; i < kMaxReadsPerEvent && !drained; i++) {
+        int savedErrno = 0;
+        ssize_t ret = chan.Recv(&savedErrno);
+        if (ret == 0) {
+            minilog(LogLevel_e::WARRNIG, "peer close");
+            _reactor->DelChannel(chan.shared_from_this());
             return;
         }
-        minilog(LogLevel_e::ERROR, "accept error:%s", strerror(errno));
+        else if (ret < 0) {
+            minilog(LogLevel_e::DEBUG, "onRead ret < 0  errno = %d", savedErrno);
+            if (savedErrno == EINTR) {
+                continue;
+            }
+            if (savedErrno != EAGAIN && savedErrno != EWOULDBLOCK) {
+                minilog(LogLevel_e::ERROR, strerror(savedErrno));
+                _reactor->DelChannel(chan.shared_from_this());
+                return;
+            }
+            drained = true;
+        }
+        else {
+            minilog(LogLevel_e::DEBUG, "onRead ret = %d", static_cast<int>(ret));
+            // a short read means the socket buffer is empty, no need to pay for the EAGAIN
+            drained = ret < static_cast<ssize_t>(Buffer::kExtraReadSize);
+        }
     }
-    else {
-        fcntl(clientFd, F_SETFL, O_NONBLOCK);
-        re->AddChannel(CreateSpChannel(clientFd, re, onRead, onSend, nullptr), ChannelEvent_e::IN);
+    if (!drained) {
+        chan.ResumeRead();
+    }
+    if (codec) {
+        handleFrames(chan);
+        return;
+    }
+    // uppercase in place and hand the blocks over to the send buffer, no copy
+    recvBuffer.ForEachChunk([](char* data, size_t len) {
+        std::transform(data, data + len, data, ::toupper);
+    });
+    chan.Send(recvBuffer);
+}
+
+void Connection::OnSend(Channel& chan)
+{
+    while (chan.HasOutput()) {
+        int savedErrno = 0;
+        ssize_t sendLen = chan.Flush(&savedErrno);
+        minilog(LogLevel_e::DEBUG, "onSend sendLen = %d", static_cast<int>(sendLen));
+        if (sendLen < 0 && savedErrno == EINTR) {
+            continue;
+        }
+        if (sendLen < 0 && savedErrno != EAGAIN && savedErrno != EWOULDBLOCK) {
+            // a paused channel doesn't read, so this is where it learns the peer is gone
+            minilog(LogLevel_e::WARRNIG, "send error: %s", strerror(savedErrno));
+            _reactor->DelChannel(chan.shared_from_this());
+            return;
+        }
+        if (sendLen <= 0) {
+            break;
+        }
+    }
+    if (!chan.HasOutput()) {
+        _reactor->DisableEvents(chan.shared_from_this(), ChannelEvent_e::OUT);
+    }
+}
+
+static SpChannel createClientChannel(int clientFd, SpReactor re, AdmissionTicket ticket)
+{
+    SpChannel client = re->CreateChannel(clientFd, nullptr, nullptr, nullptr);
+    client->SetHandler(std::make_shared<Connection>(re.get(), std::move(ticket)));
+    client->SetEdgeTriggered(edgeTriggered);
+    if (socketBusyPollUs > 0 && !client->SetBusyPoll(socketBusyPollUs)) {
+        minilog(LogLevel_e::DEBUG, "fd = %d SO_BUSY_POLL refused: %s", clientFd, strerror(errno));
+    }
+    if (highWaterBytes > 0) {
+        client->SetWaterMarks(highWaterBytes, highWaterBytes / 4, [](SpChannel chan) {
+            minilog(LogLevel_e::INFO, "fd = %d reads slower than it writes, %d bytes queued, pausing",
+                chan->GetSocket(), static_cast<int>(chan->GetSendBuffer().ReadableBytes()));
+        }, [](SpChannel chan) {
+            minilog(LogLevel_e::INFO, "fd = %d drained, resuming", chan->GetSocket());
+        });
+    }
+    return client;
+}
+
+// accept until EAGAIN or the fairness cap, select picks the reactor owning each client and
+// one of fallbacks with room takes it when that one is full; over the total limit, with all
+// of them full or out of fds the listener rests on its reactor, owner
+template <typename Selector>
+static void acceptClients(SpChannel chan, const SpReactor& owner, Selector select, const std::vector<SpReactor>& fallbacks)
+{
+    for (int i = 0; i < kMaxAcceptsPerEvent; i++) {
+        sockaddr_in clientAddr = {};
+        int savedErrno = 0;
+        int clientFd = admission->Accept(*chan, &clientAddr, &savedErrno);
+        if (clientFd == -1) {
+            if (savedErrno == EINTR) {
+                continue;
+            }
+            if (savedErrno == EMFILE || savedErrno == ENFILE) {
+                admission->PauseListener(owner, chan);
+                return;
+            }
+            if (savedErrno != EAGAIN && savedErrno != EWOULDBLOCK) {
+                minilog(LogLevel_e::ERROR, "accept error:%s", strerror(savedErrno));
+            }
+            return;
+        }
+        minilog(LogLevel_e::INFO, "accept client address : %s:%d", inet_ntoa(clientAddr.sin_addr), htons(clientAddr.sin_port));
+        SpReactor re = select(clientAddr);
+        AdmissionTicket ticket = admission->Admit(&re, fallbacks);
+        if (!ticket) {
+            close(clientFd);
+            admission->PauseListener(owner, chan);
+            return;
+        }
+        SpChannel client = createClientChannel(clientFd, re, std::move(ticket));
+        re->AddChannel(client, ChannelEvent_e::IN);
+        if (idleTimeoutMs > 0) {
+            re->SetIdleTimeout(client, idleTimeoutMs);
+        }
+    }
+    chan->ResumeRead();
+}
+
+// listener owned by the main reactor, clients are handed to a sub reactor
+void onConnect(SpChannel chan)
+{
+    SpReactorThreadPool pool = std::static_pointer_cast<ReactorThreadPool>(chan->GetSpPrivData());
+    acceptClients(chan, mainReactor, [&pool](const sockaddr_in& addr) { return pool->Select(addr); }, pool->Reactors());
+}
+
+// SO_REUSEPORT listener owned by a sub reactor, clients stay on that reactor
+void onConnectLocal(SpChannel chan)
+{
+    SpReactor re = std::static_pointer_cast<Reactor>(chan->GetSpPrivData());
+    // the other reactors accept on their own listeners, a full one just rests its own
+    acceptClients(chan, re, [&re](const sockaddr_in&) { return re; }, {});
+}
+
+// the startup report of where every thread runs
+static void report_layout(const CpuTopology& topo, const CpuLayout& layout, const std::string& nic,
+    const SpReactorThreadPool& subRes, const std::vector<SpReactorThread>& others)
+{
+    minilog(LogLevel_e::INFO, "cpu layout: %d cpus, %d cores, %d nodes, nic %s on node %d",
+        static_cast<int>(topo.Cpus().size()), static_cast<int>(topo.CoreCount()), static_cast<int>(topo.NodeCount()),
+        nic.empty() ? "-" : nic.c_str(), nic.empty() ? -1 : CpuTopology::NicNode(nic));
+    for (size_t i = 0; i < subRes->Size(); i++) {
+        minilog(LogLevel_e::INFO, "  %-16s %s", subRes->Reactor(i)->GetName().c_str(),
+            topo.Describe({ layout.reactorCpus[i] }).c_str());
+    }
+    for (auto& thrd : others) {
+        minilog(LogLevel_e::INFO, "  %-16s %s", thrd->Reactor()->GetName().c_str(), topo.Describe(thrd->GetAffinity()).c_str());
+    }
+    minilog(LogLevel_e::INFO, "  %-16s %s", "minilog", topo.Describe(layout.spareCpus).c_str());
+    if (layout.reactorCpus.size() > topo.CoreCount()) {
+        minilog(LogLevel_e::WARRNIG, "more reactors than cores, some share a core");
     }
+    if (layout.spareCpus.empty()) {
+        minilog(LogLevel_e::WARRNIG, "no cpu left over, acceptor and logger share the reactors' cpus");
+    }
+}
+
+static void usage(const char* prog)
+{
+    printf("usage: %s [-p port] [-t sub_reactor_num] [-d rr|least|hash] [-r] [-c] [-b backlog] [-e] [-i idle_seconds] [-u] [-v] [-L log_file] [-R rotate_mb] [-m admin_port] [-f len|len2|len1|line|crlf|fixed:N] [-w compute_threads] [-o high_water_kb] [-O output_budget_mb] [-n max_connections] [-N max_connections_per_reactor] [-a auto|cpu_list] [-I nic] [-B spin_us] [-S socket_busy_poll_us]\n", prog);
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    int port = 12222;
+    size_t threadNum = 0;
+    DispatchPolicy_e policy = DispatchPolicy_e::ROUND_ROBIN;
+    bool reusePort = false;
+    bool cpuSteering = false;
+    int backlog = kDefaultListenBacklog;
+    const char* logFile = nullptr;
+    size_t logRotateBytes = 0;
+    int adminPort = 0;
+    int computeThreads = -1;
+    size_t outputBudget = 0;
+    size_t maxConnections = 0;
+    size_t maxPerReactor = 0;
+    const char* affinity = nullptr;
+    std::string nic;
+    uint64_t spinUs = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:t:d:rcb:ei:uvL:R:m:f:w:o:O:n:N:a:I:B:S:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            threadNum = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'd':
+            if (strcmp(optarg, "least") == 0) {
+                policy = DispatchPolicy_e::LEAST_CHANNELS;
+            }
+            else if (strcmp(optarg, "hash") == 0) {
+                policy = DispatchPolicy_e::ADDR_HASH;
+            }
+            break;
+        case 'r':
+            reusePort = true;
+            break;
+        case 'c':
+            cpuSteering = true;
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'e':
+            edgeTriggered = true;
+            break;
+        case 'i':
+            idleTimeoutMs = static_cast<uint64_t>(atoi(optarg)) * 1000;
+            break;
+        case 'u':
+            backend = PollerBackend_e::IO_URING;
+            break;
+        case 'v':
+            Logger::SetLevel(LogLevel_e::DEBUG);
+            break;
+        case 'L':
+            logFile = optarg;
+            break;
+        case 'R':
+            logRotateBytes = static_cast<size_t>(atoi(optarg)) << 20;
+            break;
+        case 'm':
+            adminPort = atoi(optarg);
+            break;
+        case 'f':
+            codec = CreateSpCodec(optarg);
+            if (!codec) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'w':
+            computeThreads = atoi(optarg);
+            break;
+        case 'o':
+            highWaterBytes = static_cast<size_t>(atoi(optarg)) << 10;
+            break;
+        case 'O':
+            outputBudget = static_cast<size_t>(atoi(optarg)) << 20;
+            break;
+        case 'n':
+            maxConnections = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'N':
+            maxPerReactor = static_cast<size_t>(atoi(optarg));
+            break;
+        case 'a':
+            affinity = optarg;
+            break;
+        case 'I':
+            nic = optarg;
+            break;
+        case 'B':
+            spinUs = static_cast<uint64_t>(atoi(optarg));
+            break;
+        case 'S':
+            socketBusyPollUs = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (logFile && !Logger::Instance()->SetFileSink(logFile, logRotateBytes)) {
+        return 1;
+    }
+
+    if (cpuSteering && (!reusePort || !affinity)) {
+        printf("-c needs -r and -a, a connection goes to the reactor pinned to the cpu that received it\n");
+        return 1;
+    }
+
+    if (computeThreads >= 0) {
+        if (!codec) {
+            printf("-w needs -f, requests are offloaded frame by frame\n");
+            return 1;
+        }
+        computePool = CreateSpComputePool("compute", static_cast<size_t>(computeThreads));
+    }
+
+    admission = CreateSpAdmissionControl(maxConnections, maxPerReactor);
+
+    // -a auto: a reactor per physical core of the nic's node, -a 0-3: reactor i on the i-th cpu
+    CpuTopology topo;
+    CpuLayout layout;
+    if (affinity) {
+        topo = CpuTopology::Detect();
+        if (strcmp(affinity, "auto") == 0) {
+            layout = PlanCpuLayout(topo, threadNum, CpuTopology::NicNode(nic));
+        }
+        else {
+            layout = ListCpuLayout(ParseCpuList(affinity), threadNum);
+        }
+        if (layout.reactorCpus.empty()) {
+            usage(argv[0]);
+            return 1;
+        }
+        threadNum = layout.reactorCpus.size();
+    }
+
     sem_init(sem, 0, 0);
     signal(SIGINT, signal_handler);
 
-    SpReactorThread mainRe = CreateSpReactorThread("main_reactor");
-    mainRe->Open();
-    SpReactorThread subRe = CreateSpReactorThread("sub_reactor");
-    subRe->Open();
+    SpReactorThreadPool subRes = CreateSpReactorThreadPool("sub_reactor", threadNum, backend);
+    subRes->SetPolicy(policy);
+    if (affinity && !subRes->SetAffinity(layout.reactorCpus)) {
+        return 1;
+    }
+    subRes->Open();
+    for (auto& re : subRes->Reactors()) {
+        re->SetOutputBudget(outputBudget);
+        re->SetBusyPoll(spinUs);
+    }
+
+    SpReactorThread mainRe;
+    if (reusePort) {
+        // steered by the cpus the reactors are pinned to, so -c needs -a
+        if (!subRes->ListenReusePort(port, onConnectLocal, backlog, cpuSteering ? layout.reactorCpus : std::vector<int>(),
+            edgeTriggered)) {
+            return 1;
+        }
+    }
+    else {
+        mainRe = CreateSpReactorThread("main_reactor", backend);
+        mainRe->Open();
+        mainReactor = mainRe->Reactor();
+        SpChannel listenChan = CreateSpChannelListen(port, subRes, onConnect, nullptr, backlog);
+        if (!listenChan) {
+            return 1;
+        }
+        listenChan->SetEdgeTriggered(edgeTriggered);
+        mainRe->Reactor()->AddChannel(listenChan, ChannelEvent_e::IN);
+    }
+
+    // metrics are served from the main reactor, or a reactor of their own with -r
+    SpReactorThread adminRe = mainRe;
+    SpAdminServer admin;
+    if (adminPort > 0) {
+        if (!adminRe) {
+            adminRe = CreateSpReactorThread("admin_reactor", backend);
+            adminRe->Open();
+        }
+        admin = CreateSpAdminServer(adminRe->Reactor());
+        admin->AddReactor(adminRe->Reactor());
+        for (auto& re : subRes->Reactors()) {
+            admin->AddReactor(re);
+        }
+        admin->SetAdmission(admission);
+        if (!admin->Listen(adminPort)) {
+            return 1;
+        }
+    }
 
-    mainRe->Reactor()->AddChannel(CreateSpChannelListen(12222, subRe->Reactor(), onConnect, nullptr), ChannelEvent_e::IN);
+    // the acceptor, admin and logger threads go to the cpus the reactors left over
+    if (affinity) {
+        std::vector<SpReactorThread> others;
+        for (auto& thrd : { mainRe, adminRe }) {
+            if (thrd && std::find(others.begin(), others.end(), thrd) == others.end()) {
+                others.push_back(thrd);
+            }
+        }
+        if (!layout.spareCpus.empty()) {
+            for (auto& thrd : others) {
+                thrd->SetAffinity(layout.spareCpus);
+            }
+            SetThreadAffinity(Logger::Instance()->NativeHandle(), layout.spareCpus);
+        }
+        report_layout(topo, layout, nic, subRes, others);
+    }
 
     sem_wait(sem);
     //listenThrd.Stop();
@@ -3,10 +3,27 @@
 #include <functional>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <string>
 #include <algorithm>
+#include <sys/eventfd.h>
+#include "utils.h"
+#include "MiniLog.hpp"
+#include "CpuTopology.hpp"
 #include "WorkerInterface.h"
 
+/*
+ * Runs any number of workers on one thread.
+ *
+ * The worker list is copy-on-write: AddWorker / DelWorker edit it under _mutex and bump
+ * _version, the loop takes a fresh copy only when the version moved, so no lock is held
+ * while a worker runs. Waiting is event driven:
+ *   - a single worker blocks in its own Work(), control changes interrupt it via Wakeup()
+ *   - several workers have their wait fds in a thread epoll; each round the thread waits
+ *     for the earliest fd or deadline and then gives every ready worker one Work(0), so a
+ *     busy worker delays the others by one bounded iteration at most
+ */
 class MiniThread
 {
 public:
@@ -15,63 +32,226 @@ public:
 	MiniThread(const MiniThread&) = delete;
 	MiniThread& operator=(const MiniThread&) = delete;
 	void AddWorker(SpWorker);
+	// once it returns (off this thread) the worker is not running and won't run again
 	void DelWorker(SpWorker);
+	size_t GetWorkerNum();
+	std::thread::id GetThreadId() const { return _thread.get_id(); }
+	// pins the thread to cpus, effective at once; empty lets it run anywhere again
+	bool SetAffinity(const std::vector<int>& cpus);
+	std::vector<int> GetAffinity() const { return _cpus; }
+	void SetName(const std::string& name) { SetThreadName(_thread.native_handle(), name); }
 private:
 	void Work();
+	void runWorkers(std::vector<SpWorker>& workers);
+	bool removeWorker(const SpWorker& worker);
+	void wakeup();
+	void wakeupAll();
 private:
-	bool _running;
-	std::mutex _threadMutex;
+	static const int kMaxWaitMs = 1000;
+	static const int kPollWorkerMs = 10;		// wait cap while a worker without wait fd is hosted
+	static const int kMaxEvents = 64;
+	std::atomic<bool> _running;
+	std::mutex _mutex;
+	std::condition_variable _ackCv;
+	std::vector<SpWorker> _workers;			// guarded by _mutex, copied by the loop
+	std::atomic<uint64_t> _version;
+	uint64_t _ackVersion;					// last version the loop picked up, guarded by _mutex
+	int _epoll;
+	int _wakeFd;							// eventfd, interrupts the thread epoll
+	size_t _round;
+	std::vector<int> _cpus;					// set from the owner's thread
 	std::thread _thread;
-	std::vector<SpWorker> _workers;
 };
 
 MiniThread::MiniThread() :
 	_running(true),
-	_thread(std::thread(&MiniThread::Work, this))
+	_version(0),
+	_ackVersion(0),
+	_epoll(epoll_create1(EPOLL_CLOEXEC)),
+	_wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+	_round(0)
 {
-
+	epoll_event evt{};
+	evt.events = EPOLLIN;
+	evt.data.ptr = nullptr;
+	if (epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeFd, &evt) < 0) {
+		minilog(LogLevel_e::ERROR, "thread epoll ctl add error = %s", strerror(errno));
+	}
+	// started last, Work() uses everything above
+	_thread = std::thread(&MiniThread::Work, this);
 }
 
 MiniThread::~MiniThread()
 {
 	_running = false;
+	wakeupAll();
 	_thread.join();
+	close(_wakeFd);
+	close(_epoll);
+}
+
+void MiniThread::wakeup()
+{
+	uint64_t one = 1;
+	if (write(_wakeFd, &one, sizeof(one)) != sizeof(one)) {
+		minilog(LogLevel_e::ERROR, "can't wakeup thread epoll");
+	}
+}
+
+// the loop is either in the thread epoll or inside one of the workers
+void MiniThread::wakeupAll()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (auto& worker : _workers) {
+			worker->Wakeup();
+		}
+	}
+	wakeup();
 }
 
 void MiniThread::AddWorker(SpWorker worker)
 {
-	std::lock_guard<std::mutex> lock(_threadMutex);
-	_workers.emplace_back(worker);
 	worker->SetThreadId(_thread.get_id());
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		int fd = worker->GetWaitFd();
+		if (fd >= 0) {
+			epoll_event evt{};
+			evt.events = EPOLLIN;
+			evt.data.ptr = worker.get();
+			if (epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &evt) < 0) {
+				minilog(LogLevel_e::ERROR, "thread epoll ctl add error = %s", strerror(errno));
+			}
+		}
+		_workers.emplace_back(worker);
+		_version.fetch_add(1, std::memory_order_release);
+	}
+	wakeupAll();
 }
 
-void MiniThread::DelWorker(SpWorker worker) {
-	std::lock_guard<std::mutex> lock(_threadMutex);
+bool MiniThread::removeWorker(const SpWorker& worker)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
 	auto iter = std::find(_workers.begin(), _workers.end(), worker);
-	if (_workers.end() != iter) {
-		_workers.erase(iter);
+	if (_workers.end() == iter) {
+		return false;
 	}
+	int fd = worker->GetWaitFd();
+	if (fd >= 0) {
+		epoll_event evt{};
+		epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, &evt);
+	}
+	_workers.erase(iter);
+	_version.fetch_add(1, std::memory_order_release);
+	return true;
+}
+
+void MiniThread::DelWorker(SpWorker worker)
+{
+	if (!removeWorker(worker)) {
+		return;
+	}
+	uint64_t version = _version.load();
+	worker->Wakeup();
+	wakeupAll();
+	if (std::this_thread::get_id() == _thread.get_id()) {
+		// called by a worker, the loop drops it after the current round
+		return;
+	}
+	std::unique_lock<std::mutex> lock(_mutex);
+	_ackCv.wait(lock, [this, version]() { return _ackVersion >= version || !_running; });
+}
+
+bool MiniThread::SetAffinity(const std::vector<int>& cpus)
+{
+	std::vector<int> all = cpus;
+	if (all.empty()) {
+		// named, a temporary would be gone before the loop runs (C++11 range for)
+		CpuTopology topo = CpuTopology::Detect();
+		for (auto& info : topo.Cpus()) {
+			all.push_back(info.cpu);
+		}
+	}
+	if (!SetThreadAffinity(_thread.native_handle(), all)) {
+		return false;
+	}
+	_cpus = cpus;
+	return true;
+}
+
+size_t MiniThread::GetWorkerNum()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _workers.size();
 }
 
 void MiniThread::Work()
 {
+	std::vector<SpWorker> workers;
+	uint64_t seen = 0;
 	while (_running) {
-		std::lock_guard<std::mutex> lock(_threadMutex);
-		if(_workers.size() == 0){
-			sleep_ms(10);
+		if (_version.load(std::memory_order_acquire) != seen) {
+			std::vector<SpWorker> fresh;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				fresh = _workers;
+				seen = _version.load(std::memory_order_relaxed);
+				_ackVersion = seen;
+			}
+			_ackCv.notify_all();
+			// the old copy may hold the last reference of a removed worker, drop it unlocked
+			workers.swap(fresh);
+		}
+		if (workers.size() == 1) {
+			if (!workers[0]->Work(kMaxWaitMs)) {
+				removeWorker(workers[0]);
+			}
+		}
+		else {
+			runWorkers(workers);
 		}
-		for (auto worker : _workers) {
-			if (worker) {
-				if (!worker->Work())
-				{
-					auto iter = std::find(_workers.begin(), _workers.end(), worker);
-					if (_workers.end() != iter){
-						_workers.erase(iter);
-					}
-					break;
-				}
+	}
+	std::lock_guard<std::mutex> lock(_mutex);
+	_ackVersion = _version.load();
+	_ackCv.notify_all();
+}
+
+void MiniThread::runWorkers(std::vector<SpWorker>& workers)
+{
+	int timeout = workers.empty() ? -1 : kMaxWaitMs;
+	for (auto& worker : workers) {
+		int next = worker->GetWaitFd() < 0 ? kPollWorkerMs : worker->GetNextTimeout();
+		if (next >= 0 && next < timeout) {
+			timeout = next;
+		}
+	}
+	epoll_event events[kMaxEvents];
+	int n = epoll_wait(_epoll, events, kMaxEvents, timeout);
+	if (n < 0 && errno != EINTR) {
+		minilog(LogLevel_e::ERROR, "thread epoll_wait error = %s", strerror(errno));
+	}
+	std::vector<WorkerInterface*> ready;
+	for (int i = 0; i < n; i++) {
+		if (events[i].data.ptr == nullptr) {
+			uint64_t count;
+			while (read(_wakeFd, &count, sizeof(count)) == sizeof(count)) {
 			}
 		}
+		else {
+			ready.push_back(static_cast<WorkerInterface*>(events[i].data.ptr));
+		}
+	}
+	// start one further each round so no worker is always served first
+	size_t num = workers.size();
+	size_t start = num ? _round++ % num : 0;
+	for (size_t i = 0; i < num && _running; i++) {
+		SpWorker& worker = workers[(start + i) % num];
+		bool run = worker->GetWaitFd() < 0 || worker->GetNextTimeout() == 0 ||
+			std::find(ready.begin(), ready.end(), worker.get()) != ready.end();
+		if (run && !worker->Work(0)) {
+			removeWorker(worker);
+		}
 	}
 }
 
@@ -80,4 +260,4 @@ using SpThread = std::shared_ptr<MiniThread>;
 SpThread CreateSpThread()
 {
 	return std::make_shared<MiniThread>();
-}
\ No newline at end of file
+}
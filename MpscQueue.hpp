@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include "utils.h"
+
+/*
+ * Lock-free multi-producer / single-consumer queue.
+ * Producers push onto an intrusive stack with a CAS, the consumer swaps the whole
+ * stack out with one exchange and runs it in FIFO order. Items pushed while a batch
+ * runs (e.g. a functor pushing another one) land in the next batch.
+ */
+template <typename T>
+class MpscQueue : noncopyable
+{
+public:
+	MpscQueue() : _head(nullptr) {}
+	~MpscQueue();
+	void Push(T value);
+	bool Empty() const { return _head.load() == nullptr; }
+	// pops everything pushed so far and calls f(T&) on each in push order, returns the count
+	template <typename F>
+	size_t ConsumeAll(F f);
+private:
+	struct Node
+	{
+		T value;
+		Node* next;
+	};
+	std::atomic<Node*> _head;
+};
+
+template <typename T>
+MpscQueue<T>::~MpscQueue()
+{
+	Node* node = _head.exchange(nullptr);
+	while (node) {
+		Node* next = node->next;
+		delete node;
+		node = next;
+	}
+}
+
+template <typename T>
+void MpscQueue<T>::Push(T value)
+{
+	Node* node = new Node{std::move(value), _head.load(std::memory_order_relaxed)};
+	// seq_cst on purpose: the reactor checks Empty() after announcing it is about to sleep
+	while (!_head.compare_exchange_weak(node->next, node)) {
+	}
+}
+
+template <typename T>
+template <typename F>
+size_t MpscQueue<T>::ConsumeAll(F f)
+{
+	Node* node = _head.exchange(nullptr, std::memory_order_acquire);
+	Node* reversed = nullptr;
+	while (node) {
+		Node* next = node->next;
+		node->next = reversed;
+		reversed = node;
+		node = next;
+	}
+	size_t count = 0;
+	while (reversed) {
+		Node* next = reversed->next;
+		f(reversed->value);
+		delete reversed;
+		reversed = next;
+		count++;
+	}
+	return count;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <memory>
+#include "Channel.hpp"
+#include "ReactorMetrics.hpp"
+
+enum class PollerBackend_e
+{
+	EPOLL = 0,
+	IO_URING		// falls back to EPOLL when the kernel lacks the needed features
+};
+
+// What a Reactor waits with: readiness (EpollWrapper) or completions (IoUringWrapper).
+// Handlers stay backend neutral by doing their I/O through Channel::Recv / Flush / Accept.
+class PollerInterface
+{
+public:
+	virtual ~PollerInterface() {}
+	virtual bool Add(SpChannel, ChannelEvent_e) = 0;
+	virtual bool Delete(SpChannel) = 0;
+	virtual bool Modify(SpChannel, ChannelEvent_e) = 0;
+	// waits up to timeout ms and runs the handlers, returns the number of events
+	virtual int PollOnce(int timeout) = 0;
+	virtual bool HasChannel(SpChannel) const = 0;
+	virtual size_t GetChannelNum() const = 0;
+	// readable while events are waiting, lets a thread wait on several pollers
+	virtual int GetWaitFd() const = 0;
+	// monotonic ms taken when the last batch of events arrived
+	virtual uint64_t GetPollTime() const = 0;
+	// work queued for the next PollOnce, which must then not block
+	virtual bool HasPending() const = 0;
+	virtual PollerBackend_e GetBackend() const = 0;
+	// where PollOnce and the channels added from now on count their work, may be null
+	virtual void SetMetrics(ReactorMetrics*) = 0;
+};
+
+using SpPoller = std::shared_ptr<PollerInterface>;
@@ -5,14 +5,19 @@
 #include <memory>
 #include <thread>
 #include <algorithm>
-#include <map>
-#include <queue>
+#include <atomic>
+#include <sys/eventfd.h>
 
 #include "utils.h"
 #include "Channel.hpp"
 #include "WorkerInterface.h"
 #include "MiniLog.hpp"
 #include "EpollWrapper.hpp"
+#include "IoUringWrapper.hpp"
+#include "MemPool.hpp"
+#include "MpscQueue.hpp"
+#include "TimerWheel.hpp"
+#include "ReactorMetrics.hpp"
 
 class Reactor;
 using SpReactor = std::shared_ptr<Reactor>;
@@ -20,80 +25,223 @@ class Reactor : public WorkerInterface, public std::enable_shared_from_this<Reac
 {
 public:
 	Reactor() = delete;
-	explicit Reactor(const std::string &);
+	// IO_URING falls back to EPOLL when the kernel can't do it, see GetBackend
+	explicit Reactor(const std::string &, PollerBackend_e backend = PollerBackend_e::EPOLL);
 	~Reactor();
-	bool Work() override;
+	bool Work(int timeoutMs) override;
 	void SetThreadId(const std::thread::id &) override;
+	int GetWaitFd() override { return _poller->GetWaitFd(); }
+	int GetNextTimeout() override;
+	void Wakeup() override { wakeup(); }
 	std::string GetName() const { return _name; };
+	PollerBackend_e GetBackend() const { return _poller->GetBackend(); }
+	size_t GetChannelNum() const { return _poller->GetChannelNum(); }
 
 	void AddChannel(SpChannel, ChannelEvent_e);
 	void DelChannel(SpChannel);
 	void EnableEvents(SpChannel, ChannelEvent_e);
 	void DisableEvents(SpChannel, ChannelEvent_e);
 	void PushFunctor(std::function<void(void)>);
+
+	// channel and its buffer blocks come from this reactor's pools
+	SpChannel CreateChannel(int fd, CallBackFunc read, CallBackFunc send, CallBackFunc error);
+	void SetPoolLimits(size_t maxFreeChannels, size_t maxFreeBlocks);
+	// Fills the pools from this reactor's thread, so that once the thread is pinned the
+	// memory of its channels and buffers is on its own NUMA node (first touch)
+	void ReservePools();
+	MemPoolStats GetChannelPoolStats() { return _channelPool->GetStats(); }
+	MemPoolStats GetBlockPoolStats() { return _blockPool->GetStats(); }
+	// coroutine frames of this reactor's connections come from here, see Coroutine.hpp
+	const SpMemPool& GetFramePool() const { return _framePool; }
+	MemPoolStats GetFramePoolStats() { return _framePool->GetStats(); }
+	// written by the reactor thread, safe to read from any thread
+	const ReactorMetrics& GetMetrics() const { return _metrics; }
+	// Once the send buffers of all channels together hold more than bytes, every channel
+	// adding to them stops reading until its own buffer is down to its low water mark
+	// (empty if it has none), see Channel::SetWaterMarks. 0, the default, is no limit.
+	void SetOutputBudget(size_t bytes);
+	// bytes waiting in the send buffers, safe to read from any thread
+	size_t GetOutputBuffered() const { return _output.used.load(std::memory_order_relaxed); }
+	// For a reactor on a dedicated core: after any event the poller is polled without
+	// waiting for spinUs before the reactor blocks again, so a reply that follows shortly
+	// skips the sleep and wakeup. Costs a full core while traffic flows; 0 (default) is off.
+	void SetBusyPoll(uint64_t spinUs);
+
+	// Timers run in the reactor thread. Called from another thread the timer is still
+	// scheduled, but through PushFunctor, and kInvalidTimerId is returned.
+	TimerId RunAfter(uint64_t delayMs, TimerCallback cb);
+	TimerId RunEvery(uint64_t intervalMs, TimerCallback cb);
+	void Cancel(TimerId id);
+	size_t GetTimerNum() const { return _timers.Size(); }
+	// onIdle (DelChannel when empty) runs once nothing was read for idleMs, 0 turns it off
+	void SetIdleTimeout(SpChannel, uint64_t idleMs, CallBackFunc onIdle = nullptr);
 private:
 	void Init();
 	void wakeup();
 	bool isInSelfWorkThread() { return std::this_thread::get_id() == _thrdId; }
 	void handlePendingFunctors();
+	void flushPending();
+	TimerId addTimer(uint64_t delayMs, uint64_t intervalMs, TimerCallback cb);
+	void checkIdle(Channel* chan);
+	void removeChannel(const SpChannel& chan);
+	bool spinning(uint64_t nowNs) const { return _spinNs > 0 && nowNs - _lastActiveNs < _spinNs; }
 	
 private:
 	bool _init;
 	std::string _name;
-	std::mutex _pendingMutex;
-	std::queue<std::function<void(void)>> _pendingFunctors;
-	SpEpoll _epoll;
+	MpscQueue<std::function<void(void)>> _pendingFunctors;
+	SpPoller _poller;
 	bool _running;
 	std::thread::id _thrdId;
-	int _wakeUpFd[2];
+	int _wakeUpFd;						// eventfd
+	std::atomic<bool> _sleeping;		// set while we are not about to run the functors, producers only signal then
+	static const int kPollTimeoutMs = 1000;
+	uint64_t _lastEventMs;
+	SpMemPool _channelPool;
+	SpMemPool _blockPool;
+	SpMemPool _framePool;
+	static const size_t kMaxFreeChannels = 4096;
+	// allocate_shared puts its control block in front of the channel, 32 bytes with libstdc++
+	static const size_t kChannelAllocSize = sizeof(Channel) + 64;
+	static const size_t kMaxFreeBlocks = 8192;
+	static const size_t kMaxFreeFrames = 4096;
+	static const size_t kFrameAllocSize = 1024;	// larger frames bypass the pool
+	static const size_t kIdlePoolKeep = 64;		// what the pools keep after a poll timed out
+	TimerWheel _timers;
+	ReactorMetrics _metrics;
+	ReactorOutput _output;
+	uint64_t _spinNs;					// busy poll budget after activity, 0: off
+	uint64_t _lastActiveNs;				// last poll with events, kept while busy polling only
 };
 
 static void wake_up_call_back(SpChannel chan)
 {
 	SpReactor re = std::static_pointer_cast<Reactor>(chan->GetSpPrivData());
 	int fd = chan->GetSocket();
-	char one = {};
-	int n = read(fd, &one, sizeof(one));
-	if (n != sizeof(one))
+	uint64_t one = 0;
+	ssize_t n = read(fd, &one, sizeof(one));
+	// under io_uring a poll completion may report a wakeup an earlier read already took
+	if (n != sizeof(one) && !(n < 0 && errno == EAGAIN))
 	{
 		minilog(LogLevel_e::ERROR, "[%s] wakeup failed!", re->GetName().c_str());
 	}
-	else
-	{
-		minilog(LogLevel_e::INFO, "[%s] wake up!", re->GetName().c_str());
+}
+
+static SpPoller create_poller(const std::string& name, PollerBackend_e backend)
+{
+	if (backend == PollerBackend_e::IO_URING) {
+		auto uring = std::make_shared<IoUringWrapper>();
+		if (uring->Init()) {
+			return uring;
+		}
+		minilog(LogLevel_e::WARRNIG, "[%s] io_uring unavailable, falling back to epoll", name.c_str());
 	}
+	return CreateSpEpoll();
 }
 
-Reactor::Reactor(const std::string &name) : 
+Reactor::Reactor(const std::string &name, PollerBackend_e backend) :
 	_name(name),
-	_epoll(CreateSpEpoll())
+	_poller(create_poller(name, backend)),
+	_lastEventMs(monotonic_ms()),
+	_channelPool(CreateSpMemPool(name + "_channel", kMaxFreeChannels, kChannelAllocSize)),
+	_blockPool(CreateSpMemPool(name + "_block", kMaxFreeBlocks, kBufferBlockAllocSize)),
+	_framePool(CreateSpMemPool(name + "_frame", kMaxFreeFrames, kFrameAllocSize)),
+	_timers(monotonic_ms()),
+	_spinNs(0),
+	_lastActiveNs(0)
 {
 	_init = false;
+	_sleeping = false;
+	// created here rather than in Init so that channels pushed before the first Work can wake us up
+	_wakeUpFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	_poller->SetMetrics(&_metrics);
+	_output.reapply = [this](SpChannel chan) { _poller->Modify(chan, chan->GetEvents()); };
 }
 
 Reactor::~Reactor()
 {
-
+	if (!_init) {
+		close(_wakeUpFd);
+	}
 }
 
 void Reactor::Init()
 {
-	socketpair(AF_UNIX, SOCK_STREAM, 0, _wakeUpFd);
-	auto wakeUpChannel = CreateSpChannel(_wakeUpFd[1], shared_from_this(), wake_up_call_back, nullptr, nullptr);
-	_epoll->Add(wakeUpChannel, ChannelEvent_e::IN);
+	auto wakeUpChannel = CreateSpChannel(_wakeUpFd, shared_from_this(), [this](SpChannel chan) {
+		wake_up_call_back(chan);
+		_metrics.wakeups.Add();
+	}, nullptr, nullptr);
+	_poller->Add(wakeUpChannel, ChannelEvent_e::IN);
 	_init = true;
 }
 
-bool Reactor::Work()
+bool Reactor::Work(int timeoutMs)
 {
 	if(!_init){
 		Init();
 	}
-	_epoll->PollOnce(1000);
+	int maxMs = kPollTimeoutMs;
+	if (timeoutMs >= 0 && timeoutMs < maxMs) {
+		maxMs = timeoutMs;
+	}
+	uint64_t waitStart = 0;
+	bool spin = false;
+	if (_spinNs > 0) {
+		waitStart = monotonic_ns();
+		spin = spinning(waitStart);
+	}
+	int timeout = 0;
+	if (spin) {
+		// back from the zero timeout poll right away, a producer need not signal
+		_sleeping.store(false, std::memory_order_relaxed);
+	}
+	else {
+		_sleeping.store(true);
+		timeout = _pendingFunctors.Empty() ? _timers.NextTimeout(monotonic_ms(), maxMs) : 0;
+	}
+	int activeNums = _poller->PollOnce(timeout);
+	_sleeping.store(false, std::memory_order_relaxed);
+	if (_spinNs > 0) {
+		uint64_t waitEnd = activeNums > 0 ? _metrics.pollReturnNs : monotonic_ns();
+		(spin ? _metrics.spinNs : _metrics.sleepNs).Add(waitEnd - waitStart);
+		if (activeNums > 0) {
+			_lastActiveNs = waitEnd;
+			if (spin) {
+				_metrics.spinHits.Add();
+			}
+		}
+	}
+	uint64_t busyStart = activeNums > 0 ? _metrics.pollReturnNs : monotonic_ns();
+	uint64_t now = monotonic_ms();
+	if (activeNums > 0) {
+		_lastEventMs = now;
+	}
+	else if (now - _lastEventMs >= static_cast<uint64_t>(kPollTimeoutMs)) {
+		// a whole second without events, give pooled memory back
+		_lastEventMs = now;
+		_channelPool->Trim(kIdlePoolKeep);
+		_blockPool->Trim(kIdlePoolKeep);
+		_framePool->Trim(kIdlePoolKeep);
+	}
+	_timers.Advance(now);
 	handlePendingFunctors();
+	flushPending();
+	_metrics.loopNs.Record(monotonic_ns() - busyStart);
+	// Between two Work calls the thread may be waiting in its own epoll or running other
+	// workers, both count as sleeping. A functor pushed after the batch above either sees
+	// the flag or is seen by the next GetNextTimeout / Work (both seq_cst).
+	_sleeping.store(true);
 	return true;
 }
 
+int Reactor::GetNextTimeout()
+{
+	if (!_init || !_pendingFunctors.Empty() || _poller->HasPending() || (_spinNs > 0 && spinning(monotonic_ns()))) {
+		return 0;
+	}
+	return _timers.NextTimeout(monotonic_ms(), kPollTimeoutMs);
+}
+
 void Reactor::SetThreadId(const std::thread::id &id)
 {
 	_thrdId = id;
@@ -102,13 +250,16 @@ void Reactor::SetThreadId(const std::thread::id &id)
 void Reactor::AddChannel(SpChannel channel, ChannelEvent_e events)
 {
 	PushFunctor([this, channel, events](){
-		if (_epoll->IsChannelInEpoll(channel))
+		if (_poller->HasChannel(channel))
 		{
-			minilog(LogLevel_e::WARRNIG, "[%s] channel(fd = %d) has already in epoll(fd = %d)", _name.c_str(), channel->GetSocket(), this->_epoll->GetEpollFd());
+			minilog(LogLevel_e::WARRNIG, "[%s] channel(fd = %d) has already in poller(fd = %d)", _name.c_str(), channel->GetSocket(), _poller->GetWaitFd());
 		}
 		else{
 			minilog(LogLevel_e::DEBUG, "[%s] add channel(fd = %d, events = %d)", _name.c_str(), channel->GetSocket(), channel->GetEvents());
-			_epoll->Add(channel, events);
+			if (_poller->Add(channel, events)) {
+				channel->_output = &_output;
+				channel->updateOutput();
+			}
 		}
 	});
 }
@@ -116,28 +267,40 @@ void Reactor::AddChannel(SpChannel channel, ChannelEvent_e events)
 void Reactor::DelChannel(SpChannel channel)
 {
 	PushFunctor([this, channel](){
-		if (!_epoll->IsChannelInEpoll(channel))
+		if (!_poller->HasChannel(channel))
 		{
-			minilog(LogLevel_e::WARRNIG, "[%s] This channel(fd = %d) is not in epoll(fd = %d)", _name.c_str(), channel->GetSocket(), _epoll->GetEpollFd());
+			minilog(LogLevel_e::WARRNIG, "[%s] This channel(fd = %d) is not in poller(fd = %d)", _name.c_str(), channel->GetSocket(), _poller->GetWaitFd());
 		}
 		else{
 			minilog(LogLevel_e::DEBUG, "[%s] delete channel(fd = %d, events = %d)", _name.c_str(), channel->GetSocket(), channel->GetEvents());
-			_epoll->Delete(channel);
+			removeChannel(channel);
 		}
 	});
 }
 
+// every channel leaves the poller through here, its idle timer holds a raw pointer to it
+void Reactor::removeChannel(const SpChannel& chan)
+{
+	if (chan->_idleTimer != kInvalidTimerId) {
+		_timers.Cancel(chan->_idleTimer);
+		chan->_idleTimer = kInvalidTimerId;
+	}
+	chan->releaseOutput();
+	_poller->Delete(chan);
+}
+
 void Reactor::EnableEvents(SpChannel channel, ChannelEvent_e events)
 {
 	PushFunctor([this, channel, events](){
-		if (!_epoll->IsChannelInEpoll(channel))
+		if (!_poller->HasChannel(channel))
 		{
-			minilog(LogLevel_e::ERROR, "[%s] This channel(fd = %d) is not in epoll(fd = %d)", _name.c_str(), channel->GetSocket(), _epoll->GetEpollFd());
+			minilog(LogLevel_e::ERROR, "[%s] This channel(fd = %d) is not in poller(fd = %d)", _name.c_str(), channel->GetSocket(), _poller->GetWaitFd());
 		}
 		else{
 			ChannelEvent_e oldEvts = channel->GetEvents();
 			ChannelEvent_e newEvts = static_cast<ChannelEvent_e>(oldEvts | events);
-			_epoll->Modify(channel, newEvts);
+			_poller->Modify(channel, newEvts);
+			channel->updateOutput();
 			minilog(LogLevel_e::DEBUG, "[%s] enable events %d, channel(fd = %d, events %d -> %d)", _name.c_str(), events, channel->GetSocket(), oldEvts, channel->GetEvents());
 		}
 	});
@@ -145,26 +308,132 @@ void Reactor::EnableEvents(SpChannel channel, ChannelEvent_e events)
 
 void Reactor::DisableEvents(SpChannel channel, ChannelEvent_e events){
 	PushFunctor([this, channel, events](){
-		if (!_epoll->IsChannelInEpoll(channel))
+		if (!_poller->HasChannel(channel))
 		{
-			minilog(LogLevel_e::ERROR, "[%s] This channel(fd = %d) is not in epoll(fd = %d)", _name.c_str(), channel->GetSocket(), _epoll->GetEpollFd());
+			minilog(LogLevel_e::ERROR, "[%s] This channel(fd = %d) is not in poller(fd = %d)", _name.c_str(), channel->GetSocket(), _poller->GetWaitFd());
 		}
 		else{
 			ChannelEvent_e oldEvts = channel->GetEvents();
 			ChannelEvent_e newEvts = static_cast<ChannelEvent_e>(oldEvts & ~events);
-			_epoll->Modify(channel, newEvts);
+			_poller->Modify(channel, newEvts);
+			channel->updateOutput();
 			minilog(LogLevel_e::DEBUG, "[%s] disable events %d, channel(fd = %d, events %d -> %d)", _name.c_str(), events, channel->GetSocket(), oldEvts, channel->GetEvents());
 		}
 	});
 }
 
-void Reactor::PushFunctor(std::function<void(void)> functor)
+SpChannel Reactor::CreateChannel(int fd, CallBackFunc read, CallBackFunc send, CallBackFunc error)
 {
-	{
-		std::lock_guard<std::mutex> lock(_pendingMutex);
-		_pendingFunctors.push(functor);
+	return std::allocate_shared<Channel>(PoolAllocator<Channel>(_channelPool), fd, shared_from_this(),
+		std::move(read), std::move(send), std::move(error), _blockPool);
+}
+
+void Reactor::SetOutputBudget(size_t bytes)
+{
+	PushFunctor([this, bytes]() { _output.limit = bytes; });
+}
+
+void Reactor::ReservePools()
+{
+	PushFunctor([this]() {
+		_channelPool->Reserve(kIdlePoolKeep);
+		_blockPool->Reserve(kIdlePoolKeep);
+		_framePool->Reserve(kIdlePoolKeep);
+	});
+}
+
+void Reactor::SetBusyPoll(uint64_t spinUs)
+{
+	PushFunctor([this, spinUs]() {
+		_spinNs = spinUs * 1000;
+		_lastActiveNs = monotonic_ns();
+	});
+}
+
+void Reactor::SetPoolLimits(size_t maxFreeChannels, size_t maxFreeBlocks)
+{
+	_channelPool->SetMaxFree(maxFreeChannels);
+	_blockPool->SetMaxFree(maxFreeBlocks);
+}
+
+TimerId Reactor::RunAfter(uint64_t delayMs, TimerCallback cb)
+{
+	return addTimer(delayMs, 0, std::move(cb));
+}
+
+TimerId Reactor::RunEvery(uint64_t intervalMs, TimerCallback cb)
+{
+	return addTimer(intervalMs, std::max<uint64_t>(intervalMs, 1), std::move(cb));
+}
+
+TimerId Reactor::addTimer(uint64_t delayMs, uint64_t intervalMs, TimerCallback cb)
+{
+	if (!isInSelfWorkThread()) {
+		PushFunctor([this, delayMs, intervalMs, cb]() {
+			_timers.Add(monotonic_ms() + delayMs, intervalMs, cb);
+		});
+		return kInvalidTimerId;
 	}
-	if (!isInSelfWorkThread())
+	return _timers.Add(monotonic_ms() + delayMs, intervalMs, std::move(cb));
+}
+
+void Reactor::Cancel(TimerId id)
+{
+	if (!isInSelfWorkThread()) {
+		PushFunctor([this, id]() { _timers.Cancel(id); });
+		return;
+	}
+	_timers.Cancel(id);
+}
+
+void Reactor::SetIdleTimeout(SpChannel channel, uint64_t idleMs, CallBackFunc onIdle)
+{
+	PushFunctor([this, channel, idleMs, onIdle]() {
+		if (!_poller->HasChannel(channel)) {
+			minilog(LogLevel_e::ERROR, "[%s] This channel(fd = %d) is not in poller(fd = %d)", _name.c_str(), channel->GetSocket(), _poller->GetWaitFd());
+			return;
+		}
+		Channel* chan = channel.get();
+		chan->_idleTimeoutMs = idleMs;
+		chan->_onIdle = onIdle;
+		chan->_lastActiveMs = monotonic_ms();
+		if (idleMs == 0) {
+			_timers.Cancel(chan->_idleTimer);
+			chan->_idleTimer = kInvalidTimerId;
+		}
+		else if (!_timers.Restart(chan->_idleTimer, chan->_lastActiveMs + idleMs)) {
+			// two pointers fit std::function's local storage, so arming costs no allocation
+			chan->_idleTimer = _timers.Add(chan->_lastActiveMs + idleMs, 0, [this, chan]() { checkIdle(chan); });
+		}
+	});
+}
+
+// Reads only refresh _lastActiveMs; the wheel is touched once per timeout period at most.
+void Reactor::checkIdle(Channel* chan)
+{
+	uint64_t now = monotonic_ms();
+	uint64_t deadline = chan->_lastActiveMs + chan->_idleTimeoutMs;
+	if (deadline > now) {
+		_timers.Restart(chan->_idleTimer, deadline);
+		return;
+	}
+	SpChannel channel = chan->shared_from_this();
+	minilog(LogLevel_e::INFO, "[%s] channel(fd = %d) idle for %d ms", _name.c_str(), chan->GetSocket(), static_cast<int>(now - chan->_lastActiveMs));
+	_timers.Cancel(chan->_idleTimer);
+	chan->_idleTimer = kInvalidTimerId;
+	if (chan->_onIdle) {
+		chan->_onIdle(channel);
+	}
+	else {
+		removeChannel(channel);
+	}
+}
+
+void Reactor::PushFunctor(std::function<void(void)> functor)
+{
+	_pendingFunctors.Push(std::move(functor));
+	// one eventfd write per sleep no matter how many producers push
+	if (!isInSelfWorkThread() && _sleeping.exchange(false))
 	{
 		wakeup();
 	}
@@ -172,8 +441,8 @@ void Reactor::PushFunctor(std::function<void(void)> functor)
 
 void Reactor::wakeup()
 {
-	char one = '1';
-	auto n = write(_wakeUpFd[0], &one, sizeof(one));
+	uint64_t one = 1;
+	auto n = write(_wakeUpFd, &one, sizeof(one));
 	if (n != sizeof(one))
 	{
 		minilog(LogLevel_e::ERROR, "can't wakeup this epoll loop");
@@ -182,17 +451,56 @@ void Reactor::wakeup()
 
 void Reactor::handlePendingFunctors()
 {
-	std::lock_guard<std::mutex> lock(_pendingMutex);
-	while (_pendingFunctors.size() > 0)
-	{
-		auto func = _pendingFunctors.front();
-		if(func) func();
-		_pendingFunctors.pop();
+	if (_pendingFunctors.Empty()) {
+		return;
+	}
+	uint64_t start = monotonic_ns();
+	size_t n = _pendingFunctors.ConsumeAll([](std::function<void(void)>& func) {
+		if (func) func();
+	});
+	uint64_t ns = monotonic_ns() - start;
+	_metrics.functors.Add(n);
+	_metrics.functorBatch.Record(n);
+	_metrics.functorNs.Add(ns);
+}
+
+// The writes Channel::Send put off, one per channel however many replies it got this
+// iteration. Only what the socket doesn't take waits for OUT.
+void Reactor::flushPending()
+{
+	if (_output.pending.empty()) {
+		return;
+	}
+	std::vector<SpChannel> pending;
+	pending.swap(_output.pending);
+	for (auto& chan : pending) {
+		chan->_flushPending = false;
+		if (!chan->_inEpoll) {
+			continue;
+		}
+		while (chan->HasOutput()) {
+			int savedErrno = 0;
+			ssize_t n = chan->Flush(&savedErrno);
+			if (n <= 0 && savedErrno != EINTR) {
+				break;
+			}
+		}
+		// under io_uring Flush only reports, the poller sends for channels with OUT on;
+		// a hard error is left for the send handler to see
+		if (chan->HasOutput() && !(chan->GetEvents() & ChannelEvent_e::OUT)) {
+			_poller->Modify(chan, static_cast<ChannelEvent_e>(chan->GetEvents() | ChannelEvent_e::OUT));
+		}
+		chan->updateOutput();
+	}
+	// the vector keeps its capacity for the next iteration
+	pending.clear();
+	if (_output.pending.empty()) {
+		pending.swap(_output.pending);
 	}
 }
 
 /*--------------- shared_ptr -----------*/
-SpReactor CreateSpReactor(const std::string &name)
+SpReactor CreateSpReactor(const std::string &name, PollerBackend_e backend = PollerBackend_e::EPOLL)
 {
-	return std::make_shared<Reactor>(name);
+	return std::make_shared<Reactor>(name, backend);
 }
\ No newline at end of file
@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include "utils.h"
+#include "Histogram.hpp"
+
+// Counter written by one thread and read by any: relaxed load + store instead of a
+// locked add, the reader may see a value a few increments old.
+class MetricCounter : noncopyable
+{
+public:
+	MetricCounter() : _value(0) {}
+	void Add(uint64_t n = 1) { _value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+	uint64_t Get() const { return _value.load(std::memory_order_relaxed); }
+private:
+	std::atomic<uint64_t> _value;
+};
+
+static inline uint64_t monotonic_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * What one reactor did since it was created. Only the reactor's thread writes
+ * (Reactor::Work, the poller's PollOnce and the channel I/O), an exporter on another
+ * thread reads it at any time. Times are taken once per poll batch and once per
+ * functor batch, never per callback, so this stays cheap enough to leave on.
+ */
+struct ReactorMetrics : noncopyable
+{
+	MetricCounter polls;			// PollOnce calls
+	MetricCounter emptyPolls;		// polls that returned without any event
+	MetricCounter events;			// ready events (epoll) or completions (io_uring) dispatched
+	MetricCounter wakeups;			// eventfd wakeups by other threads
+	MetricCounter accepts;
+	MetricCounter bytesIn;
+	MetricCounter bytesOut;
+	MetricCounter functors;
+	MetricCounter readPauses;		// channels that stopped reading because their output backed up
+	MetricCounter callbackNs;		// spent in the channel callbacks
+	MetricCounter functorNs;		// spent in the pending functors
+	MetricCounter spinNs;			// busy polling without a wait, see Reactor::SetBusyPoll
+	MetricCounter sleepNs;			// blocked in the poller, counted while busy polling is on
+	MetricCounter spinHits;			// spinning polls that found events, each a sleep and wakeup saved
+	AtomicHistogram eventsPerPoll;
+	AtomicHistogram callbackBatchNs;	// one poll's worth of callbacks
+	AtomicHistogram functorBatch;	// functors found queued by one drain, i.e. the queue depth
+	AtomicHistogram loopNs;			// busy part of a loop iteration, from poll return to the next wait
+	uint64_t pollReturnNs = 0;		// when the last wait returned events, owner thread only
+};
@@ -6,20 +6,34 @@ class ReactorThread
 {
 public:
     ReactorThread() = delete;
-    ReactorThread(const std::string& name);
+    ReactorThread(const std::string& name, PollerBackend_e backend = PollerBackend_e::EPOLL);
+    // hosts the reactor on an existing thread, next to that thread's other workers
+    ReactorThread(const std::string& name, SpThread thread, PollerBackend_e backend = PollerBackend_e::EPOLL);
     ~ReactorThread();
     bool Open();
     void Close();
     SpReactor Reactor(){return _reactor;}
+    // pins the hosting thread (and whatever else it hosts) and refills the reactor's
+    // memory pools from there, so they are local to the thread's node
+    bool SetAffinity(const std::vector<int>& cpus);
+    std::vector<int> GetAffinity() const { return _thread ? _thread->GetAffinity() : std::vector<int>(); }
 private:
     SpReactor _reactor;
     SpThread _thread;
 };
 
-ReactorThread::ReactorThread(const std::string& name)
+ReactorThread::ReactorThread(const std::string& name, PollerBackend_e backend)
 {
-    _reactor = CreateSpReactor(name);
+    _reactor = CreateSpReactor(name, backend);
     _thread = CreateSpThread();
+    // the thread is ours alone, name it after the reactor for top -H and perf
+    _thread->SetName(name);
+}
+
+ReactorThread::ReactorThread(const std::string& name, SpThread thread, PollerBackend_e backend) :
+    _reactor(CreateSpReactor(name, backend)),
+    _thread(thread)
+{
 }
 
 ReactorThread::~ReactorThread()
@@ -33,6 +47,16 @@ bool ReactorThread::Open()
         return false;
     }
     _thread->AddWorker(_reactor);
+    return true;
+}
+
+bool ReactorThread::SetAffinity(const std::vector<int>& cpus)
+{
+    if(!_thread || !_thread->SetAffinity(cpus)){
+        return false;
+    }
+    _reactor->ReservePools();
+    return true;
 }
 
 void ReactorThread::Close()
@@ -41,7 +65,12 @@ void ReactorThread::Close()
 }
 
 using SpReactorThread = std::shared_ptr<ReactorThread>;
-SpReactorThread CreateSpReactorThread(const std::string& name)
+SpReactorThread CreateSpReactorThread(const std::string& name, PollerBackend_e backend = PollerBackend_e::EPOLL)
+{
+    return std::make_shared<ReactorThread>(name, backend);
+}
+
+SpReactorThread CreateSpReactorThread(const std::string& name, SpThread thread, PollerBackend_e backend = PollerBackend_e::EPOLL)
 {
-    return std::make_shared<ReactorThread>(name);
+    return std::make_shared<ReactorThread>(name, thread, backend);
 }
\ No newline at end of file
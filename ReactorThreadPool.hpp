@@ -0,0 +1,203 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <functional>
+#include "ReactorThread.hpp"
+
+enum class DispatchPolicy_e
+{
+	ROUND_ROBIN = 0,
+	LEAST_CHANNELS,		// reactor with the fewest channels in its epoll
+	ADDR_HASH			// same peer ip always lands on the same reactor
+};
+
+// returns the index of the reactor that should own a new connection from peer
+using DispatchFunc = std::function<size_t(const std::vector<SpReactor>&, const sockaddr_in& peer)>;
+
+class ReactorThreadPool : noncopyable
+{
+public:
+	ReactorThreadPool() = delete;
+	explicit ReactorThreadPool(const std::string& name, size_t threadNum = 0, PollerBackend_e backend = PollerBackend_e::EPOLL);
+	~ReactorThreadPool();
+	bool Open();
+	void Close();
+	void SetPolicy(DispatchPolicy_e policy);
+	void SetDispatcher(DispatchFunc func);
+	// reactor i on cpus[i % cpus.size()], see PlanCpuLayout
+	bool SetAffinity(const std::vector<int>& cpus);
+	SpReactor Select(const sockaddr_in& peer);
+	// steeringCpus, the cpu reactor i is pinned to for each i, hands every connection to the
+	// reactor on the cpu that received it; empty leaves the spreading to the kernel's hash
+	bool ListenReusePort(int port, CallBackFunc connect, int backlog = kDefaultListenBacklog,
+		const std::vector<int>& steeringCpus = {}, bool edgeTriggered = false);
+	SpReactor Reactor(size_t index) { return _reactors[index % _reactors.size()]; }
+	const std::vector<SpReactor>& Reactors() const { return _reactors; }
+	size_t Size() const { return _reactors.size(); }
+private:
+	size_t roundRobin();
+	size_t leastChannels() const;
+	static size_t addrHash(const sockaddr_in& peer, size_t n);
+private:
+	std::string _name;
+	std::vector<SpReactorThread> _threads;
+	std::vector<SpReactor> _reactors;
+	DispatchPolicy_e _policy;
+	DispatchFunc _dispatcher;
+	std::atomic<size_t> _next;
+};
+
+ReactorThreadPool::ReactorThreadPool(const std::string& name, size_t threadNum, PollerBackend_e backend) :
+	_name(name),
+	_policy(DispatchPolicy_e::ROUND_ROBIN),
+	_next(0)
+{
+	if (threadNum == 0) {
+		threadNum = std::max<size_t>(1, std::thread::hardware_concurrency());
+	}
+	for (size_t i = 0; i < threadNum; i++) {
+		auto thrd = CreateSpReactorThread(_name + "_" + std::to_string(i), backend);
+		_threads.emplace_back(thrd);
+		_reactors.emplace_back(thrd->Reactor());
+	}
+}
+
+ReactorThreadPool::~ReactorThreadPool()
+{
+
+}
+
+bool ReactorThreadPool::Open()
+{
+	for (auto& thrd : _threads) {
+		if (!thrd->Open()) {
+			minilog(LogLevel_e::ERROR, "[%s] open reactor thread failed", _name.c_str());
+			return false;
+		}
+	}
+	minilog(LogLevel_e::INFO, "[%s] %d sub reactors started", _name.c_str(), static_cast<int>(_threads.size()));
+	return true;
+}
+
+void ReactorThreadPool::Close()
+{
+	for (auto& thrd : _threads) {
+		thrd->Close();
+	}
+}
+
+void ReactorThreadPool::SetPolicy(DispatchPolicy_e policy)
+{
+	_policy = policy;
+	_dispatcher = nullptr;
+}
+
+void ReactorThreadPool::SetDispatcher(DispatchFunc func)
+{
+	_dispatcher = func;
+}
+
+bool ReactorThreadPool::SetAffinity(const std::vector<int>& cpus)
+{
+	if (cpus.empty()) {
+		return false;
+	}
+	for (size_t i = 0; i < _threads.size(); i++) {
+		if (!_threads[i]->SetAffinity({ cpus[i % cpus.size()] })) {
+			return false;
+		}
+	}
+	return true;
+}
+
+SpReactor ReactorThreadPool::Select(const sockaddr_in& peer)
+{
+	size_t n = _reactors.size();
+	if (n == 1) {
+		return _reactors[0];
+	}
+	size_t index = 0;
+	if (_dispatcher) {
+		index = _dispatcher(_reactors, peer);
+	}
+	else {
+		switch (_policy)
+		{
+		case DispatchPolicy_e::LEAST_CHANNELS:
+			index = leastChannels();
+			break;
+		case DispatchPolicy_e::ADDR_HASH:
+			index = addrHash(peer, n);
+			break;
+		case DispatchPolicy_e::ROUND_ROBIN:
+		default:
+			index = roundRobin();
+			break;
+		}
+	}
+	return _reactors[index % n];
+}
+
+// Every reactor gets its own SO_REUSEPORT listener and accepts on it locally,
+// the listener's private data is the owning reactor.
+bool ReactorThreadPool::ListenReusePort(int port, CallBackFunc connect, int backlog, const std::vector<int>& steeringCpus,
+	bool edgeTriggered)
+{
+	if (!steeringCpus.empty() && steeringCpus.size() != _reactors.size()) {
+		minilog(LogLevel_e::ERROR, "[%s] cpu steering needs the cpu of each of the %d reactors, %d given", _name.c_str(),
+			static_cast<int>(_reactors.size()), static_cast<int>(steeringCpus.size()));
+		return false;
+	}
+	std::vector<SpChannel> listeners;
+	for (auto& re : _reactors) {
+		auto chan = CreateSpChannelListen(port, re, connect, nullptr, backlog, true);
+		if (!chan) {
+			return false;
+		}
+		chan->SetEdgeTriggered(edgeTriggered);
+		listeners.emplace_back(chan);
+	}
+	if (!steeringCpus.empty() && !AttachReusePortCpuSteering(listeners[0]->GetSocket(), steeringCpus)) {
+		return false;
+	}
+	for (size_t i = 0; i < listeners.size(); i++) {
+		_reactors[i]->AddChannel(listeners[i], ChannelEvent_e::IN);
+	}
+	minilog(LogLevel_e::INFO, "[%s] %d reuseport listeners on port %d, backlog %d, cpu steering %s",
+		_name.c_str(), static_cast<int>(listeners.size()), port, backlog, steeringCpus.empty() ? "off" : "on");
+	return true;
+}
+
+size_t ReactorThreadPool::roundRobin()
+{
+	return _next.fetch_add(1, std::memory_order_relaxed) % _reactors.size();
+}
+
+size_t ReactorThreadPool::leastChannels() const
+{
+	size_t best = 0;
+	size_t bestNum = _reactors[0]->GetChannelNum();
+	for (size_t i = 1; i < _reactors.size(); i++) {
+		size_t num = _reactors[i]->GetChannelNum();
+		if (num < bestNum) {
+			best = i;
+			bestNum = num;
+		}
+	}
+	return best;
+}
+
+size_t ReactorThreadPool::addrHash(const sockaddr_in& peer, size_t n)
+{
+	// fibonacci hashing of the ipv4 address, the port is left out on purpose
+	uint32_t h = ntohl(peer.sin_addr.s_addr) * 2654435761u;
+	return (h >> 16) % n;
+}
+
+/*--------------- shared_ptr -----------*/
+using SpReactorThreadPool = std::shared_ptr<ReactorThreadPool>;
+SpReactorThreadPool CreateSpReactorThreadPool(const std::string& name, size_t threadNum = 0,
+	PollerBackend_e backend = PollerBackend_e::EPOLL)
+{
+	return std::make_shared<ReactorThreadPool>(name, threadNum, backend);
+}
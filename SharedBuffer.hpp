@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <memory>
+#include "utils.h"
+
+/*
+ * Immutable bytes that any number of buffers may hold at once, e.g. one message broadcast
+ * to many channels: Buffer::AppendShared links it into each send buffer as a block of its
+ * own, so the payload is never copied per channel and goes out with the rest in one
+ * sendmsg. The count is atomic, channels on several reactors may send the same one; it
+ * is freed with its last holder, on whichever thread that is.
+ */
+class SharedBuffer : noncopyable
+{
+public:
+	explicit SharedBuffer(std::string data) : _data(std::move(data)) {}
+	const char* Data() const { return _data.data(); }
+	size_t Size() const { return _data.size(); }
+private:
+	const std::string _data;
+};
+
+/*--------------- shared_ptr -----------*/
+using SpSharedBuffer = std::shared_ptr<const SharedBuffer>;
+SpSharedBuffer CreateSpSharedBuffer(std::string data)
+{
+	return std::make_shared<const SharedBuffer>(std::move(data));
+}
+SpSharedBuffer CreateSpSharedBuffer(const char* data, size_t len)
+{
+	return CreateSpSharedBuffer(std::string(data, len));
+}
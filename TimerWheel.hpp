@@ -0,0 +1,317 @@
+#pragma once
+#include <functional>
+#include <vector>
+#include <stdint.h>
+#include "utils.h"
+
+using TimerId = uint64_t;
+using TimerCallback = std::function<void(void)>;
+static const TimerId kInvalidTimerId = 0;
+
+/*
+ * Hierarchical timing wheel with 1ms ticks, in the style of the classic kernel timers:
+ *
+ *   root    256 slots    delta < 256ms
+ *   level1   64 slots    delta < 16s
+ *   level2   64 slots    delta < 17min
+ *   level3   64 slots    delta < 18.6h (anything later is parked in the last slot and re-cascaded)
+ *
+ * Timers live in one vector of nodes linked by index, so insert, cancel and restart are
+ * O(1) and a live timer costs no allocation of its own. A TimerId carries the node index
+ * and a generation, so a stale id never cancels the node's next owner.
+ * Not thread safe, it belongs to one reactor.
+ */
+class TimerWheel : noncopyable
+{
+public:
+	explicit TimerWheel(uint64_t nowMs);
+	TimerId Add(uint64_t expireMs, uint64_t intervalMs, TimerCallback cb);
+	bool Cancel(TimerId id);
+	bool Restart(TimerId id, uint64_t expireMs);
+	bool IsActive(TimerId id) const;
+	void Advance(uint64_t nowMs);
+	// ms until the next tick that has to be processed, capped at maxMs
+	int NextTimeout(uint64_t nowMs, int maxMs) const;
+	size_t Size() const { return _count; }
+private:
+	static const int kRootBits = 8;
+	static const int kLevelBits = 6;
+	static const uint32_t kRootSize = 1u << kRootBits;
+	static const uint32_t kLevelSize = 1u << kLevelBits;
+	static const int kLevels = 3;
+	static const uint32_t kListNum = kRootSize + kLevels * kLevelSize;
+	static const uint32_t kNil = 0xffffffffu;
+	static const uint32_t kDueList = kListNum;		// the slot being processed is moved here
+	static const uint32_t kFiring = kListNum + 1;	// node.list while its callback runs
+	static const uint32_t kFree = kListNum + 2;
+	static const uint64_t kMaxDelta = (1ull << (kRootBits + kLevels * kLevelBits)) - 1;
+
+	struct Node
+	{
+		uint32_t prev;
+		uint32_t next;
+		uint32_t list;
+		uint32_t gen;
+		uint64_t expire;
+		uint64_t interval;
+		TimerCallback cb;
+	};
+
+	uint32_t lookup(TimerId id) const;
+	uint32_t allocNode();
+	void freeNode(uint32_t idx);
+	void link(uint32_t idx);
+	void unlink(uint32_t idx);
+	uint32_t cascade(int level, uint32_t slot);
+	void fire(uint32_t idx);
+private:
+	std::vector<Node> _nodes;
+	uint32_t _freeHead;
+	uint32_t _lists[kListNum + 1];
+	uint64_t _rootBits[kRootSize / 64];		// non-empty root slots
+	uint64_t _current;						// next tick to process
+	size_t _count;
+};
+
+TimerWheel::TimerWheel(uint64_t nowMs) :
+	_freeHead(kNil),
+	_current(nowMs),
+	_count(0)
+{
+	for (uint32_t i = 0; i <= kListNum; i++) {
+		_lists[i] = kNil;
+	}
+	for (uint32_t i = 0; i < kRootSize / 64; i++) {
+		_rootBits[i] = 0;
+	}
+}
+
+uint32_t TimerWheel::lookup(TimerId id) const
+{
+	uint32_t idx = static_cast<uint32_t>(id);
+	uint32_t gen = static_cast<uint32_t>(id >> 32);
+	if (idx >= _nodes.size() || _nodes[idx].gen != gen || _nodes[idx].list == kFree) {
+		return kNil;
+	}
+	return idx;
+}
+
+uint32_t TimerWheel::allocNode()
+{
+	uint32_t idx;
+	if (_freeHead != kNil) {
+		idx = _freeHead;
+		_freeHead = _nodes[idx].next;
+	}
+	else {
+		idx = static_cast<uint32_t>(_nodes.size());
+		_nodes.emplace_back();
+		_nodes[idx].gen = 1;
+	}
+	_count++;
+	return idx;
+}
+
+void TimerWheel::freeNode(uint32_t idx)
+{
+	Node& node = _nodes[idx];
+	node.cb = nullptr;
+	node.list = kFree;
+	if (++node.gen == 0) {
+		node.gen = 1;
+	}
+	node.next = _freeHead;
+	_freeHead = idx;
+	_count--;
+}
+
+void TimerWheel::link(uint32_t idx)
+{
+	Node& node = _nodes[idx];
+	uint64_t expire = std::max(node.expire, _current);
+	uint64_t delta = expire - _current;
+	uint32_t list;
+	if (delta < kRootSize) {
+		list = expire & (kRootSize - 1);
+		_rootBits[list / 64] |= 1ull << (list % 64);
+	}
+	else {
+		if (delta > kMaxDelta) {
+			expire = _current + kMaxDelta;
+			delta = kMaxDelta;
+		}
+		int level = 1;
+		while (delta >= (1ull << (kRootBits + level * kLevelBits))) {
+			level++;
+		}
+		uint32_t slot = (expire >> (kRootBits + (level - 1) * kLevelBits)) & (kLevelSize - 1);
+		list = kRootSize + (level - 1) * kLevelSize + slot;
+	}
+	node.list = list;
+	node.prev = kNil;
+	node.next = _lists[list];
+	if (node.next != kNil) {
+		_nodes[node.next].prev = idx;
+	}
+	_lists[list] = idx;
+}
+
+void TimerWheel::unlink(uint32_t idx)
+{
+	Node& node = _nodes[idx];
+	if (node.prev != kNil) {
+		_nodes[node.prev].next = node.next;
+	}
+	else {
+		_lists[node.list] = node.next;
+		if (node.next == kNil && node.list < kRootSize) {
+			_rootBits[node.list / 64] &= ~(1ull << (node.list % 64));
+		}
+	}
+	if (node.next != kNil) {
+		_nodes[node.next].prev = node.prev;
+	}
+	node.prev = node.next = kNil;
+}
+
+TimerId TimerWheel::Add(uint64_t expireMs, uint64_t intervalMs, TimerCallback cb)
+{
+	uint32_t idx = allocNode();
+	Node& node = _nodes[idx];
+	node.expire = expireMs;
+	node.interval = intervalMs;
+	node.cb = std::move(cb);
+	link(idx);
+	return (static_cast<uint64_t>(node.gen) << 32) | idx;
+}
+
+bool TimerWheel::Cancel(TimerId id)
+{
+	uint32_t idx = lookup(id);
+	if (idx == kNil) {
+		return false;
+	}
+	if (_nodes[idx].list == kFiring) {
+		// freed by fire() once the callback returns
+		_nodes[idx].interval = 0;
+		_nodes[idx].expire = 0;
+		return true;
+	}
+	unlink(idx);
+	freeNode(idx);
+	return true;
+}
+
+bool TimerWheel::Restart(TimerId id, uint64_t expireMs)
+{
+	uint32_t idx = lookup(id);
+	if (idx == kNil) {
+		return false;
+	}
+	if (_nodes[idx].list != kFiring) {
+		unlink(idx);
+	}
+	_nodes[idx].expire = expireMs;
+	link(idx);
+	return true;
+}
+
+bool TimerWheel::IsActive(TimerId id) const
+{
+	return lookup(id) != kNil;
+}
+
+uint32_t TimerWheel::cascade(int level, uint32_t slot)
+{
+	uint32_t list = kRootSize + (level - 1) * kLevelSize + slot;
+	uint32_t idx = _lists[list];
+	_lists[list] = kNil;
+	while (idx != kNil) {
+		uint32_t next = _nodes[idx].next;
+		link(idx);
+		idx = next;
+	}
+	return slot;
+}
+
+void TimerWheel::fire(uint32_t idx)
+{
+	// the callback may add timers and grow _nodes, so it must not run from inside the vector
+	TimerCallback cb = std::move(_nodes[idx].cb);
+	_nodes[idx].list = kFiring;
+	cb();
+	Node& node = _nodes[idx];
+	if (node.list != kFiring) {
+		// restarted by the callback
+		node.cb = std::move(cb);
+	}
+	else if (node.interval > 0) {
+		node.expire = std::max(node.expire + node.interval, _current);
+		node.cb = std::move(cb);
+		link(idx);
+	}
+	else {
+		freeNode(idx);
+	}
+}
+
+void TimerWheel::Advance(uint64_t nowMs)
+{
+	while (_current <= nowMs) {
+		if (_count == 0) {
+			// nothing is linked, so skipping ticks and cascades is safe
+			_current = nowMs + 1;
+			return;
+		}
+		uint32_t index = _current & (kRootSize - 1);
+		// callbacks may cancel or restart timers that are due in the same tick,
+		// so the slot is moved to a list of its own and popped one node at a time
+		uint32_t idx = _lists[index];
+		_lists[index] = kNil;
+		_rootBits[index / 64] &= ~(1ull << (index % 64));
+		_lists[kDueList] = idx;
+		for (; idx != kNil; idx = _nodes[idx].next) {
+			_nodes[idx].list = kDueList;
+		}
+		_current++;
+		if ((_current & (kRootSize - 1)) == 0) {
+			// cascade eagerly so that NextTimeout only has to look at the root
+			for (int level = 1; level <= kLevels; level++) {
+				uint32_t slot = (_current >> (kRootBits + (level - 1) * kLevelBits)) & (kLevelSize - 1);
+				if (cascade(level, slot) != 0) {
+					break;
+				}
+			}
+		}
+		while (_lists[kDueList] != kNil) {
+			idx = _lists[kDueList];
+			unlink(idx);
+			fire(idx);
+		}
+	}
+}
+
+int TimerWheel::NextTimeout(uint64_t nowMs, int maxMs) const
+{
+	if (_count == 0) {
+		return maxMs;
+	}
+	if (_current <= nowMs) {
+		return 0;
+	}
+	// first non-empty root slot before the next cascade, or the cascade itself
+	uint64_t due = (_current | (kRootSize - 1)) + 1;
+	uint32_t start = _current & (kRootSize - 1);
+	for (uint32_t word = start / 64; word < kRootSize / 64; word++) {
+		uint64_t bits = _rootBits[word];
+		if (word == start / 64) {
+			bits &= ~0ull << (start % 64);
+		}
+		if (bits) {
+			due = (_current & ~static_cast<uint64_t>(kRootSize - 1)) + word * 64 + __builtin_ctzll(bits);
+			break;
+		}
+	}
+	uint64_t timeout = due - nowMs;
+	return timeout > static_cast<uint64_t>(maxMs) ? maxMs : static_cast<int>(timeout);
+}
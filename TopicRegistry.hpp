@@ -0,0 +1,235 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "Reactor.hpp"
+#include "SharedBuffer.hpp"
+
+struct TopicStats
+{
+	uint64_t published;		// Publish calls that had subscribers
+	uint64_t tasks;			// fan-out tasks posted, one per reactor per message
+	uint64_t delivered;		// messages queued on a subscriber
+	uint64_t dropped;		// skipped for a subscriber over the queue limit
+};
+
+/*
+ * Topics and their subscribed channels, spread over any number of reactors. Publish
+ * posts one task per reactor with subscribers to the topic, not one per channel, and
+ * that task queues the same SharedBuffer on each of its channels (Channel::Send), so a
+ * broadcast costs one copy of the payload plus a block header per subscriber.
+ *
+ * The subscribers of a topic on one reactor are only touched by that reactor's thread;
+ * the registry's lock covers the topic table only and is held by Publish just long enough
+ * to copy the list of reactors. A channel leaves on Unsubscribe, or on the next message
+ * once it was deleted from its poller. A reactor left without subscribers to a topic is
+ * dropped from it, and a topic left without reactors from the table, so that Publish to
+ * it costs nothing and returns 0 again.
+ *
+ * With maxQueued set, a subscriber whose send buffer already holds more than that misses
+ * messages (counted as dropped) instead of growing without bound. Thread safe.
+ */
+class TopicRegistry : public std::enable_shared_from_this<TopicRegistry>, noncopyable
+{
+public:
+	explicit TopicRegistry(size_t maxQueued = 0);
+	// chan must belong to re
+	void Subscribe(const std::string& topic, const SpReactor& re, const SpChannel& chan);
+	void Unsubscribe(const std::string& topic, const SpReactor& re, const SpChannel& chan);
+	// the number of reactors the message went to, 0 when the topic has no subscribers
+	size_t Publish(const std::string& topic, const SpSharedBuffer& msg);
+	size_t Publish(const std::string& topic, std::string msg) { return Publish(topic, CreateSpSharedBuffer(std::move(msg))); }
+	TopicStats GetStats() const;
+private:
+	// one topic's subscribers on one reactor
+	struct Shard
+	{
+		std::string topic;
+		SpReactor reactor;
+		// reactor thread only
+		std::vector<std::weak_ptr<Channel>> channels;
+		bool removed = false;			// out of the table, a late Subscribe finds a new one
+	};
+	using SpShard = std::shared_ptr<Shard>;
+	using ShardList = std::vector<SpShard>;
+	SpShard findShard(const std::string& topic, const SpReactor& re, bool create);
+	void fanOut(Shard& shard, const SpSharedBuffer& msg);
+	void dropShard(Shard& shard);
+private:
+	size_t _maxQueued;
+	mutable std::mutex _mutex;
+	// replaced, never changed in place, so that Publish can take a copy and let go of the lock
+	std::unordered_map<std::string, std::shared_ptr<const ShardList>> _topics;	// guarded by _mutex
+	std::atomic<uint64_t> _published;
+	std::atomic<uint64_t> _tasks;
+	std::atomic<uint64_t> _delivered;
+	std::atomic<uint64_t> _dropped;
+};
+
+TopicRegistry::TopicRegistry(size_t maxQueued) :
+	_maxQueued(maxQueued),
+	_published(0),
+	_tasks(0),
+	_delivered(0),
+	_dropped(0)
+{
+}
+
+TopicRegistry::SpShard TopicRegistry::findShard(const std::string& topic, const SpReactor& re, bool create)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	auto it = _topics.find(topic);
+	if (it != _topics.end()) {
+		for (auto& shard : *it->second) {
+			if (shard->reactor == re) {
+				return shard;
+			}
+		}
+	}
+	if (!create) {
+		return nullptr;
+	}
+	std::shared_ptr<const ShardList>& list = _topics[topic];
+	auto shard = std::make_shared<Shard>();
+	shard->topic = topic;
+	shard->reactor = re;
+	auto grown = list ? std::make_shared<ShardList>(*list) : std::make_shared<ShardList>();
+	grown->push_back(shard);
+	list = grown;
+	return shard;
+}
+
+void TopicRegistry::Subscribe(const std::string& topic, const SpReactor& re, const SpChannel& chan)
+{
+	SpShard shard = findShard(topic, re, true);
+	std::weak_ptr<Channel> weak = chan;
+	auto self = shared_from_this();
+	re->PushFunctor([self, shard, weak]() {
+		// emptied and dropped since findShard
+		SpShard target = shard->removed ? self->findShard(shard->topic, shard->reactor, true) : shard;
+		target->channels.push_back(weak);
+	});
+}
+
+void TopicRegistry::Unsubscribe(const std::string& topic, const SpReactor& re, const SpChannel& chan)
+{
+	Channel* raw = chan.get();
+	auto self = shared_from_this();
+	SpReactor target = re;
+	// looked up on the reactor, where its shards are dropped and made again: one found
+	// here could be dropped by then, and an earlier Subscribe gone into its successor
+	re->PushFunctor([self, topic, target, raw]() {
+		SpShard shard = self->findShard(topic, target, false);
+		if (!shard) {
+			return;
+		}
+		// the expired ones go as well
+		auto& channels = shard->channels;
+		for (size_t i = 0; i < channels.size();) {
+			SpChannel chan = channels[i].lock();
+			if (chan && chan.get() != raw) {
+				i++;
+				continue;
+			}
+			channels[i] = std::move(channels.back());
+			channels.pop_back();
+		}
+		if (channels.empty()) {
+			self->dropShard(*shard);
+		}
+	});
+}
+
+size_t TopicRegistry::Publish(const std::string& topic, const SpSharedBuffer& msg)
+{
+	std::shared_ptr<const ShardList> list;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto it = _topics.find(topic);
+		if (it == _topics.end()) {
+			return 0;
+		}
+		list = it->second;
+	}
+	auto self = shared_from_this();
+	for (auto& shard : *list) {
+		SpShard target = shard;
+		shard->reactor->PushFunctor([self, target, msg]() { self->fanOut(*target, msg); });
+	}
+	_published.fetch_add(1, std::memory_order_relaxed);
+	_tasks.fetch_add(list->size(), std::memory_order_relaxed);
+	return list->size();
+}
+
+// on the shard's reactor: the same message into every subscriber's send buffer
+void TopicRegistry::fanOut(Shard& shard, const SpSharedBuffer& msg)
+{
+	auto& channels = shard.channels;
+	uint64_t delivered = 0;
+	uint64_t dropped = 0;
+	for (size_t i = 0; i < channels.size();) {
+		SpChannel chan = channels[i].lock();
+		if (!chan || !chan->InPoller()) {
+			channels[i] = std::move(channels.back());
+			channels.pop_back();
+			continue;
+		}
+		if (_maxQueued > 0 && chan->GetSendBuffer().ReadableBytes() > _maxQueued) {
+			dropped++;
+		}
+		else {
+			chan->Send(msg);
+			delivered++;
+		}
+		i++;
+	}
+	_delivered.fetch_add(delivered, std::memory_order_relaxed);
+	_dropped.fetch_add(dropped, std::memory_order_relaxed);
+	if (channels.empty()) {
+		dropShard(shard);
+	}
+}
+
+// on the shard's reactor, once its last subscriber left
+void TopicRegistry::dropShard(Shard& shard)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (shard.removed) {
+		return;
+	}
+	shard.removed = true;
+	auto it = _topics.find(shard.topic);
+	if (it == _topics.end()) {
+		return;
+	}
+	auto shrunk = std::make_shared<ShardList>();
+	for (auto& other : *it->second) {
+		if (other.get() != &shard) {
+			shrunk->push_back(other);
+		}
+	}
+	if (shrunk->empty()) {
+		_topics.erase(it);
+	}
+	else {
+		it->second = shrunk;
+	}
+}
+
+TopicStats TopicRegistry::GetStats() const
+{
+	TopicStats stats;
+	stats.published = _published.load(std::memory_order_relaxed);
+	stats.tasks = _tasks.load(std::memory_order_relaxed);
+	stats.delivered = _delivered.load(std::memory_order_relaxed);
+	stats.dropped = _dropped.load(std::memory_order_relaxed);
+	return stats;
+}
+
+/*--------------- shared_ptr -----------*/
+using SpTopicRegistry = std::shared_ptr<TopicRegistry>;
+SpTopicRegistry CreateSpTopicRegistry(size_t maxQueued = 0)
+{
+	return std::make_shared<TopicRegistry>(maxQueued);
+}
@@ -1,11 +1,21 @@
 #pragma once
 #include <memory>
+#include <thread>
 
 class WorkerInterface
 {
 public:
-	virtual bool Work() = 0;
+	virtual ~WorkerInterface() {}
+	// one bounded iteration, blocking for at most timeoutMs (-1: until woken up).
+	// Returning false removes the worker from its thread.
+	virtual bool Work(int timeoutMs) = 0;
 	virtual void SetThreadId(const std::thread::id&) = 0;
+	// readable whenever the worker has something to do, -1 makes the thread poll it
+	virtual int GetWaitFd() { return -1; }
+	// ms until the worker has to run even if its fd stays quiet, -1 for no deadline
+	virtual int GetNextTimeout() { return -1; }
+	// makes a blocking Work return early, may be called from any thread
+	virtual void Wakeup() {}
 };
 
-using SpWorker = std::shared_ptr<WorkerInterface>;
\ No newline at end of file
+using SpWorker = std::shared_ptr<WorkerInterface>;
@@ -0,0 +1,85 @@
+// Decoding frames that arrive a few bytes per read: the connection's DecodeState carried
+// between reads against a fresh one per read (every Decode searching from the front),
+// and the checks that go with it: frames come out whole and in order with the delimiter
+// split over two reads, and a payload too long for a length field is refused, not cut.
+// Exits 1 when a check fails.
+//   ./bench/CodecBench [frame_kb] [read_bytes]
+#include <chrono>
+#include "Codec.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// frames of frameSize bytes of 'a' + k % 26 behind the codec's framing, fed chunk bytes
+// at a time; true when every frame came out as sent
+static bool feed(CodecInterface& codec, bool keepState, size_t frames, size_t frameSize, size_t chunk,
+	double* seconds)
+{
+	std::string wire;
+	for (size_t k = 0; k < frames; k++) {
+		Buffer frame;
+		std::string payload(frameSize, static_cast<char>('a' + k % 26));
+		if (!codec.Encode(frame, payload.data(), payload.size())) {
+			return false;
+		}
+		wire += frame.RetrieveAllAsString();
+	}
+	Buffer in;
+	DecodeState state;
+	size_t got = 0;
+	bool ok = true;
+	auto start = Clock::now();
+	for (size_t pos = 0; pos < wire.size() && ok; pos += chunk) {
+		in.Append(wire.data() + pos, std::min(chunk, wire.size() - pos));
+		if (!keepState) {
+			state = DecodeState();
+		}
+		int n = DispatchFrames(in, codec, state, [&](const char* data, size_t len) {
+			ok = ok && len == frameSize && std::string(data, len) == std::string(frameSize, static_cast<char>('a' + got % 26));
+			got++;
+			return true;
+		});
+		ok = ok && n >= 0;
+	}
+	*seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	return ok && got == frames && in.ReadableBytes() == 0;
+}
+
+// a payload over what the header can carry must not go out with its length cut
+static bool oversize(int headerBytes, size_t len)
+{
+	LengthFieldCodec codec(headerBytes);
+	Buffer out;
+	std::string payload(len, 'x');
+	bool refused = !codec.Encode(out, payload.data(), payload.size()) && out.ReadableBytes() == 0;
+	bool fits = codec.Encode(out, payload.data(), len - 1) && out.ReadableBytes() == static_cast<size_t>(headerBytes) + len - 1;
+	fprintf(stderr, "oversize   len%d  %zu bytes refused, %zu encoded  %s\n", headerBytes, len, len - 1,
+		refused && fits ? "ok" : "FAILED");
+	return refused && fits;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t frameSize = (argc > 1 ? static_cast<size_t>(atoi(argv[1])) : 256) * 1024;
+	size_t chunk = argc > 2 ? static_cast<size_t>(atoi(argv[2])) : 1000;
+	bool ok = true;
+
+	for (const char* spec : { "line", "crlf", "len" }) {
+		SpCodec codec = CreateSpCodec(spec);
+		for (bool keepState : { true, false }) {
+			double seconds = 0;
+			bool good = feed(*codec, keepState, 4, frameSize, chunk, &seconds);
+			ok = ok && good;
+			fprintf(stderr, "decode     %-4s %s  4 x %zu KB in %zu byte reads: %9.2f ms  %s\n", spec,
+				keepState ? "kept state " : "fresh state", frameSize / 1024, chunk, seconds * 1000, good ? "ok" : "CORRUPT");
+		}
+	}
+	// odd reads put the "\r" and the "\n" of a delimiter into different reads
+	double seconds = 0;
+	bool split = feed(*CreateSpCodec("crlf"), true, 1000, 10, 3, &seconds);
+	fprintf(stderr, "decode     crlf split delimiters  %s\n", split ? "ok" : "CORRUPT");
+	ok = ok && split;
+
+	ok = oversize(1, 256) && ok;
+	ok = oversize(2, 65536) && ok;
+	return ok ? 0 : 1;
+}
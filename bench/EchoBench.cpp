@@ -0,0 +1,148 @@
+// Echo round trips against an in-process server, epoll and io_uring side by side.
+// Every connection has its own blocking client thread doing send / recv ping-pong.
+//   ./bench/EchoBench [connections] [round_trips] [msg_size] [port]
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <netinet/tcp.h>
+#include "ReactorThread.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static double percentile(std::vector<double>& v, double p)
+{
+	size_t idx = static_cast<size_t>(p / 100.0 * (v.size() - 1));
+	std::nth_element(v.begin(), v.begin() + idx, v.end());
+	return v[idx];
+}
+
+static void onEcho(SpChannel chan)
+{
+	SpReactor re = std::static_pointer_cast<Reactor>(chan->GetSpPrivData());
+	while (true) {
+		int savedErrno = 0;
+		ssize_t n = chan->Recv(&savedErrno);
+		if (n == 0 || (n < 0 && savedErrno != EAGAIN && savedErrno != EINTR)) {
+			re->DelChannel(chan);
+			return;
+		}
+		if (n < 0 && savedErrno == EAGAIN) {
+			break;
+		}
+	}
+	chan->AppendSendBuffer(chan->GetRecvBuffer());
+	re->EnableEvents(chan, ChannelEvent_e::OUT);
+}
+
+static void onFlush(SpChannel chan)
+{
+	SpReactor re = std::static_pointer_cast<Reactor>(chan->GetSpPrivData());
+	int savedErrno = 0;
+	while (!chan->GetSendBuffer().Empty() && chan->Flush(&savedErrno) > 0) {
+	}
+	if (chan->GetSendBuffer().Empty()) {
+		re->DisableEvents(chan, ChannelEvent_e::OUT);
+	}
+}
+
+static void onAccept(SpChannel chan)
+{
+	SpReactor re = std::static_pointer_cast<Reactor>(chan->GetSpPrivData());
+	sockaddr_in peer = {};
+	int savedErrno = 0;
+	int fd;
+	while ((fd = chan->Accept(&peer, &savedErrno)) >= 0) {
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		re->AddChannel(re->CreateChannel(fd, onEcho, onFlush, nullptr), ChannelEvent_e::IN);
+	}
+}
+
+static void client(int port, int rounds, int size, std::vector<double>* us)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+		fprintf(stderr, "connect error = %s\n", strerror(errno));
+		return;
+	}
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	std::vector<char> msg(size, 'x'), reply(size);
+	us->reserve(rounds);
+	for (int i = 0; i < rounds; i++) {
+		auto start = Clock::now();
+		if (send(fd, msg.data(), size, 0) != size) {
+			break;
+		}
+		int got = 0;
+		while (got < size) {
+			ssize_t n = recv(fd, reply.data() + got, size - got, 0);
+			if (n <= 0) {
+				close(fd);
+				return;
+			}
+			got += n;
+		}
+		us->push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+	}
+	close(fd);
+}
+
+static void run(PollerBackend_e backend, int port, int conns, int rounds, int size)
+{
+	SpReactorThread server = CreateSpReactorThread("echo", backend);
+	SpReactor re = server->Reactor();
+	const char* name = re->GetBackend() == PollerBackend_e::IO_URING ? "io_uring" : "epoll";
+	if (backend != re->GetBackend()) {
+		fprintf(stderr, "%-8s unavailable\n", "io_uring");
+		return;
+	}
+	SpChannel listener = CreateSpChannelListen(port, re, onAccept, nullptr);
+	if (!listener) {
+		return;
+	}
+	server->Open();
+	re->AddChannel(listener, ChannelEvent_e::IN);
+	sleep_ms(50);
+
+	std::vector<std::vector<double>> results(conns);
+	std::vector<std::thread> threads;
+	auto start = Clock::now();
+	for (int i = 0; i < conns; i++) {
+		threads.emplace_back(client, port, rounds, size, &results[i]);
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	double sec = std::chrono::duration<double>(Clock::now() - start).count();
+	std::vector<double> all;
+	for (auto& r : results) {
+		all.insert(all.end(), r.begin(), r.end());
+	}
+	if (all.empty()) {
+		return;
+	}
+	double p50 = percentile(all, 50), p99 = percentile(all, 99);
+	fprintf(stderr, "%-8s conns %d  msg %dB  %.0f round trips/s  %.1f MB/s  p50 %.1fus  p99 %.1fus\n",
+		name, conns, size, all.size() / sec, all.size() * 2.0 * size / sec / 1e6, p50, p99);
+	re->DelChannel(listener);
+	sleep_ms(50);
+	server->Close();
+}
+
+int main(int argc, char* argv[])
+{
+	int conns = argc > 1 ? atoi(argv[1]) : 8;
+	int rounds = argc > 2 ? atoi(argv[2]) : 20000;
+	int size = argc > 3 ? atoi(argv[3]) : 64;
+	int port = argc > 4 ? atoi(argv[4]) : 12300;
+
+	run(PollerBackend_e::EPOLL, port, conns, rounds, size);
+	run(PollerBackend_e::IO_URING, port + 1, conns, rounds, size);
+	return 0;
+}
@@ -0,0 +1,334 @@
+// Broadcasting one message to many loopback subscribers: a copy per subscriber
+// (Channel::Send(data, len)) against one SharedBuffer queued on all of them through
+// TopicRegistry. Both post one task per reactor per message.
+//  - backlog: the subscribers don't read, what the server holds for them is measured as
+//    RSS growth, then every subscriber checks that it got all messages in order;
+//  - flow: the subscribers read as fast as they can, messages delivered per second and
+//    the server's CPU per delivery;
+//  - churn: threads subscribing and unsubscribing at once, checked to leave every
+//    topic with exactly the subscribers it should have (exits 1 when not).
+//   ./bench/FanoutBench [subscribers] [reactors] [port] [epoll|uring]
+#include <chrono>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <map>
+#include <poll.h>
+#include <sys/resource.h>
+#include "ReactorThreadPool.hpp"
+#include "TopicRegistry.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static const std::string kTopic = "bench";
+static const int kSmallSocketBuffer = 4096;		// keeps the backlog in user space, not in the kernel
+static SpTopicRegistry registry;
+static std::mutex channelsMutex;
+static std::map<Reactor*, std::vector<SpChannel>> channels;	// per reactor, for the copying mode
+static std::atomic<size_t> subscribed(0);
+
+class Subscriber : public ChannelHandler<Subscriber>
+{
+public:
+	explicit Subscriber(Reactor* re) : _reactor(re) {}
+	void OnRead(Channel& chan)
+	{
+		while (true) {
+			int savedErrno = 0;
+			ssize_t n = chan.Recv(&savedErrno);
+			if (n > 0 || (n < 0 && savedErrno == EINTR)) {
+				chan.GetRecvBuffer().RetrieveAll();
+				continue;
+			}
+			if (n < 0 && savedErrno == EAGAIN) {
+				return;
+			}
+			_reactor->DelChannel(chan.shared_from_this());
+			return;
+		}
+	}
+	void OnSend(Channel& chan)
+	{
+		while (chan.HasOutput()) {
+			int savedErrno = 0;
+			ssize_t n = chan.Flush(&savedErrno);
+			if (n <= 0 && savedErrno != EINTR) {
+				break;
+			}
+		}
+		if (!chan.HasOutput()) {
+			_reactor->DisableEvents(chan.shared_from_this(), ChannelEvent_e::OUT);
+		}
+	}
+private:
+	Reactor* _reactor;
+};
+
+static void onAccept(SpChannel listener)
+{
+	SpReactorThreadPool pool = std::static_pointer_cast<ReactorThreadPool>(listener->GetSpPrivData());
+	sockaddr_in peer = {};
+	int savedErrno = 0;
+	int fd;
+	while ((fd = listener->Accept(&peer, &savedErrno)) >= 0) {
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &kSmallSocketBuffer, sizeof(kSmallSocketBuffer));
+		SpReactor re = pool->Select(peer);
+		SpChannel chan = re->CreateChannel(fd, nullptr, nullptr, nullptr);
+		chan->SetHandler(std::make_shared<Subscriber>(re.get()));
+		re->AddChannel(chan, ChannelEvent_e::IN);
+		registry->Subscribe(kTopic, re, chan);
+		{
+			std::lock_guard<std::mutex> lock(channelsMutex);
+			channels[re.get()].push_back(chan);
+		}
+		subscribed++;
+	}
+}
+
+// returns once everything posted to the reactors so far has run
+static void sync_reactors(const SpReactorThreadPool& pool)
+{
+	for (auto& re : pool->Reactors()) {
+		std::promise<void> done;
+		re->PushFunctor([&done]() { done.set_value(); });
+		done.get_future().wait();
+	}
+}
+
+static void publish(bool shared, const SpReactorThreadPool& pool, const std::string& payload)
+{
+	SpSharedBuffer msg = CreateSpSharedBuffer(payload);
+	if (shared) {
+		registry->Publish(kTopic, msg);
+		return;
+	}
+	for (auto& re : pool->Reactors()) {
+		Reactor* raw = re.get();
+		re->PushFunctor([raw, msg]() {
+			for (auto& chan : channels[raw]) {
+				chan->Send(msg->Data(), msg->Size());
+			}
+		});
+	}
+}
+
+static double cpu_seconds(int who)
+{
+	rusage usage;
+	getrusage(who, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static size_t rss_kb()
+{
+	FILE* fp = fopen("/proc/self/status", "r");
+	char line[256];
+	size_t kb = 0;
+	while (fp && fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "VmRSS: %zu kB", &kb) == 1) {
+			break;
+		}
+	}
+	if (fp) {
+		fclose(fp);
+	}
+	return kb;
+}
+
+// message k is msgSize times 'a' + k % 26, so a subscriber can check order and length
+static std::string make_message(size_t k, size_t msgSize)
+{
+	return std::string(msgSize, static_cast<char>('a' + k % 26));
+}
+
+static bool drain_and_check(const std::vector<int>& clients, size_t messages, size_t msgSize)
+{
+	std::vector<char> data(64 * 1024);
+	for (int fd : clients) {
+		size_t got = 0;
+		while (got < messages * msgSize) {
+			ssize_t n = recv(fd, data.data(), std::min(data.size(), messages * msgSize - got), 0);
+			if (n <= 0) {
+				return false;
+			}
+			for (ssize_t i = 0; i < n; i++) {
+				if (data[i] != static_cast<char>('a' + (got + i) / msgSize % 26)) {
+					return false;
+				}
+			}
+			got += n;
+		}
+	}
+	return true;
+}
+
+static void backlog(bool shared, const SpReactorThreadPool& pool, const std::vector<int>& clients,
+	size_t messages, size_t msgSize)
+{
+	size_t before = rss_kb();
+	for (size_t k = 0; k < messages; k++) {
+		publish(shared, pool, make_message(k, msgSize));
+	}
+	sync_reactors(pool);
+	size_t held = rss_kb() - before;
+	bool ok = drain_and_check(clients, messages, msgSize);
+	fprintf(stderr, "backlog %-6s %zu x %zu KB to %zu: server grew %8.1f MB (%.0f bytes per subscriber message)  %s\n",
+		shared ? "shared" : "copy", messages, msgSize / 1024, clients.size(), held / 1024.0,
+		held * 1024.0 / (messages * clients.size()), ok ? "ok" : "CORRUPT");
+}
+
+// readers discard everything; the publisher keeps at most window messages unread
+static void flow(bool shared, const SpReactorThreadPool& pool, const std::vector<int>& clients,
+	size_t messages, size_t msgSize)
+{
+	static const size_t kWindow = 64;
+	std::atomic<size_t> received(0);
+	std::atomic<bool> stop(false);
+	double readerCpu = 0;
+	std::thread reader([&]() {
+		std::vector<pollfd> fds;
+		for (int fd : clients) {
+			fds.push_back(pollfd{ fd, POLLIN, 0 });
+		}
+		std::vector<char> data(64 * 1024);
+		while (!stop) {
+			if (poll(fds.data(), fds.size(), 10) <= 0) {
+				continue;
+			}
+			for (auto& p : fds) {
+				if (p.revents & POLLIN) {
+					ssize_t n = recv(p.fd, data.data(), data.size(), MSG_DONTWAIT);
+					if (n > 0) {
+						received += n;
+					}
+				}
+			}
+		}
+		readerCpu = cpu_seconds(RUSAGE_THREAD);
+	});
+	size_t total = messages * msgSize * clients.size();
+	// the reactors' share: the process minus this (publishing) thread and the reader
+	double cpu = cpu_seconds(RUSAGE_SELF) - cpu_seconds(RUSAGE_THREAD);
+	auto start = Clock::now();
+	for (size_t k = 0; k < messages; k++) {
+		while ((k - std::min(k, kWindow)) * msgSize * clients.size() > received) {
+			std::this_thread::yield();
+		}
+		publish(shared, pool, make_message(k, msgSize));
+	}
+	while (received < total) {
+		std::this_thread::yield();
+	}
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	stop = true;
+	reader.join();
+	cpu = cpu_seconds(RUSAGE_SELF) - cpu_seconds(RUSAGE_THREAD) - readerCpu - cpu;
+	fprintf(stderr, "flow    %-6s %zu x %zu B to %zu: %10.0f deliveries/s  %7.1f MB/s  server %5.0f ns/delivery\n",
+		shared ? "shared" : "copy", messages, msgSize, clients.size(), messages * clients.size() / seconds,
+		total / seconds / 1e6, cpu * 1e9 / (messages * clients.size()));
+}
+
+// Every thread works its own topics, so each one ends in a known state: subscribed, or
+// subscribed and unsubscribed again, with the shards emptied and made again on the way
+// while the registry's tasks lag behind the calls. A publisher keeps fanning out to them.
+static bool churn(const SpReactorThreadPool& pool)
+{
+	static const size_t kThreads = 4;
+	static const size_t kTopics = 500;
+	std::vector<std::pair<SpReactor, SpChannel>> subs;
+	for (auto& re : pool->Reactors()) {
+		std::lock_guard<std::mutex> lock(channelsMutex);
+		for (auto& chan : channels[re.get()]) {
+			subs.emplace_back(re, chan);
+		}
+	}
+	auto topic = [](size_t t, size_t k) { return "churn_" + std::to_string(t) + "_" + std::to_string(k); };
+	std::atomic<bool> stop(false);
+	std::thread publisher([&]() {
+		SpSharedBuffer msg = CreateSpSharedBuffer(std::string("c"));
+		for (size_t i = 0; !stop; i++) {
+			registry->Publish(topic(i % kThreads, i / kThreads % kTopics), msg);
+		}
+	});
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < kThreads; t++) {
+		threads.emplace_back([&, t]() {
+			for (size_t k = 0; k < kTopics; k++) {
+				auto& sub = subs[(t * kTopics + k) % subs.size()];
+				registry->Subscribe(topic(t, k), sub.first, sub.second);
+				registry->Unsubscribe(topic(t, k), sub.first, sub.second);
+				registry->Subscribe(topic(t, k), sub.first, sub.second);
+				if (k % 2) {
+					registry->Unsubscribe(topic(t, k), sub.first, sub.second);
+				}
+			}
+		});
+	}
+	for (auto& thrd : threads) {
+		thrd.join();
+	}
+	stop = true;
+	publisher.join();
+	sync_reactors(pool);
+	size_t wrong = 0;
+	for (size_t t = 0; t < kThreads; t++) {
+		for (size_t k = 0; k < kTopics; k++) {
+			wrong += registry->Publish(topic(t, k), std::string("c")) != (k % 2 ? 0u : 1u);
+		}
+	}
+	fprintf(stderr, "churn   %zu threads x %zu topics: %zu left with the wrong subscribers  %s\n", kThreads, kTopics,
+		wrong, wrong ? "BROKEN" : "ok");
+	return wrong == 0;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t subscribers = argc > 1 ? static_cast<size_t>(atoi(argv[1])) : 1000;
+	size_t reactors = argc > 2 ? static_cast<size_t>(atoi(argv[2])) : 2;
+	int port = argc > 3 ? atoi(argv[3]) : 13500;
+	PollerBackend_e backend = argc > 4 && strcmp(argv[4], "uring") == 0 ? PollerBackend_e::IO_URING : PollerBackend_e::EPOLL;
+	Logger::SetLevel(LogLevel_e::WARRNIG);
+
+	registry = CreateSpTopicRegistry();
+	SpReactorThreadPool pool = CreateSpReactorThreadPool("fanout", reactors, backend);
+	pool->Open();
+	SpReactorThread acceptor = CreateSpReactorThread("acceptor", backend);
+	acceptor->Open();
+	SpChannel listener = CreateSpChannelListen(port, pool, onAccept, nullptr);
+	if (!listener) {
+		return 1;
+	}
+	acceptor->Reactor()->AddChannel(listener, ChannelEvent_e::IN);
+
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	std::vector<int> clients;
+	for (size_t i = 0; i < subscribers; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &kSmallSocketBuffer, sizeof(kSmallSocketBuffer));
+		if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+			fprintf(stderr, "connect: %s\n", strerror(errno));
+			return 1;
+		}
+		clients.push_back(fd);
+	}
+	while (subscribed < subscribers) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	sync_reactors(pool);
+
+	// shared first: the pools keep what the copies freed, RSS would not show the second run
+	backlog(true, pool, clients, 8, 16 * 1024);
+	backlog(false, pool, clients, 8, 16 * 1024);
+	flow(true, pool, clients, 2000, 1024);
+	flow(false, pool, clients, 2000, 1024);
+	// last, what it publishes is left unread
+	bool ok = churn(pool);
+	TopicStats stats = registry->GetStats();
+	fprintf(stderr, "registry: %llu published, %llu tasks, %llu delivered\n",
+		static_cast<unsigned long long>(stats.published), static_cast<unsigned long long>(stats.tasks),
+		static_cast<unsigned long long>(stats.delivered));
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,364 @@
+// Serving a file to one loopback client: read + Send against SendFile, and relaying it
+// from an upstream socket: Recv + Send against SpliceFrom. A header and a trailer go
+// around the file as buffered data, the client checks that everything arrived in order.
+//   ./bench/FileBench [size_mb] [port] [epoll|uring]
+#include <chrono>
+#include <thread>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include "ReactorThread.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+enum class Mode_e { COPY, SENDFILE, RELAY, SPLICE };
+static const char* kModeNames[] = { "read + Send", "SendFile", "Recv + Send", "SpliceFrom" };
+
+static Mode_e mode;
+static SpFileSource file;
+static int feederPort;
+static const std::string kHeader = "HEADER\n";
+static const std::string kTrailer = "TRAILER\n";
+static const size_t kChunk = 64 * 1024;
+static const size_t kHighWater = 1 << 20;
+
+static uint64_t fnv1a(uint64_t hash, const char* data, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+	}
+	return hash;
+}
+
+// the client's half of the connection, and the upstream it is fed from in the relay modes
+class Downstream : public ChannelHandler<Downstream>
+{
+public:
+	explicit Downstream(Reactor* re) : _reactor(re), _offset(0), _done(false) {}
+	void Start(Channel& chan);
+	void OnRead(Channel& chan);
+	void OnSend(Channel& chan);
+	// upstream side, relay modes
+	void OnUpstreamRead(Channel& up, Channel& chan);
+private:
+	void fill(Channel& chan);
+	void pauseUpstream(Channel& chan);
+	void close(Channel& chan);
+	Reactor* _reactor;
+	off_t _offset;			// read + Send: how far the file went into the send buffer
+	bool _done;				// the trailer is queued
+	SpChannel _upstream;
+	bool _upstreamPaused = false;
+	bool _closed = false;	// DelChannel is queued, a send event of the same poll must not touch it
+};
+
+class Upstream : public ChannelHandler<Upstream>
+{
+public:
+	Upstream(Downstream* down, std::weak_ptr<Channel> chan) : _down(down), _chan(std::move(chan)) {}
+	void OnRead(Channel& up)
+	{
+		if (SpChannel chan = _chan.lock()) {
+			_down->OnUpstreamRead(up, *chan);
+		}
+	}
+private:
+	Downstream* _down;
+	std::weak_ptr<Channel> _chan;
+};
+
+void Downstream::Start(Channel& chan)
+{
+	chan.Send(kHeader);
+	if (mode == Mode_e::SENDFILE) {
+		chan.SendFile(file, 0, file->GetSize());
+		chan.Send(kTrailer);
+		_done = true;
+		return;
+	}
+	if (mode == Mode_e::COPY) {
+		fill(chan);
+		_reactor->EnableEvents(chan.shared_from_this(), ChannelEvent_e::OUT);
+		return;
+	}
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(feederPort);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+		fprintf(stderr, "connect upstream: %s\n", strerror(errno));
+		::close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	_upstream = _reactor->CreateChannel(fd, nullptr, nullptr, nullptr);
+	_upstream->SetHandler(std::make_shared<Upstream>(this, chan.shared_from_this()));
+	_reactor->AddChannel(_upstream, ChannelEvent_e::IN);
+}
+
+void Downstream::fill(Channel& chan)
+{
+	char data[kChunk];
+	while (!_done && chan.GetSendBuffer().ReadableBytes() < kHighWater) {
+		size_t len = std::min(kChunk, file->GetSize() - static_cast<size_t>(_offset));
+		ssize_t n = len > 0 ? pread(file->GetFd(), data, len, _offset) : 0;
+		if (n > 0) {
+			chan.Send(data, static_cast<size_t>(n));
+			_offset += n;
+			continue;
+		}
+		chan.Send(kTrailer);
+		_done = true;
+	}
+}
+
+void Downstream::OnUpstreamRead(Channel& up, Channel& chan)
+{
+	bool eof = false;
+	while (!eof) {
+		int savedErrno = 0;
+		ssize_t n = 0;
+		if (mode == Mode_e::SPLICE) {
+			n = chan.SpliceFrom(up, kHighWater, &savedErrno);
+		}
+		else if (chan.GetSendBuffer().ReadableBytes() < kHighWater) {
+			n = up.Recv(&savedErrno);
+			chan.Send(up.GetRecvBuffer());
+		}
+		else {
+			savedErrno = ENOBUFS;
+			n = -1;
+		}
+		if (n > 0 || (n < 0 && savedErrno == EINTR)) {
+			continue;
+		}
+		if (n < 0 && savedErrno == ENOBUFS) {
+			pauseUpstream(chan);
+			return;
+		}
+		eof = n == 0 || savedErrno != EAGAIN;
+		if (!eof) {
+			return;
+		}
+	}
+	chan.Send(kTrailer);
+	_done = true;
+	_reactor->DelChannel(_upstream);
+	_upstream = nullptr;
+}
+
+// the client is behind: stop reading upstream until what is queued for the client went out
+void Downstream::pauseUpstream(Channel& chan)
+{
+	_upstreamPaused = true;
+	_reactor->DisableEvents(_upstream, ChannelEvent_e::IN);
+	_reactor->EnableEvents(chan.shared_from_this(), ChannelEvent_e::OUT);
+}
+
+void Downstream::OnRead(Channel& chan)
+{
+	while (true) {
+		int savedErrno = 0;
+		ssize_t n = chan.Recv(&savedErrno);
+		if (n > 0 || (n < 0 && savedErrno == EINTR)) {
+			chan.GetRecvBuffer().RetrieveAll();
+			continue;
+		}
+		if (n < 0 && savedErrno == EAGAIN) {
+			return;
+		}
+		close(chan);
+		return;
+	}
+}
+
+void Downstream::OnSend(Channel& chan)
+{
+	while (chan.HasOutput() && !_closed) {
+		int savedErrno = 0;
+		ssize_t n = chan.Flush(&savedErrno);
+		if (n > 0 || (n < 0 && savedErrno == EINTR)) {
+			continue;
+		}
+		if (n < 0 && savedErrno != EAGAIN) {
+			fprintf(stderr, "flush: %s\n", strerror(savedErrno));
+			close(chan);
+			return;
+		}
+		break;
+	}
+	if (mode == Mode_e::COPY) {
+		fill(chan);
+	}
+	if (chan.HasOutput() || _closed) {
+		return;
+	}
+	if (_upstreamPaused && _upstream) {
+		_upstreamPaused = false;
+		_reactor->EnableEvents(_upstream, ChannelEvent_e::IN);
+	}
+	_reactor->DisableEvents(chan.shared_from_this(), ChannelEvent_e::OUT);
+}
+
+void Downstream::close(Channel& chan)
+{
+	_closed = true;
+	if (_upstream) {
+		_reactor->DelChannel(_upstream);
+		_upstream = nullptr;
+	}
+	_reactor->DelChannel(chan.shared_from_this());
+}
+
+static void onAccept(SpChannel chan)
+{
+	SpReactor re = std::static_pointer_cast<Reactor>(chan->GetSpPrivData());
+	sockaddr_in peer = {};
+	int savedErrno = 0;
+	int fd;
+	while ((fd = chan->Accept(&peer, &savedErrno)) >= 0) {
+		SpChannel client = re->CreateChannel(fd, nullptr, nullptr, nullptr);
+		auto down = std::make_shared<Downstream>(re.get());
+		client->SetHandler(down);
+		re->AddChannel(client, ChannelEvent_e::IN);
+		re->PushFunctor([down, client]() { down->Start(*client); });
+	}
+}
+
+// the upstream of the relay modes: writes the whole file to every connection, blocking
+static void feed(int listenFd)
+{
+	while (true) {
+		int fd = accept(listenFd, nullptr, nullptr);
+		if (fd < 0) {
+			continue;
+		}
+		off_t offset = 0;
+		while (static_cast<size_t>(offset) < file->GetSize() &&
+			sendfile(fd, file->GetFd(), &offset, file->GetSize() - offset) > 0) {
+		}
+		::close(fd);
+	}
+}
+
+static int listen_blocking(int port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+		fprintf(stderr, "listen %d: %s\n", port, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+static double cpu_seconds(int who)
+{
+	rusage usage;
+	getrusage(who, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// reads the whole answer, false if it is not header + file + trailer; a timed run skips
+// the hash, it costs more than the transfer
+static bool fetch(int port, size_t expectLen, const uint64_t* expectHash, double* seconds)
+{
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	auto start = Clock::now();
+	if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+		fprintf(stderr, "connect: %s\n", strerror(errno));
+		::close(fd);
+		return false;
+	}
+	std::vector<char> data(1 << 20);
+	size_t got = 0;
+	uint64_t hash = 14695981039346656037ull;
+	while (got < expectLen) {
+		ssize_t n = recv(fd, data.data(), data.size(), 0);
+		if (n <= 0) {
+			break;
+		}
+		if (expectHash) {
+			hash = fnv1a(hash, data.data(), static_cast<size_t>(n));
+		}
+		got += n;
+	}
+	*seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	::close(fd);
+	return got == expectLen && (!expectHash || hash == *expectHash);
+}
+
+int main(int argc, char* argv[])
+{
+	size_t sizeMb = argc > 1 ? static_cast<size_t>(atoi(argv[1])) : 256;
+	int port = argc > 2 ? atoi(argv[2]) : 13400;
+	PollerBackend_e backend = argc > 3 && strcmp(argv[3], "uring") == 0 ? PollerBackend_e::IO_URING : PollerBackend_e::EPOLL;
+	feederPort = port + 1;
+	Logger::SetLevel(LogLevel_e::WARRNIG);
+
+	// a file of sizeMb in the page cache, unlinked once open, the fd keeps it
+	char path[] = "/tmp/filebench.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+		return 1;
+	}
+	std::vector<char> block(1 << 20);
+	uint64_t hash = fnv1a(14695981039346656037ull, kHeader.data(), kHeader.size());
+	for (size_t i = 0; i < sizeMb; i++) {
+		for (size_t j = 0; j < block.size(); j++) {
+			block[j] = static_cast<char>((i * 131 + j * 7) >> 3);
+		}
+		if (write(fd, block.data(), block.size()) != static_cast<ssize_t>(block.size())) {
+			fprintf(stderr, "write: %s\n", strerror(errno));
+			return 1;
+		}
+		hash = fnv1a(hash, block.data(), block.size());
+	}
+	hash = fnv1a(hash, kTrailer.data(), kTrailer.size());
+	::close(fd);
+	file = CreateSpFileSource(path);
+	unlink(path);
+	if (!file) {
+		return 1;
+	}
+	size_t expectLen = kHeader.size() + file->GetSize() + kTrailer.size();
+
+	std::thread(feed, listen_blocking(feederPort)).detach();
+	SpReactorThread server = CreateSpReactorThread("file_server", backend);
+	server->Open();
+	SpReactor re = server->Reactor();
+	SpChannel listener = CreateSpChannelListen(port, re, onAccept, nullptr);
+	if (!listener) {
+		return 1;
+	}
+	re->AddChannel(listener, ChannelEvent_e::IN);
+
+	fprintf(stderr, "%zu MB file, %s\n", sizeMb, re->GetBackend() == PollerBackend_e::IO_URING ? "io_uring" : "epoll");
+	bool ok = true;
+	for (Mode_e m : { Mode_e::COPY, Mode_e::SENDFILE, Mode_e::RELAY, Mode_e::SPLICE }) {
+		if (m == Mode_e::SPLICE && re->GetBackend() == PollerBackend_e::IO_URING) {
+			continue;
+		}
+		mode = m;
+		double seconds = 0;
+		bool good = fetch(port, expectLen, &hash, &seconds);
+		// everything but this (the client) thread: the server, and the feeder in the relay modes
+		double cpu = cpu_seconds(RUSAGE_SELF) - cpu_seconds(RUSAGE_THREAD);
+		good = fetch(port, expectLen, nullptr, &seconds) && good;
+		cpu = cpu_seconds(RUSAGE_SELF) - cpu_seconds(RUSAGE_THREAD) - cpu;
+		ok = ok && good;
+		fprintf(stderr, "%-12s %8.1f MB/s  server cpu %6.1f ms/GB  %s\n", kModeNames[static_cast<int>(m)],
+			sizeMb / seconds, cpu * 1000 * 1024 / sizeMb, good ? "ok" : "CORRUPT");
+	}
+	return ok ? 0 : 1;
+}
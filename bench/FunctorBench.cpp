@@ -0,0 +1,77 @@
+// Cross-thread Reactor::PushFunctor latency and throughput.
+//   ./bench/FunctorBench [round_trips] [producers] [functors_per_producer]
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include "ReactorThread.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static double percentile(std::vector<double>& v, double p)
+{
+	size_t idx = static_cast<size_t>(p / 100.0 * (v.size() - 1));
+	std::nth_element(v.begin(), v.begin() + idx, v.end());
+	return v[idx];
+}
+
+// one functor in flight at a time: the reactor sleeps in epoll_wait before every push
+static void latency(SpReactor re, int rounds)
+{
+	std::vector<double> us;
+	us.reserve(rounds);
+	std::atomic<bool> done(false);
+	for (int i = 0; i < rounds; i++) {
+		done.store(false);
+		auto start = Clock::now();
+		re->PushFunctor([&us, &done, start]() {
+			us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+			done.store(true, std::memory_order_release);
+		});
+		while (!done.load(std::memory_order_acquire)) {
+			std::this_thread::yield();
+		}
+	}
+	double p50 = percentile(us, 50), p99 = percentile(us, 99), max = *std::max_element(us.begin(), us.end());
+	fprintf(stderr, "latency    rounds %d  p50 %.1fus  p99 %.1fus  max %.1fus\n", rounds, p50, p99, max);
+}
+
+static void throughput(SpReactor re, int producers, int perProducer)
+{
+	std::atomic<long> executed(0);
+	long total = static_cast<long>(producers) * perProducer;
+	auto start = Clock::now();
+	std::vector<std::thread> threads;
+	for (int p = 0; p < producers; p++) {
+		threads.emplace_back([re, perProducer, &executed]() {
+			for (int i = 0; i < perProducer; i++) {
+				re->PushFunctor([&executed]() { executed.fetch_add(1, std::memory_order_relaxed); });
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	double pushSec = std::chrono::duration<double>(Clock::now() - start).count();
+	while (executed.load(std::memory_order_relaxed) < total) {
+		std::this_thread::yield();
+	}
+	double sec = std::chrono::duration<double>(Clock::now() - start).count();
+	fprintf(stderr, "throughput producers %d  functors %ld  push %.2f Mops/s  executed %.2f Mops/s\n",
+		producers, total, total / pushSec / 1e6, total / sec / 1e6);
+}
+
+int main(int argc, char* argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 20000;
+	int producers = argc > 2 ? atoi(argv[2]) : 4;
+	int perProducer = argc > 3 ? atoi(argv[3]) : 250000;
+
+	SpReactorThread thrd = CreateSpReactorThread("bench_reactor");
+	thrd->Open();
+	sleep_ms(100);
+	latency(thrd->Reactor(), rounds);
+	throughput(thrd->Reactor(), producers, perProducer);
+	thrd->Close();
+	return 0;
+}
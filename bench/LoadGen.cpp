@@ -0,0 +1,344 @@
+// Loopback load generator for ./mini (or anything that answers each request with the
+// same number of bytes). With -f the requests are framed by that codec, to match a
+// ./mini started with the same -f. Every thread drives its share of the connections from its own
+// epoll loop, nonblocking, with up to `depth` requests pipelined per connection.
+//   closed loop (default): a connection sends its next request as soon as one completes
+//   open loop (-r rate):   requests go out on a fixed schedule whatever the server does,
+//                          latency is measured from the scheduled time so a stalled
+//                          server shows up in the tail instead of slowing the senders down
+//   ./bench/LoadGen [-p port] [-c connections] [-t threads] [-s size] [-d depth]
+//                   [-r total_rate] [-D seconds] [-w warmup_seconds] [-m max_p99_us]
+//                   [-f len|len2|len1|line|crlf|fixed:N]
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include "Histogram.hpp"
+#include "Codec.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+struct LoadConfig
+{
+	int port = 12222;
+	int conns = 16;
+	int threads = 1;
+	size_t size = 64;			// payload bytes per request
+	std::string codec;
+	std::string request;		// one encoded request
+	size_t wire = 0;			// its size, responses are as long
+	int depth = 1;
+	double rate = 0;			// requests/s over all connections, 0 for closed loop
+	int seconds = 5;
+	int warmup = 1;
+	double maxP99Us = 0;		// exit status 2 when p99 exceeds it, 0 to disable
+};
+
+struct LoadConn
+{
+	int fd = -1;
+	bool wantOut = false;
+	size_t unsent = 0;					// bytes of queued requests not yet written
+	size_t sendOffset = 0;				// where in its request the next byte to write is
+	size_t received = 0;				// bytes of the response in progress
+	std::deque<Clock::time_point> sent;	// start time of every request in flight
+	Clock::time_point next;				// open loop: when the next request is due
+};
+
+struct LoadResult
+{
+	Histogram latency;					// ns
+	uint64_t requests = 0;
+	uint64_t errors = 0;
+};
+
+static const size_t kMaxOpenLoopBacklog = 1 << 16;
+static std::atomic<bool> measuring(false);
+static std::atomic<bool> stopping(false);
+
+static int connect_loopback(int port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+		fprintf(stderr, "connect 127.0.0.1:%d error = %s\n", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+static void update_interest(int ep, LoadConn& conn)
+{
+	bool wantOut = conn.unsent > 0;
+	if (wantOut == conn.wantOut) {
+		return;
+	}
+	epoll_event evt{};
+	evt.events = EPOLLIN | (wantOut ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+	evt.data.ptr = &conn;
+	epoll_ctl(ep, EPOLL_CTL_MOD, conn.fd, &evt);
+	conn.wantOut = wantOut;
+}
+
+// false when the connection broke
+static bool flush_conn(LoadConn& conn, const LoadConfig& cfg, const std::string& payload)
+{
+	// payload holds whole requests back to back, a write may start at any offset below one request
+	while (conn.unsent > 0) {
+		size_t len = std::min(conn.unsent, payload.size() - conn.sendOffset);
+		ssize_t n = send(conn.fd, payload.data() + conn.sendOffset, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			return errno == EAGAIN || errno == EINTR;
+		}
+		conn.unsent -= n;
+		conn.sendOffset = (conn.sendOffset + n) % cfg.wire;
+	}
+	return true;
+}
+
+static bool read_conn(LoadConn& conn, const LoadConfig& cfg, LoadResult& result, std::vector<char>& scratch)
+{
+	while (true) {
+		ssize_t n = recv(conn.fd, scratch.data(), scratch.size(), 0);
+		if (n == 0) {
+			return false;
+		}
+		if (n < 0) {
+			return errno == EAGAIN || errno == EINTR;
+		}
+		conn.received += n;
+		if (conn.received < cfg.wire) {
+			continue;
+		}
+		Clock::time_point now = Clock::now();
+		bool record = measuring.load(std::memory_order_relaxed);
+		while (conn.received >= cfg.wire && !conn.sent.empty()) {
+			if (record) {
+				uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - conn.sent.front()).count();
+				result.latency.Record(ns);
+				result.requests++;
+			}
+			conn.sent.pop_front();
+			conn.received -= cfg.wire;
+		}
+	}
+}
+
+static void queue_requests(LoadConn& conn, const LoadConfig& cfg, Clock::duration interval, Clock::time_point now)
+{
+	if (cfg.rate <= 0) {
+		while (static_cast<int>(conn.sent.size()) < cfg.depth) {
+			conn.sent.push_back(now);
+			conn.unsent += cfg.wire;
+		}
+		return;
+	}
+	while (conn.next <= now && conn.sent.size() < kMaxOpenLoopBacklog) {
+		conn.sent.push_back(conn.next);
+		conn.unsent += cfg.wire;
+		conn.next += interval;
+	}
+}
+
+static void drive(const LoadConfig& cfg, int conns, double rate, LoadResult* result)
+{
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	std::vector<LoadConn> pool(conns);
+	std::string payload;
+	while (payload.size() < 64 * 1024) {
+		payload += cfg.request;
+	}
+	std::vector<char> scratch(64 * 1024);
+	Clock::duration interval = rate > 0 ?
+		std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(conns / rate)) : Clock::duration(0);
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < conns; i++) {
+		LoadConn& conn = pool[i];
+		conn.fd = connect_loopback(cfg.port);
+		if (conn.fd < 0) {
+			result->errors++;
+			continue;
+		}
+		// spread the open loop schedule so the connections don't fire in lockstep
+		conn.next = start + interval * i / conns;
+		epoll_event evt{};
+		evt.events = EPOLLIN;
+		evt.data.ptr = &conn;
+		epoll_ctl(ep, EPOLL_CTL_ADD, conn.fd, &evt);
+	}
+
+	epoll_event events[64];
+	while (!stopping.load(std::memory_order_relaxed)) {
+		Clock::time_point now = Clock::now();
+		Clock::time_point due = now + std::chrono::milliseconds(10);
+		for (auto& conn : pool) {
+			if (conn.fd < 0) {
+				continue;
+			}
+			queue_requests(conn, cfg, interval, now);
+			if (!conn.wantOut && !flush_conn(conn, cfg, payload)) {
+				result->errors++;
+				close(conn.fd);
+				conn.fd = -1;
+				continue;
+			}
+			update_interest(ep, conn);
+			if (rate > 0) {
+				due = std::min(due, conn.next);
+			}
+		}
+		// the open loop schedule is finer than epoll_wait's ms, a rounded down timeout would spin
+		long long waitNs = std::max<long long>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(due - now).count());
+		timespec timeout = { static_cast<time_t>(waitNs / 1000000000), static_cast<long>(waitNs % 1000000000) };
+		int n = epoll_pwait2(ep, events, 64, &timeout, nullptr);
+		for (int i = 0; i < n; i++) {
+			LoadConn& conn = *static_cast<LoadConn*>(events[i].data.ptr);
+			bool ok = true;
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+				ok = read_conn(conn, cfg, *result, scratch);
+			}
+			if (ok && (events[i].events & EPOLLOUT)) {
+				ok = flush_conn(conn, cfg, payload);
+			}
+			if (!ok) {
+				result->errors++;
+				epoll_ctl(ep, EPOLL_CTL_DEL, conn.fd, nullptr);
+				close(conn.fd);
+				conn.fd = -1;
+			}
+		}
+	}
+	for (auto& conn : pool) {
+		if (conn.fd >= 0) {
+			close(conn.fd);
+		}
+	}
+	close(ep);
+}
+
+static void usage(const char* prog)
+{
+	printf("usage: %s [-p port] [-c connections] [-t threads] [-s size] [-d depth] [-r total_rate] [-D seconds] [-w warmup_seconds] [-m max_p99_us] [-f len|len2|len1|line|crlf|fixed:N]\n", prog);
+}
+
+int main(int argc, char* argv[])
+{
+	LoadConfig cfg;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:c:t:s:d:r:D:w:m:f:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			cfg.port = atoi(optarg);
+			break;
+		case 'c':
+			cfg.conns = std::max(1, atoi(optarg));
+			break;
+		case 't':
+			cfg.threads = std::max(1, atoi(optarg));
+			break;
+		case 's':
+			cfg.size = static_cast<size_t>(std::max(1, atoi(optarg)));
+			break;
+		case 'd':
+			cfg.depth = std::max(1, atoi(optarg));
+			break;
+		case 'r':
+			cfg.rate = atof(optarg);
+			break;
+		case 'D':
+			cfg.seconds = std::max(1, atoi(optarg));
+			break;
+		case 'w':
+			cfg.warmup = std::max(0, atoi(optarg));
+			break;
+		case 'm':
+			cfg.maxP99Us = atof(optarg);
+			break;
+		case 'f':
+			cfg.codec = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	cfg.threads = std::min(cfg.threads, cfg.conns);
+	std::string body(cfg.size, 'x');
+	if (cfg.codec.empty()) {
+		cfg.request = body;
+	}
+	else {
+		SpCodec codec = CreateSpCodec(cfg.codec);
+		if (!codec) {
+			usage(argv[0]);
+			return 1;
+		}
+		// the delimiter must not show up inside the payload, 'x' never does
+		Buffer frame;
+		if (!codec->Encode(frame, body.data(), body.size())) {
+			fprintf(stderr, "-s %zu does not fit a %s frame\n", cfg.size, cfg.codec.c_str());
+			return 1;
+		}
+		cfg.request = frame.RetrieveAllAsString();
+	}
+	cfg.wire = cfg.request.size();
+
+	std::vector<LoadResult> results(cfg.threads);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < cfg.threads; i++) {
+		int conns = cfg.conns / cfg.threads + (i < cfg.conns % cfg.threads ? 1 : 0);
+		double rate = cfg.rate * conns / cfg.conns;
+		threads.emplace_back(drive, std::cref(cfg), conns, rate, &results[i]);
+	}
+	sleep(cfg.warmup);
+	measuring.store(true);
+	Clock::time_point start = Clock::now();
+	sleep(cfg.seconds);
+	measuring.store(false);
+	double sec = std::chrono::duration<double>(Clock::now() - start).count();
+	stopping.store(true);
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	LoadResult total;
+	for (auto& r : results) {
+		total.latency.Merge(r.latency);
+		total.requests += r.requests;
+		total.errors += r.errors;
+	}
+	const Histogram& h = total.latency;
+	double p99 = h.Percentile(99) / 1e3;
+	printf("%s loop  conns %d  threads %d  size %zuB  depth %d",
+		cfg.rate > 0 ? "open" : "closed", cfg.conns, cfg.threads, cfg.wire, cfg.depth);
+	if (!cfg.codec.empty()) {
+		printf("  codec %s", cfg.codec.c_str());
+	}
+	if (cfg.rate > 0) {
+		printf("  target %.0f req/s", cfg.rate);
+	}
+	printf("\n%.0f req/s  %.1f MB/s  %llu requests  %llu errors\n",
+		total.requests / sec, total.requests * 2.0 * cfg.wire / sec / 1e6,
+		static_cast<unsigned long long>(total.requests), static_cast<unsigned long long>(total.errors));
+	printf("latency us  min %.1f  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+		h.Min() / 1e3, h.Mean() / 1e3, h.Percentile(50) / 1e3, h.Percentile(90) / 1e3,
+		p99, h.Percentile(99.9) / 1e3, h.Max() / 1e3);
+	if (total.errors > 0 || total.requests == 0) {
+		return 1;
+	}
+	if (cfg.maxP99Us > 0 && p99 > cfg.maxP99Us) {
+		fprintf(stderr, "p99 %.1fus over the %.1fus limit\n", p99, cfg.maxP99Us);
+		return 2;
+	}
+	return 0;
+}
@@ -0,0 +1,153 @@
+// MiniThread scheduling: worker add/remove latency, fairness and latency coupling
+// between reactors sharing one thread.
+//   ./bench/SchedulerBench [rounds] [reactors] [busy_us]
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <semaphore.h>
+#include "ReactorThread.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static double percentile(std::vector<double>& v, double p)
+{
+	size_t idx = static_cast<size_t>(p / 100.0 * (v.size() - 1));
+	std::nth_element(v.begin(), v.begin() + idx, v.end());
+	return v[idx];
+}
+
+static void spin_us(int us)
+{
+	auto end = Clock::now() + std::chrono::microseconds(us);
+	while (Clock::now() < end) {
+	}
+}
+
+// push a functor and wait until it ran, returns the round trip in us.
+// Blocks instead of spinning so that on few cores the waiting thread doesn't compete with the reactors.
+static double ping(SpReactor re)
+{
+	sem_t done;
+	sem_init(&done, 0, 0);
+	auto start = Clock::now();
+	re->PushFunctor([&done]() { sem_post(&done); });
+	while (sem_wait(&done) != 0) {
+	}
+	sem_destroy(&done);
+	return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+static void report(const char* name, std::vector<double>& us)
+{
+	double p50 = percentile(us, 50), p99 = percentile(us, 99), max = *std::max_element(us.begin(), us.end());
+	fprintf(stderr, "%-22s rounds %zu  p50 %.1fus  p99 %.1fus  max %.1fus\n", name, us.size(), p50, p99, max);
+}
+
+// a worker joining a thread whose only reactor is blocked in epoll_wait
+static void addRemove(int rounds)
+{
+	SpThread thrd = CreateSpThread();
+	SpReactor idle = CreateSpReactor("idle");
+	SpReactor guest = CreateSpReactor("guest");
+	thrd->AddWorker(idle);
+	ping(idle);
+	std::vector<double> addUs, delUs;
+	for (int i = 0; i < rounds; i++) {
+		sleep_ms(1);
+		auto start = Clock::now();
+		thrd->AddWorker(guest);
+		ping(guest);
+		addUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+		start = Clock::now();
+		thrd->DelWorker(guest);
+		delUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+	}
+	report("add until running", addUs);
+	report("remove", delUs);
+	thrd->DelWorker(idle);
+}
+
+// every reactor keeps re-pushing a busy functor, the thread should split its time evenly
+static void fairness(int reactors, int busyUs)
+{
+	SpThread thrd = CreateSpThread();
+	std::vector<SpReactor> res;
+	std::vector<std::atomic<long>> counts(reactors);
+	std::atomic<bool> stop(false);
+	std::vector<std::function<void(void)>> loops(reactors);
+	for (int i = 0; i < reactors; i++) {
+		res.push_back(CreateSpReactor("fair_" + std::to_string(i)));
+		counts[i] = 0;
+		SpReactor re = res[i];
+		std::atomic<long>* count = &counts[i];
+		std::function<void(void)>* loop = &loops[i];
+		loops[i] = [re, count, loop, &stop, busyUs]() {
+			if (stop.load(std::memory_order_relaxed)) {
+				return;
+			}
+			spin_us(busyUs);
+			count->fetch_add(1, std::memory_order_relaxed);
+			re->PushFunctor(*loop);
+		};
+		thrd->AddWorker(re);
+	}
+	for (int i = 0; i < reactors; i++) {
+		res[i]->PushFunctor(loops[i]);
+	}
+	sleep_ms(1000);
+	stop.store(true);
+	long minCount = counts[0], maxCount = counts[0];
+	fprintf(stderr, "fairness %d reactors, %dus functors:", reactors, busyUs);
+	for (int i = 0; i < reactors; i++) {
+		long c = counts[i];
+		minCount = std::min(minCount, c);
+		maxCount = std::max(maxCount, c);
+		fprintf(stderr, " %ld", c);
+	}
+	fprintf(stderr, "  min/max %.2f\n", maxCount ? static_cast<double>(minCount) / maxCount : 0.0);
+	for (auto& re : res) {
+		thrd->DelWorker(re);
+	}
+}
+
+// an idle reactor sharing its thread with a busy one only waits for one busy iteration
+static void coupling(int rounds, int busyUs)
+{
+	SpThread thrd = CreateSpThread();
+	SpReactor busy = CreateSpReactor("busy");
+	SpReactor quiet = CreateSpReactor("quiet");
+	thrd->AddWorker(busy);
+	thrd->AddWorker(quiet);
+	std::atomic<bool> stop(false);
+	std::function<void(void)> loop = [&]() {
+		if (stop.load(std::memory_order_relaxed)) {
+			return;
+		}
+		spin_us(busyUs);
+		busy->PushFunctor(loop);
+	};
+	busy->PushFunctor(loop);
+	std::vector<double> us;
+	for (int i = 0; i < rounds; i++) {
+		us.push_back(ping(quiet));
+	}
+	stop.store(true);
+	char name[64];
+	snprintf(name, sizeof(name), "beside %dus busy", busyUs);
+	report(name, us);
+	thrd->DelWorker(busy);
+	thrd->DelWorker(quiet);
+}
+
+int main(int argc, char* argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+	int reactors = argc > 2 ? atoi(argv[2]) : 4;
+	int busyUs = argc > 3 ? atoi(argv[3]) : 50;
+
+	addRemove(rounds);
+	fairness(reactors, busyUs);
+	coupling(rounds, busyUs);
+	return 0;
+}
@@ -0,0 +1,89 @@
+// The uppercasing echo of ./mini written as a coroutine, to compare with the callbacks.
+//   ./coro/CoEcho [-p port] [-t sub_reactor_num] [-u]
+#include <semaphore.h>
+#include <signal.h>
+#include <algorithm>
+#include <getopt.h>
+#include "ReactorThreadPool.hpp"
+#include "Coroutine.hpp"
+
+static sem_t sem;
+
+static void signal_handler(int)
+{
+	sem_post(&sem);
+}
+
+static CoTask echo(CoConnection& conn)
+{
+	Buffer buf;
+	while (true) {
+		ssize_t n = co_await conn.ReadSome(buf);
+		if (n <= 0) {
+			break;
+		}
+		buf.ForEachChunk([](char* data, size_t len) {
+			std::transform(data, data + len, data, ::toupper);
+		});
+		if (co_await conn.WriteAll(buf) < 0) {
+			break;
+		}
+	}
+	conn.Close();
+}
+
+static void onConnect(SpChannel chan)
+{
+	SpReactorThreadPool pool = std::static_pointer_cast<ReactorThreadPool>(chan->GetSpPrivData());
+	while (true) {
+		sockaddr_in peer = {};
+		int savedErrno = 0;
+		int fd = chan->Accept(&peer, &savedErrno);
+		if (fd < 0) {
+			if (savedErrno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		SpReactor re = pool->Select(peer);
+		CoServe(re, re->CreateChannel(fd, nullptr, nullptr, nullptr), echo);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int port = 12222;
+	size_t threadNum = 0;
+	PollerBackend_e backend = PollerBackend_e::EPOLL;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:t:uh")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 't':
+			threadNum = static_cast<size_t>(atoi(optarg));
+			break;
+		case 'u':
+			backend = PollerBackend_e::IO_URING;
+			break;
+		default:
+			printf("usage: %s [-p port] [-t sub_reactor_num] [-u]\n", argv[0]);
+			return 1;
+		}
+	}
+	sem_init(&sem, 0, 0);
+	signal(SIGINT, signal_handler);
+
+	SpReactorThreadPool subRes = CreateSpReactorThreadPool("sub_reactor", threadNum, backend);
+	subRes->Open();
+	SpReactorThread mainRe = CreateSpReactorThread("main_reactor", backend);
+	mainRe->Open();
+	SpChannel listenChan = CreateSpChannelListen(port, subRes, onConnect, nullptr);
+	if (!listenChan) {
+		return 1;
+	}
+	mainRe->Reactor()->AddChannel(listenChan, ChannelEvent_e::IN);
+	sem_wait(&sem);
+	return 0;
+}
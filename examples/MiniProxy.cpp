@@ -0,0 +1,342 @@
+// A TCP proxy: every client is paired with a warm connection to the backend from its
+// reactor's BackendPool and the bytes are piped both ways. Each direction stops reading
+// its source while the other side's output is backed up, so a slow reader on either end
+// holds at most kHighWater per direction instead of everything the fast end sends.
+//   ./examples/MiniProxy -b host:port [-p port] [-t sub_reactor_num] [-w warm_per_reactor] [-s] [-u] [-v]
+// -s moves the bytes with splice instead of Recv + Send (epoll only).
+#include <semaphore.h>
+#include <signal.h>
+#include <poll.h>
+#include <map>
+#include <getopt.h>
+#include "ReactorThreadPool.hpp"
+#include "BackendPool.hpp"
+
+static sem_t sem;
+static bool useSplice = false;
+static std::map<Reactor*, SpBackendPool> pools;		// one per sub reactor, filled before the listener opens
+static const size_t kHighWater = 256 * 1024;
+static const int kClient = 0;
+static const int kBackend = 1;
+
+static void signal_handler(int)
+{
+	sem_post(&sem);
+}
+
+/*
+ * A client and its backend connection. Side i reads _chan[i] into _chan[1 - i]. A FIN is
+ * passed on once what came before it went out, the session ends when both directions are
+ * shut or either side fails.
+ */
+class Session : noncopyable
+{
+public:
+	Session(Reactor* re, SpChannel client, SpChannel backend);
+	void Start(const std::shared_ptr<Session>& self);
+	void OnRead(int from);
+	void OnSend(int to);
+private:
+	void pump(int from);
+	void checkHangup(int from);
+	void pause(int from);
+	void peerClosed(int from);
+	void shutWrite(int to);
+	void close();
+private:
+	Reactor* _reactor;
+	SpChannel _chan[2];
+	bool _paused[2];		// not reading _chan[i] until _chan[1 - i] drained
+	bool _eof[2];			// _chan[i] sent its FIN
+	bool _shut[2];			// _chan[i] got it passed on
+	bool _splice;
+	bool _closed;
+};
+
+// handler of one of the session's channels; the channels keep the session alive
+class Side : public ChannelHandler<Side>
+{
+public:
+	Side(std::shared_ptr<Session> session, int index) : _session(std::move(session)), _index(index) {}
+	void OnRead(Channel&) { _session->OnRead(_index); }
+	void OnSend(Channel&) { _session->OnSend(_index); }
+private:
+	std::shared_ptr<Session> _session;
+	int _index;
+};
+
+Session::Session(Reactor* re, SpChannel client, SpChannel backend) :
+	_reactor(re),
+	_paused{ false, false },
+	_eof{ false, false },
+	_shut{ false, false },
+	_splice(useSplice),
+	_closed(false)
+{
+	_chan[kClient] = std::move(client);
+	_chan[kBackend] = std::move(backend);
+}
+
+void Session::Start(const std::shared_ptr<Session>& self)
+{
+	for (int i : { kClient, kBackend }) {
+		_chan[i]->SetHandler(std::make_shared<Side>(self, i));
+	}
+	_reactor->AddChannel(_chan[kClient], ChannelEvent_e::IN);
+	_reactor->EnableEvents(_chan[kBackend], ChannelEvent_e::IN);
+}
+
+void Session::OnRead(int from)
+{
+	if (_closed) {
+		return;
+	}
+	if (_paused[from] || _eof[from]) {
+		checkHangup(from);
+		return;
+	}
+	pump(from);
+}
+
+// IN is off on this side, but the poller still reports errors and hangups: a reset or a
+// peer gone both ways ends the session, a level triggered poller would report it forever
+void Session::checkHangup(int from)
+{
+	pollfd p = { _chan[from]->GetSocket(), 0, 0 };
+	if (poll(&p, 1, 0) > 0 && (p.revents & (POLLERR | POLLHUP))) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(p.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		minilog(LogLevel_e::DEBUG, "fd = %d hung up while not read: %s", p.fd, err ? strerror(err) : "closed");
+		close();
+	}
+}
+
+// moves what _chan[from] has into the other side's output until it runs dry or backs up
+void Session::pump(int from)
+{
+	Channel& src = *_chan[from];
+	Channel& dst = *_chan[1 - from];
+	while (true) {
+		int savedErrno = 0;
+		ssize_t n = -1;
+		if (_splice) {
+			n = dst.SpliceFrom(src, kHighWater, &savedErrno);
+			if (n < 0 && savedErrno == EOPNOTSUPP) {
+				_splice = false;
+				continue;
+			}
+		}
+		else if (dst.GetSendBuffer().ReadableBytes() < kHighWater) {
+			n = src.Recv(&savedErrno);
+			if (n > 0) {
+				dst.Send(src.GetRecvBuffer());
+			}
+		}
+		else {
+			savedErrno = ENOBUFS;
+		}
+		if (n > 0 || (n < 0 && savedErrno == EINTR)) {
+			continue;
+		}
+		if (n == 0) {
+			peerClosed(from);
+		}
+		else if (savedErrno == ENOBUFS) {
+			pause(from);
+		}
+		else if (savedErrno != EAGAIN && savedErrno != EWOULDBLOCK) {
+			minilog(LogLevel_e::DEBUG, "fd = %d read error: %s", src.GetSocket(), strerror(savedErrno));
+			close();
+		}
+		return;
+	}
+}
+
+// the other side is behind: stop reading this one until its output went out
+void Session::pause(int from)
+{
+	_paused[from] = true;
+	_reactor->DisableEvents(_chan[from], ChannelEvent_e::IN);
+	_reactor->EnableEvents(_chan[1 - from], ChannelEvent_e::OUT);
+}
+
+void Session::peerClosed(int from)
+{
+	_eof[from] = true;
+	// a level triggered poller keeps reporting the EOF
+	_reactor->DisableEvents(_chan[from], ChannelEvent_e::IN);
+	int to = 1 - from;
+	if (_chan[to]->HasOutput()) {
+		// passed on from OnSend once the rest went out
+		_reactor->EnableEvents(_chan[to], ChannelEvent_e::OUT);
+	}
+	else {
+		shutWrite(to);
+	}
+}
+
+void Session::shutWrite(int to)
+{
+	if (_shut[to]) {
+		return;
+	}
+	_shut[to] = true;
+	shutdown(_chan[to]->GetSocket(), SHUT_WR);
+	if (_shut[kClient] && _shut[kBackend]) {
+		close();
+	}
+}
+
+void Session::OnSend(int to)
+{
+	Channel& dst = *_chan[to];
+	while (dst.HasOutput() && !_closed) {
+		int savedErrno = 0;
+		ssize_t n = dst.Flush(&savedErrno);
+		if (n > 0 || (n < 0 && savedErrno == EINTR)) {
+			continue;
+		}
+		if (n < 0 && savedErrno != EAGAIN && savedErrno != EWOULDBLOCK) {
+			minilog(LogLevel_e::DEBUG, "fd = %d write error: %s", dst.GetSocket(), strerror(savedErrno));
+			close();
+		}
+		break;
+	}
+	if (_closed || dst.HasOutput()) {
+		return;
+	}
+	_reactor->DisableEvents(_chan[to], ChannelEvent_e::OUT);
+	int from = 1 - to;
+	if (_eof[from]) {
+		shutWrite(to);
+	}
+	else if (_paused[from]) {
+		_paused[from] = false;
+		_reactor->EnableEvents(_chan[from], ChannelEvent_e::IN);
+		// under io_uring what was received while paused is not reported again
+		pump(from);
+	}
+}
+
+void Session::close()
+{
+	if (_closed) {
+		return;
+	}
+	_closed = true;
+	// the channels own the session through their handlers, this breaks the cycle
+	for (auto& chan : _chan) {
+		_reactor->DelChannel(chan);
+		chan = nullptr;
+	}
+}
+
+static void startSession(const SpReactor& re, int fd, SpChannel backend)
+{
+	if (!backend) {
+		minilog(LogLevel_e::WARRNIG, "[%s] no backend connection, client fd = %d closed", re->GetName().c_str(), fd);
+		::close(fd);
+		return;
+	}
+	auto session = std::make_shared<Session>(re.get(), re->CreateChannel(fd, nullptr, nullptr, nullptr), backend);
+	session->Start(session);
+}
+
+static void onConnect(SpChannel chan)
+{
+	SpReactorThreadPool subRes = std::static_pointer_cast<ReactorThreadPool>(chan->GetSpPrivData());
+	while (true) {
+		sockaddr_in peer = {};
+		int savedErrno = 0;
+		int fd = chan->Accept(&peer, &savedErrno);
+		if (fd < 0) {
+			if (savedErrno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		// the client is read only once its backend connection is there
+		SpReactor re = subRes->Select(peer);
+		re->PushFunctor([re, fd]() {
+			// shared by all sub reactors, only read once filled: at(), never operator[]
+			pools.at(re.get())->Acquire([re, fd](SpChannel backend) { startSession(re, fd, backend); });
+		});
+	}
+}
+
+static void usage(const char* prog)
+{
+	printf("usage: %s -b host:port [-p port] [-t sub_reactor_num] [-w warm_per_reactor] [-s] [-u] [-v]\n", prog);
+}
+
+int main(int argc, char* argv[])
+{
+	int port = 12300;
+	size_t threadNum = 0;
+	size_t warm = 8;
+	const char* backendAddr = nullptr;
+	PollerBackend_e backend = PollerBackend_e::EPOLL;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:p:t:w:suvh")) != -1) {
+		switch (opt) {
+		case 'b':
+			backendAddr = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 't':
+			threadNum = static_cast<size_t>(atoi(optarg));
+			break;
+		case 'w':
+			warm = static_cast<size_t>(atoi(optarg));
+			break;
+		case 's':
+			useSplice = true;
+			break;
+		case 'u':
+			backend = PollerBackend_e::IO_URING;
+			break;
+		case 'v':
+			Logger::SetLevel(LogLevel_e::DEBUG);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	sockaddr_in addr;
+	if (!backendAddr || !ParseAddress(backendAddr, &addr)) {
+		usage(argv[0]);
+		return 1;
+	}
+	sem_init(&sem, 0, 0);
+	signal(SIGINT, signal_handler);
+
+	SpReactorThreadPool subRes = CreateSpReactorThreadPool("sub_reactor", threadNum, backend);
+	subRes->Open();
+	for (auto& re : subRes->Reactors()) {
+		SpBackendPool pool = CreateSpBackendPool(re, addr, warm);
+		pools[re.get()] = pool;
+		pool->Start();
+	}
+	SpReactorThread mainRe = CreateSpReactorThread("main_reactor", backend);
+	mainRe->Open();
+	SpChannel listenChan = CreateSpChannelListen(port, subRes, onConnect, nullptr);
+	if (!listenChan) {
+		return 1;
+	}
+	mainRe->Reactor()->AddChannel(listenChan, ChannelEvent_e::IN);
+	minilog(LogLevel_e::INFO, "proxying port %d to %s, %d warm connections per reactor", port,
+		FormatAddress(addr).c_str(), static_cast<int>(warm));
+
+	sem_wait(&sem);
+	for (auto& entry : pools) {
+		BackendPoolStats stats = entry.second->GetStats();
+		printf("[%s] warm hits %llu, misses %llu (failed %llu), idle dropped %llu\n", entry.first->GetName().c_str(),
+			static_cast<unsigned long long>(stats.hits), static_cast<unsigned long long>(stats.misses),
+			static_cast<unsigned long long>(stats.failed), static_cast<unsigned long long>(stats.dropped));
+	}
+	return 0;
+}
@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <memory>
+#include <stdint.h>
 // net
 #include <arpa/inet.h>	// ip
 #include <sys/socket.h> // tcp/udp
@@ -18,6 +19,14 @@
 #include <sys/epoll.h>	// epoll
 
 #define sleep_ms(x) usleep(x * 1000)
+
+static inline uint64_t monotonic_ms()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
 class noncopyable
 {
  public: